@@ -0,0 +1,66 @@
+/* Multi-threaded string allocation benchmark: every thread builds and
+ * flattens strings the way SADD/I2S/PRINT do, through its own allocator.
+ *
+ *   bench_alloc [heap|arena] [threads] [rounds]
+ */
+#define _POSIX_C_SOURCE 200809L // clock_gettime, fdopen
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "vm_strings.h"
+
+static const int PIECES = 1000;	// per string built
+
+static bool use_arena = true;
+static int rounds = 2000;
+
+static void *worker(void *arg) {
+	Allocator heap = heap_allocator;	// private copy so stats don't race
+	Allocator *a = use_arena ? arena_new(ARENA_CHUNK_SIZE) : &heap;
+	size_t total = 0;
+	for (int r = 0; r < rounds; r++) {
+		String *s = String_new(a, "");
+		for (int i = 0; i < PIECES; i++) {
+			String *c = String_from_int(a, i);
+			String *u = String_add(a, s, c);
+			String_free(c);
+			String_free(s);
+			s = u;
+		}
+		total += strlen(String_str(s));
+		String_free(s);
+		a->release(a);					// what vm_reset() does between runs
+	}
+	size_t *n = arg;
+	*n = a->allocations + (total == 0);
+	if ( use_arena ) a->destroy(a);
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	int nthreads = 4;
+	if ( argc > 1 ) use_arena = strcmp(argv[1], "heap") != 0;
+	if ( argc > 2 ) nthreads = atoi(argv[2]);
+	if ( argc > 3 ) rounds = atoi(argv[3]);
+
+	pthread_t threads[nthreads];
+	size_t allocs[nthreads];
+	struct timespec start, stop;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < nthreads; i++) pthread_create(&threads[i], NULL, worker, &allocs[i]);
+	for (int i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	double secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	size_t total = 0;
+	for (int i = 0; i < nthreads; i++) total += allocs[i];
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("%s threads=%d allocations=%zu secs=%.3f allocs/sec=%.0f maxrss_kb=%ld\n",
+		   use_arena ? "arena" : "heap", nthreads, total, secs, total / secs, usage.ru_maxrss);
+	return 0;
+}
@@ -0,0 +1,82 @@
+/* SPMD benchmark: fib(k) for N arguments spread over 0..K with
+ * vm_batch() on the scalar engine, the generic lane loop and the AVX2
+ * one.
+ *
+ *   bench_batch [inputs] [max k] [trials]
+ */
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vm.h"
+#include "loader.h"
+#include "batch.h"
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static char *FIB =
+	"0 strings\n"
+	"2 functions maxaddr=6\n"
+	"	0: 4/main\n"
+	"	6: 3/fib\n"
+	"18 instr, 58 bytes\n"
+	"	ICONST 0\n"
+	"	HALT\n"
+	"	LOAD 0\n"
+	"	ICONST 2\n"
+	"	ILT\n"
+	"	BRF 24\n"
+	"	LOAD 0\n"
+	"	RET\n"
+	"	LOAD 0\n"
+	"	ICONST 1\n"
+	"	ISUB\n"
+	"	CALL 6, 1\n"
+	"	LOAD 0\n"
+	"	ICONST 2\n"
+	"	ISUB\n"
+	"	CALL 6, 1\n"
+	"	IADD\n"
+	"	RET\n";
+
+int main(int argc, char *argv[]) {
+	int n = argc > 1 ? atoi(argv[1]) : 100000;
+	int k = argc > 2 ? atoi(argv[2]) : 15;
+	int trials = argc > 3 ? atoi(argv[3]) : 3;
+	VM *vm = vm_load_text(FIB, strlen(FIB));
+	int *args = malloc((size_t)n * sizeof(int));
+	int *results = malloc((size_t)n * sizeof(int));
+	for (int i = 0; i < n; i++) args[i] = i % (k + 1);
+
+	const char *names[] = {"scalar", "vector", "avx2"};
+	double scalar = 0;
+	long check = -1;
+	printf("%-10s %10s %10s %10s %10s\n", "engine", "inputs", "ms", "in lanes", "speedup");
+	for (batch_level l = BATCH_SCALAR; l <= BATCH_AVX2; l++) {
+		if ( !batch_use(l) ) continue;
+		double best = 1e9;
+		int in_lanes = 0;
+		for (int t = 0; t < trials; t++) {
+			double start = now();
+			in_lanes = vm_batch(vm, "fib", args, 1, n, results);
+			double elapsed = now() - start;
+			if ( elapsed < best ) best = elapsed;
+		}
+		long sum = 0;
+		for (int i = 0; i < n; i++) sum += results[i];
+		if ( check >= 0 && sum != check ) fprintf(stderr, "%s results differ\n", names[l]);
+		check = sum;
+		if ( l == BATCH_SCALAR ) scalar = best;
+		printf("%-10s %10d %10.1f %10d %9.2fx\n", names[l], n, best * 1e3, in_lanes, scalar / best);
+	}
+	free(args);
+	free(results);
+	vm_free(vm);
+	return 0;
+}
@@ -0,0 +1,72 @@
+/* Host call overhead: add(a, b) called from C with vm_call() on one loaded
+ * VM, against the only way there was before, vm_reset() and vm_exec() of
+ * a main that makes the same call.
+ *
+ *   bench_call [calls] [trials]
+ */
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vm.h"
+#include "loader.h"
+#include "functions.h"
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static char *ADD =
+	"0 strings\n"
+	"2 functions maxaddr=19\n"
+	"	0: 4/main\n"
+	"	19: 3/add\n"
+	"9 instr, 27 bytes\n"
+	"	ICONST 1\n"
+	"	ICONST 2\n"
+	"	CALL 19, 2\n"
+	"	POP\n"
+	"	HALT\n"
+	"	LOAD 0\n"
+	"	LOAD 1\n"
+	"	IADD\n"
+	"	RET\n";
+
+int main(int argc, char *argv[]) {
+	int n = argc > 1 ? atoi(argv[1]) : 10000000;
+	int trials = argc > 2 ? atoi(argv[2]) : 3;
+	VM *vm = vm_load_text(ADD, strlen(ADD));
+	Function *add = function_named(&vm->funcs, "add");
+
+	double call = 1e9, exec = 1e9;
+	long sum = 0;
+	for (int t = 0; t < trials; t++) {
+		double start = now();
+		for (int i = 0; i < n; i++) {
+			element args[2] = {{.type = INT, .i = i}, {.type = INT, .i = 1}}, result;
+			vm_call(vm, add, args, 2, &result);
+			sum += result.i;
+		}
+		double elapsed = now() - start;
+		if ( elapsed < call ) call = elapsed;
+
+		int m = n / 10; // much slower
+		start = now();
+		for (int i = 0; i < m; i++) {
+			vm_reset(vm);
+			vm_exec(vm, false);
+		}
+		elapsed = (now() - start) * n / m;
+		if ( elapsed < exec ) exec = elapsed;
+	}
+	vm_free(vm);
+
+	printf("%-16s %10s %10s %10s\n", "entry", "calls", "ns/call", "speedup");
+	printf("%-16s %10d %10.1f %10s\n", "vm_exec", n, exec / n * 1e9, "1.00x");
+	printf("%-16s %10d %10.1f %9.2fx\n", "vm_call", n, call / n * 1e9, exec / call);
+	return sum == 0;
+}
@@ -0,0 +1,75 @@
+/* Compare two bench_ops result files and flag benchmarks whose median
+ * got slower than the baseline by more than a threshold.
+ *
+ *   bench_compare baseline.json current.json [threshold_percent=10]
+ *
+ * Exits 1 if anything regressed. A missing baseline is not an error.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+static const int MAX_RESULTS = 256;
+
+typedef struct {
+	char name[64];
+	double median_ns;
+} Result;
+
+/* bench_ops writes one benchmark object per line */
+static int read_results(const char *filename, Result *results) {
+	FILE *f = fopen(filename, "r");
+	if ( f == NULL ) return -1;
+	char line[1024];
+	int n = 0;
+	while ( n < MAX_RESULTS && fgets(line, sizeof(line), f) != NULL ) {
+		char *name = strstr(line, "\"name\": \"");
+		char *median = strstr(line, "\"median_ns\": ");
+		if ( name == NULL || median == NULL ) continue;
+		sscanf(name + strlen("\"name\": \""), "%63[^\"]", results[n].name);
+		results[n].median_ns = atof(median + strlen("\"median_ns\": "));
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+int main(int argc, char *argv[]) {
+	if ( argc < 3 ) {
+		fprintf(stderr, "usage: %s baseline.json current.json [threshold_percent]\n", argv[0]);
+		return 2;
+	}
+	double threshold = argc > 3 ? atof(argv[3]) : 10.0;
+	Result baseline[MAX_RESULTS], current[MAX_RESULTS];
+	int nbase = read_results(argv[1], baseline);
+	int ncur = read_results(argv[2], current);
+	if ( ncur < 0 ) {
+		perror(argv[2]);
+		return 2;
+	}
+	if ( nbase < 0 ) {
+		printf("no baseline at %s; nothing to compare (make bench_baseline creates one)\n", argv[1]);
+		return 0;
+	}
+
+	int regressions = 0;
+	printf("%-16s %14s %14s %9s\n", "benchmark", "baseline ns", "current ns", "change");
+	for (int i = 0; i < ncur; i++) {
+		Result *base = NULL;
+		for (int j = 0; j < nbase; j++) {
+			if ( strcmp(baseline[j].name, current[i].name) == 0 ) base = &baseline[j];
+		}
+		if ( base == NULL ) {
+			printf("%-16s %14s %14.0f %9s\n", current[i].name, "-", current[i].median_ns, "new");
+			continue;
+		}
+		double change = 100.0 * (current[i].median_ns - base->median_ns) / base->median_ns;
+		bool regressed = change > threshold;
+		regressions += regressed;
+		printf("%-16s %14.0f %14.0f %+8.1f%%%s\n", current[i].name, base->median_ns, current[i].median_ns,
+			   change, regressed ? "  REGRESSION" : "");
+	}
+	if ( regressions > 0 ) printf("%d benchmark(s) regressed by more than %.1f%%\n", regressions, threshold);
+	return regressions > 0;
+}
@@ -0,0 +1,138 @@
+/* Loader benchmark: a generated text program of N instructions (1M by
+ * default) loaded with vm_load() versus the old way, fgets+sscanf per
+ * line and a linear strcmp over vm_instructions[] per mnemonic, and with
+ * the mmap loader vm_load_file() on 1 and on T threads.
+ *
+ *   bench_load [instructions] [trials] [threads=CPUs]
+ */
+#define _POSIX_C_SOURCE 200809L // clock_gettime, mkstemp, fdopen
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "loader.h"
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* a mix of all operand shapes, in a loop so it would also run */
+static const char *BODY[] = {
+	"	LOAD 0\n", "	ICONST 1\n", "	IADD\n", "	STORE 0\n", "	LOAD 0\n",
+	"	ICONST 1000\n", "	ILT\n", "	BRF 0\n", "	SCONST 0\n", "	POP\n",
+	"	CALL 0, 0\n", "	POP\n",
+};
+static const int BODY_BYTES = 3+5+1+3+3+5+1+5+3+1+7+1;
+
+static FILE *generate(int ninstr, size_t *text_size, char *fname) {
+	FILE *f = fdopen(mkstemp(fname), "w+");
+	int nbody = (int)(sizeof(BODY)/sizeof(BODY[0]));
+	int n = ninstr / nbody * nbody;
+	fprintf(f, "1 strings\n   0: 5/hello\n1 functions maxaddr=0\n   0: 4/main\n");
+	fprintf(f, "%d instr, %d bytes\n", n, n / nbody * BODY_BYTES);
+	for (int i = 0; i < n; i++) fputs(BODY[i % nbody], f);
+	*text_size = (size_t)ftell(f);
+	return f;
+}
+
+static VM_INSTRUCTION *linear_instr(char *name) {
+	for (int i = 0; i < NUM_INSTRS; ++i) {
+		if ( strcmp(name, vm_instructions[i].name)==0 ) return &vm_instructions[i];
+	}
+	return NULL;
+}
+
+/* the instruction loop vm_load used to have, minus error reporting */
+static long load_sscanf(FILE *f) {
+	int nstrings, nfuncs, maxaddr, ninstr, nbytes;
+	char line[81];
+	fscanf(f, "%d strings\n", &nstrings);
+	for (int i = 0; i < nstrings; i++) fgets(line, sizeof(line), f);
+	fscanf(f, "%d functions maxaddr=%d\n", &nfuncs, &maxaddr);
+	for (int i = 0; i < nfuncs; i++) fgets(line, sizeof(line), f);
+	fscanf(f, "%d instr, %d bytes\n", &ninstr, &nbytes);
+	byte *code = calloc((size_t)nbytes, 1);
+	addr32 ip = 0;
+	for (int i = 1; i <= ninstr; i++) {
+		char name[80];
+		int opnd1, opnd2;
+		fgets(line, sizeof(line), f);
+		int n = sscanf(line, "%s %d, %d", name, &opnd1, &opnd2);
+		VM_INSTRUCTION *I = linear_instr(name);
+		code[ip++] = I->opcode;
+		if ( n >= 2 ) {
+			if ( I->opnd_sizes[0] == 2 ) *(int16_t *)&code[ip] = (int16_t)opnd1;
+			else *(int32_t *)&code[ip] = opnd1;
+			ip += I->opnd_sizes[0];
+		}
+		if ( n == 3 ) {
+			*(int16_t *)&code[ip] = (int16_t)opnd2;
+			ip += I->opnd_sizes[1];
+		}
+	}
+	long sum = 0;
+	for (addr32 a = 0; a < ip; a++) sum += code[a];
+	free(code);
+	return sum;
+}
+
+int main(int argc, char *argv[]) {
+	int ninstr = argc > 1 ? atoi(argv[1]) : 1000000;
+	int trials = argc > 2 ? atoi(argv[2]) : 5;
+	int nthreads = argc > 3 ? atoi(argv[3]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	size_t size;
+	char fname[] = "/tmp/bench_load_XXXXXX";
+	FILE *f = generate(ninstr, &size, fname);
+	fflush(f);
+
+	double best_old = 1e9, best_new = 1e9, best_mmap1 = 1e9, best_mmapn = 1e9;
+	long check_old = 0, check_new = 0;
+	for (int t = 0; t < trials; t++) {
+		rewind(f);
+		double start = now();
+		check_old = load_sscanf(f);
+		double elapsed = now() - start;
+		if ( elapsed < best_old ) best_old = elapsed;
+
+		rewind(f);
+		start = now();
+		VM *vm = vm_load(f);
+		elapsed = now() - start;
+		if ( elapsed < best_new ) best_new = elapsed;
+		check_new = 0;
+		for (int a = 0; a < vm->code_size; a++) check_new += vm->code[a];
+		vm_free(vm);
+
+		start = now();
+		vm = vm_load_file(fname, 1);
+		elapsed = now() - start;
+		if ( elapsed < best_mmap1 ) best_mmap1 = elapsed;
+		vm_free(vm);
+
+		start = now();
+		vm = vm_load_file(fname, nthreads);
+		elapsed = now() - start;
+		if ( elapsed < best_mmapn ) best_mmapn = elapsed;
+		long check = 0;
+		for (int a = 0; a < vm->code_size; a++) check += vm->code[a];
+		if ( check != check_new ) fprintf(stderr, "parallel code differs\n");
+		vm_free(vm);
+	}
+	fclose(f);
+	remove(fname);
+	if ( check_old != check_new ) fprintf(stderr, "code differs: %ld vs %ld\n", check_old, check_new);
+
+	printf("%-14s %10s %10s %12s %10s\n", "loader", "instrs", "ms", "MB/s", "speedup");
+	printf("%-14s %10d %10.1f %12.1f %10s\n", "fgets+sscanf", ninstr, best_old * 1e3, size / best_old / 1e6, "1.00x");
+	printf("%-14s %10d %10.1f %12.1f %9.2fx\n", "vm_load", ninstr, best_new * 1e3, size / best_new / 1e6, best_old / best_new);
+	printf("%-14s %10d %10.1f %12.1f %9.2fx\n", "mmap x1", ninstr, best_mmap1 * 1e3, size / best_mmap1 / 1e6, best_old / best_mmap1);
+	char label[20];
+	snprintf(label, sizeof(label), "mmap x%d", nthreads);
+	printf("%-14s %10d %10.1f %12.1f %9.2fx\n", label, ninstr, best_mmapn * 1e3, size / best_mmapn / 1e6, best_old / best_mmapn);
+	return check_old != check_new;
+}
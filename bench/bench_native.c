@@ -0,0 +1,75 @@
+/* Native call overhead: a bytecode loop that adds 1 to a sum n times
+ * with IADD inline, with a CALL to a bytecode add(a, b) and with an
+ * NCALL to a host add(a, b). The per-call cost is the time over the
+ * inline loop.
+ *
+ *   bench_native [iterations] [trials]
+ */
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vm.h"
+#include "loader.h"
+#include "natives.h"
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static element add(VM *vm, element *args, int nargs) {
+	return (element) {.type = INT, .i = args[0].i + args[1].i};
+}
+
+/* s = 0; for i < n: s = s <op> 1; print s; then add() at the end */
+static double time_loop(const char *op, int op_size, int n, int trials, char *output) {
+	int k = op_size;
+	char text[2000];
+	snprintf(text, sizeof(text),
+			 "1 strings\n   0: 3/add\n"
+			 "2 functions maxaddr=%d\n   0: 4/main\n   %d: 3/add\n"
+			 "25 instr, %d bytes\n"
+			 "	LOCALS 2\n	ICONST 0\n	STORE 0\n	ICONST 0\n	STORE 1\n"
+			 "	LOAD 0\n	ICONST %d\n	ILT\n	BRF %d\n"
+			 "	LOAD 1\n	ICONST 1\n	%s\n	STORE 1\n"
+			 "	LOAD 0\n	ICONST 1\n	IADD\n	STORE 0\n	BR 19\n"
+			 "	LOAD 1\n	PRINT\n	HALT\n"
+			 "	LOAD 0\n	LOAD 1\n	IADD\n	RET\n",
+			 66 + k, 66 + k, 74 + k, n, 61 + k, op);
+	VM *vm = vm_load_text(text, strlen(text));
+	vm_bind_native(vm, "add", add);
+	double best = 1e9;
+	for (int t = 0; t < trials; t++) {
+		vm_reset(vm);
+		double start = now();
+		vm_exec(vm, false);
+		double elapsed = now() - start;
+		if ( elapsed < best ) best = elapsed;
+	}
+	strcpy(output, vm->output);
+	vm_free(vm);
+	return best;
+}
+
+int main(int argc, char *argv[]) {
+	int n = argc > 1 ? atoi(argv[1]) : 10000000;
+	int trials = argc > 2 ? atoi(argv[2]) : 3;
+	char expected[32], inline_out[32], call_out[32], ncall_out[32];
+	snprintf(expected, sizeof(expected), "%d\n", n);
+
+	char call[32];
+	snprintf(call, sizeof(call), "CALL %d, 2", 66 + 7);
+	double base = time_loop("IADD", 1, n, trials, inline_out);
+	double bytecode = time_loop(call, 7, n, trials, call_out);
+	double native = time_loop("NCALL 0, 2", 7, n, trials, ncall_out);
+
+	printf("%-10s %10s %10s %14s\n", "add", "calls", "ms", "ns/call extra");
+	printf("%-10s %10d %10.1f %14s\n", "inline", n, base * 1e3, "-");
+	printf("%-10s %10d %10.1f %14.2f\n", "CALL", n, bytecode * 1e3, (bytecode - base) / n * 1e9);
+	printf("%-10s %10d %10.1f %14.2f\n", "NCALL", n, native * 1e3, (native - base) / n * 1e9);
+	return strcmp(inline_out, expected) != 0 || strcmp(call_out, expected) != 0 || strcmp(ncall_out, expected) != 0;
+}
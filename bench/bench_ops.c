@@ -0,0 +1,248 @@
+/* Opcode microbenchmarks and macro workloads. Each benchmark is written
+ * in a small assembly dialect (labels, "fn name" entries, symbolic
+ * branch/call targets), assembled into .bytecode text, loaded once and
+ * run warmup+trials times with vm_reset() in between. Results go to a
+ * JSON file for bench_compare.
+ *
+ *   bench_ops [-o results.json] [-t trials] [-w warmup] [-f name-filter]
+ */
+#define _POSIX_C_SOURCE 200809L // clock_gettime, fdopen
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "loader.h"
+#include "memo.h"
+#include "inliner.h"
+#include "jit.h"
+
+typedef struct {
+	char *name;
+	char *init;		// main, before the loop
+	char *body;		// loop body; '$' becomes the repetition number in labels
+	int reps;		// copies of body per iteration
+	char *fini;		// main, after the loop
+	char *funcs;	// other functions
+	int iterations;
+	int memo;		// vm_memo_enable() with this many entries before each run; 0 for none
+	int inline_bytes;	// vm_inline() budget after loading; 0 for none
+	int jit;		// 1: vm_jit_enable() after loading; warmup runs get the loops traced
+} Bench;
+
+static Bench benchmarks[] = {
+	{"int_alu", "",
+		"ICONST 7\nICONST 3\nIADD\nICONST 2\nIMUL\nICONST 5\nISUB\nICONST 3\nIDIV\nINEG\nPOP\n",
+		10, "", "", 20000},
+	{"bool_logic", "",
+		"ICONST 1\nICONST 2\nILT\nICONST 3\nICONST 3\nIEQ\nAND\nNOT\nICONST 0\nICONST 1\nINEQ\nOR\nPOP\n",
+		10, "", "", 20000},
+	{"cmp_branch", "",
+		"LOAD 0\nICONST 5\nILT\nBRF a$\na$:\nLOAD 0\nICONST 3\nIGE\nBRF b$\nb$:\nBR c$\nc$:\n",
+		10, "", "", 20000},
+	{"load_store", "",
+		"LOAD 0\nSTORE 1\nLOAD 1\nSTORE 2\nLOAD 2\nPOP\n",
+		10, "", "", 20000},
+	{"call_ret", "",
+		"ICONST 1\nCALL id, 1\nPOP\n",
+		10, "", "fn id\nLOAD 0\nRET\n", 20000},
+	{"call_locals", "",
+		"ICONST 1\nCALL loc, 1\nPOP\n",
+		10, "", "fn loc\nLOCALS 1\nLOAD 0\nSTORE 1\nLOAD 1\nRET\n", 20000},
+	{"call_inlined", "",
+		"ICONST 1\nCALL loc, 1\nPOP\n",
+		10, "", "fn loc\nLOCALS 1\nLOAD 0\nSTORE 1\nLOAD 1\nRET\n", 20000, 0, 32},
+	{"sum_loop", "ICONST 0\nSTORE 1\n",
+		"LOAD 1\nLOAD 0\nIADD\nSTORE 1\n",
+		10, "", "", 20000},
+	{"sum_loop_jit", "ICONST 0\nSTORE 1\n",
+		"LOAD 1\nLOAD 0\nIADD\nSTORE 1\n",
+		10, "", "", 20000, 0, 0, 1},
+	{"string_ops", "",
+		"SCONST 0\nSCONST 1\nSADD\nSLEN\nPOP\nSCONST 0\nSCONST 1\nSLT\nPOP\nLOAD 0\nI2S\nICONST 1\nSINDEX\nPOP\n",
+		10, "", "", 5000},
+	{"print", "",
+		"LOAD 0\nPRINT\n",
+		1, "", "", 20000},
+	// macro workloads
+	{"fib30", "ICONST 30\nCALL fib, 1\nPRINT\n", NULL, 0, "",
+		"fn fib\n"
+		"LOAD 0\nICONST 0\nIEQ\nLOAD 0\nICONST 1\nIEQ\nOR\nBRF rec\nLOAD 0\nRET\n"
+		"rec:\nLOAD 0\nICONST 1\nISUB\nCALL fib, 1\nLOAD 0\nICONST 2\nISUB\nCALL fib, 1\nIADD\nRET\n", 0},
+	{"fib30_memo", "ICONST 30\nCALL fib, 1\nPRINT\n", NULL, 0, "",
+		"fn fib\n"
+		"LOAD 0\nICONST 0\nIEQ\nLOAD 0\nICONST 1\nIEQ\nOR\nBRF rec\nLOAD 0\nRET\n"
+		"rec:\nLOAD 0\nICONST 1\nISUB\nCALL fib, 1\nLOAD 0\nICONST 2\nISUB\nCALL fib, 1\nIADD\nRET\n", 0, 1024},
+	{"string_build", "SCONST 2\nSTORE 1\n",
+		"LOAD 1\nLOAD 0\nI2S\nSADD\nSTORE 1\n",
+		1, "LOAD 1\nSLEN\nPRINT\n", "", 20000},
+};
+
+static char *strings[] = {"hello", "bye", ""};
+static const int NUM_STRINGS = 3;
+
+static const int MAX_LINES = 4096;
+static const int MAX_LABELS = 512;
+
+/* Expand a benchmark into assembly source */
+static char *bench_source(Bench *b) {
+	size_t size = 4096 + (b->body != NULL ? strlen(b->body) * b->reps * 2 : 0) + strlen(b->funcs);
+	char *src = calloc(size, 1);
+	char *p = src;
+	p += sprintf(p, "fn main\nLOCALS 3\n%s", b->init);
+	if ( b->body != NULL ) {
+		p += sprintf(p, "ICONST 0\nSTORE 0\nloop:\nLOAD 0\nICONST %d\nILT\nBRF done\n", b->iterations);
+		for (int r = 0; r < b->reps; r++) {
+			for (const char *q = b->body; *q; q++) {
+				if ( *q == '$' ) p += sprintf(p, "%d", r);
+				else *p++ = *q;
+			}
+		}
+		p += sprintf(p, "LOAD 0\nICONST 1\nIADD\nSTORE 0\nBR loop\ndone:\n");
+	}
+	p += sprintf(p, "%sHALT\n%s", b->fini, b->funcs);
+	return src;
+}
+
+typedef struct { char name[32]; int addr; bool func; } Label;
+
+static int label_addr(Label *labels, int n, const char *name) {
+	for (int i = 0; i < n; i++) {
+		if ( strcmp(labels[i].name, name) == 0 ) return labels[i].addr;
+	}
+	fprintf(stderr, "undefined label %s\n", name);
+	exit(1);
+}
+
+/* Two passes: lay out addresses from vm_instructions[] operand sizes, then
+ * emit .bytecode text with labels replaced by addresses.
+ */
+static char *assemble(char *src) {
+	char *lines[MAX_LINES];
+	int nlines = 0;
+	for (char *line = strtok(src, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+		lines[nlines++] = line;
+	}
+	Label labels[MAX_LABELS];
+	int nlabels = 0, nfuncs = 0, ninstr = 0, addr = 0, maxaddr = 0;
+	for (int i = 0; i < nlines; i++) {
+		char name[80];
+		sscanf(lines[i], "%79s", name);
+		if ( strncmp(lines[i], "fn ", 3) == 0 ) {
+			sscanf(lines[i] + 3, "%31s", labels[nlabels].name);
+			labels[nlabels].addr = maxaddr = addr;
+			labels[nlabels++].func = true;
+			nfuncs++;
+		}
+		else if ( name[strlen(name)-1] == ':' ) {
+			name[strlen(name)-1] = '\0';
+			strcpy(labels[nlabels].name, name);
+			labels[nlabels].addr = addr;
+			labels[nlabels++].func = false;
+		}
+		else {
+			VM_INSTRUCTION *I = vm_instr(name);
+			addr += 1 + I->opnd_sizes[0] + I->opnd_sizes[1];
+			ninstr++;
+		}
+	}
+
+	char *out = calloc((size_t)nlines * 64 + 1024, 1);
+	char *p = out;
+	p += sprintf(p, "%d strings\n", NUM_STRINGS);
+	for (int i = 0; i < NUM_STRINGS; i++) p += sprintf(p, "\t%d: %d/%s\n", i, (int)strlen(strings[i]), strings[i]);
+	p += sprintf(p, "%d functions maxaddr=%d\n", nfuncs, maxaddr);
+	for (int i = 0; i < nlabels; i++) {
+		if ( labels[i].func ) p += sprintf(p, "\t%d: %d/%s\n", labels[i].addr, (int)strlen(labels[i].name), labels[i].name);
+	}
+	p += sprintf(p, "%d instr, %d bytes\n", ninstr, addr);
+	for (int i = 0; i < nlines; i++) {
+		char name[80], opnd1[80] = "", opnd2[80] = "";
+		int n = sscanf(lines[i], "%79s %79[^,], %79s", name, opnd1, opnd2);
+		if ( strncmp(lines[i], "fn ", 3) == 0 || name[strlen(name)-1] == ':' ) continue;
+		p += sprintf(p, "\t%s", name);
+		if ( n >= 2 ) {
+			p += sprintf(p, " %d", isalpha(opnd1[0]) ? label_addr(labels, nlabels, opnd1) : atoi(opnd1));
+		}
+		if ( n == 3 ) p += sprintf(p, ", %s", opnd2);
+		p += sprintf(p, "\n");
+	}
+	return out;
+}
+
+static VM *bench_load(Bench *b) {
+	char *src = bench_source(b);
+	char *code = assemble(src);
+	FILE *f = tmpfile();
+	fputs(code, f);
+	rewind(f);
+	VM *vm = vm_load(f);
+	fclose(f);
+	free(code);
+	free(src);
+	return vm;
+}
+
+static double now_ns() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+	char *out_name = "bench_results.json";
+	char *filter = NULL;
+	int trials = 10, warmup = 2;
+	for (int i = 1; i < argc - 1; i++) {
+		if ( strcmp(argv[i], "-o") == 0 ) out_name = argv[++i];
+		else if ( strcmp(argv[i], "-t") == 0 ) trials = atoi(argv[++i]);
+		else if ( strcmp(argv[i], "-w") == 0 ) warmup = atoi(argv[++i]);
+		else if ( strcmp(argv[i], "-f") == 0 ) filter = argv[++i];
+	}
+	FILE *out = fopen(out_name, "w");
+	if ( out == NULL ) {
+		perror(out_name);
+		return 1;
+	}
+	FILE *console = fdopen(dup(fileno(stdout)), "w");
+	freopen("/dev/null", "w", stdout);	// nothing but the table on the console
+
+	fprintf(out, "{\n\"benchmarks\": [\n");
+	int nbench = sizeof(benchmarks) / sizeof(benchmarks[0]);
+	bool first = true;
+	for (int i = 0; i < nbench; i++) {
+		Bench *b = &benchmarks[i];
+		if ( filter != NULL && strstr(b->name, filter) == NULL ) continue;
+		VM *vm = bench_load(b);
+		if ( b->inline_bytes > 0 ) vm_inline(vm, b->inline_bytes);
+		if ( b->jit ) vm_jit_enable(vm, false);
+		double times[trials];
+		for (int t = -warmup; t < trials; t++) {
+			vm_reset(vm);
+			if ( b->memo > 0 ) vm_memo_enable(vm, b->memo); // empty each time
+			double start = now_ns();
+			vm_exec(vm, false);
+			if ( t >= 0 ) times[t] = now_ns() - start;
+		}
+		qsort(times, (size_t)trials, sizeof(double), cmp_double);
+		double median = times[trials / 2];
+		long iters = b->body != NULL ? (long)b->iterations * b->reps : 1;
+		fprintf(out, "%s  {\"name\": \"%s\", \"trials\": %d, \"median_ns\": %.0f, \"min_ns\": %.0f, \"max_ns\": %.0f, \"ns_per_op\": %.2f}",
+				first ? "" : ",\n", b->name, trials, median, times[0], times[trials-1], median / iters);
+		fprintf(console, "%-14s median %12.0f ns  min %12.0f ns  %10.2f ns/op\n", b->name, median, times[0], median / iters);
+		fflush(console);
+		first = false;
+		vm_free(vm);
+	}
+	fprintf(out, "\n]\n}\n");
+	fclose(out);
+	return 0;
+}
@@ -0,0 +1,113 @@
+/* Channel throughput: a three-stage pipeline (numbers -> 3x+1 -> their
+ * decimal lengths summed) with each stage a VM on its own thread,
+ * streaming over SPSC channels of the given capacity, against the same
+ * stages run one after another with the whole stream held in between.
+ *
+ *   bench_pipeline [values] [capacity] [trials]
+ */
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "vm.h"
+#include "loader.h"
+#include "channel.h"
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// for (i = 0; i < n; i++) send(0, i);
+static const char *SOURCE =
+	"0 strings\n1 functions maxaddr=0\n   0: 4/main\n15 instr, 49 bytes\n"
+	"	LOCALS 1\n	ICONST 0\n	STORE 0\n"
+	"	LOAD 0\n	ICONST %d\n	ILT\n	BRF 48\n"
+	"	LOAD 0\n	SEND 0\n	LOAD 0\n	ICONST 1\n	IADD\n	STORE 0\n	BR 11\n"
+	"	HALT\n";
+
+// while ( more(0) ) send(1, 3 * recv(0) + 1);
+static const char *TRANSFORM =
+	"0 strings\n1 functions maxaddr=0\n   0: 4/main\n10 instr, 32 bytes\n"
+	"	MORE 0\n	BRF 31\n"
+	"	RECV 0\n	ICONST 3\n	IMUL\n	ICONST 1\n	IADD\n	SEND 1\n	BR 0\n"
+	"	HALT\n";
+
+// s = 0; while ( more(1) ) s += len(string(recv(1))); print s;
+static const char *FORMAT =
+	"0 strings\n1 functions maxaddr=0\n   0: 4/main\n15 instr, 41 bytes\n"
+	"	LOCALS 1\n	ICONST 0\n	STORE 0\n"
+	"	MORE 1\n	BRF 36\n"
+	"	RECV 1\n	I2S\n	SLEN\n	LOAD 0\n	IADD\n	STORE 0\n	BR 11\n"
+	"	LOAD 0\n	PRINT\n	HALT\n";
+
+typedef struct {
+	VM *vm;
+	Channel *out;	// closed when the stage is done
+} Stage;
+
+static void *run_stage(void *arg) {
+	Stage *st = arg;
+	vm_exec(st->vm, false);
+	if ( st->out != NULL ) channel_close(st->out);
+	return NULL;
+}
+
+static double run(int n, int capacity, bool threads, int trials, char *output, Channel_Stats *stats) {
+	char source[400];
+	snprintf(source, sizeof(source), SOURCE, n);
+	const char *texts[3] = {source, TRANSFORM, FORMAT};
+	double best = 1e9;
+	for (int t = 0; t < trials; t++) {
+		Channel *a = channel_new(capacity), *b = channel_new(capacity);
+		Stage stages[3];
+		for (int i = 0; i < 3; i++) {
+			stages[i] = (Stage) {vm_load_text(texts[i], strlen(texts[i])), i == 0 ? a : i == 1 ? b : NULL};
+			vm_connect(stages[i].vm, 0, a);
+			vm_connect(stages[i].vm, 1, b);
+		}
+		double start = now();
+		if ( threads ) {
+			pthread_t th[3];
+			for (int i = 0; i < 3; i++) pthread_create(&th[i], NULL, run_stage, &stages[i]);
+			for (int i = 0; i < 3; i++) pthread_join(th[i], NULL);
+		}
+		else {
+			for (int i = 0; i < 3; i++) run_stage(&stages[i]);
+		}
+		double elapsed = now() - start;
+		if ( elapsed < best ) {
+			best = elapsed;
+			strcpy(output, stages[2].vm->output);
+			*stats = channel_stats(b);
+		}
+		for (int i = 0; i < 3; i++) vm_free(stages[i].vm);
+		channel_free(a);
+		channel_free(b);
+	}
+	return best;
+}
+
+int main(int argc, char *argv[]) {
+	int n = argc > 1 ? atoi(argv[1]) : 2000000;	// 3n+1 stays short enough to go by value
+	int capacity = argc > 2 ? atoi(argv[2]) : 1024;
+	int trials = argc > 3 ? atoi(argv[3]) : 3;
+
+	char piped[100], staged[100];
+	Channel_Stats ps, ss;
+	double threaded = run(n, capacity, true, trials, piped, &ps);
+	double sequential = run(n, n, false, trials, staged, &ss);
+
+	printf("%d values, 3 stages\n", n);
+	printf("%-12s %10s %10s %10s %12s %12s\n", "run", "capacity", "ms", "Mvalues/s", "full waits", "empty waits");
+	printf("%-12s %10d %10.2f %10.2f %12llu %12llu\n", "sequential", n, sequential * 1e3, n / sequential / 1e6,
+		   (unsigned long long)ss.full_waits, (unsigned long long)ss.empty_waits);
+	printf("%-12s %10d %10.2f %10.2f %12llu %12llu\n", "pipelined", capacity, threaded * 1e3, n / threaded / 1e6,
+		   (unsigned long long)ps.full_waits, (unsigned long long)ps.empty_waits);
+	printf("speedup %.2fx\n", sequential / threaded);
+	return strcmp(piped, staged) != 0;
+}
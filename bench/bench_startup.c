@@ -0,0 +1,82 @@
+/* Startup benchmark for the code cache: time from a .bytecode file to a
+ * runnable VM with no cache, with a cold cache (parse and write the
+ * image) and with a warm one (map the image).
+ *
+ *   bench_startup [instructions] [trials]
+ */
+#define _POSIX_C_SOURCE 200809L // clock_gettime, mkstemp, mkdtemp, fdopen
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "loader.h"
+#include "code_cache.h"
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static const char *BODY[] = {
+	"	LOAD 0\n", "	ICONST 1\n", "	IADD\n", "	STORE 0\n", "	SCONST 0\n", "	POP\n", "	CALL 0, 0\n", "	POP\n",
+};
+static const int BODY_BYTES = 3+5+1+3+3+1+7+1;
+
+static double time_load(const char *fname, int trials) {
+	double best = 1e9;
+	for (int t = 0; t < trials; t++) {
+		double start = now();
+		VM *vm = vm_load_file(fname, 0);
+		double elapsed = now() - start;
+		if ( elapsed < best ) best = elapsed;
+		vm_free(vm);
+	}
+	return best;
+}
+
+int main(int argc, char *argv[]) {
+	int ninstr = argc > 1 ? atoi(argv[1]) : 1000000;
+	int trials = argc > 2 ? atoi(argv[2]) : 5;
+
+	char fname[] = "/tmp/bench_startup_XXXXXX";
+	FILE *f = fdopen(mkstemp(fname), "w");
+	int nbody = (int)(sizeof(BODY)/sizeof(BODY[0]));
+	int n = ninstr / nbody * nbody;
+	fprintf(f, "1 strings\n   0: 5/hello\n1 functions maxaddr=0\n   0: 4/main\n");
+	fprintf(f, "%d instr, %d bytes\n", n, n / nbody * BODY_BYTES);
+	for (int i = 0; i < n; i++) fputs(BODY[i % nbody], f);
+	fclose(f);
+	char dir[] = "/tmp/bench_cache_XXXXXX";
+	mkdtemp(dir);
+
+	double uncached = time_load(fname, trials);
+
+	vm_set_cache_dir(dir);
+	double cold = 1e9;
+	for (int t = 0; t < trials; t++) {	// miss every time: drop the image first
+		char cmd[100];
+		snprintf(cmd, sizeof(cmd), "rm -f %s/*.wvm", dir);
+		system(cmd);
+		double elapsed = time_load(fname, 1);
+		if ( elapsed < cold ) cold = elapsed;
+	}
+	vm_cache_reset_stats();
+	double warm = time_load(fname, trials);
+	Cache_Stats stats = vm_cache_stats();
+
+	char cmd[100];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	system(cmd);
+	remove(fname);
+
+	printf("%-10s %10s %10s %10s\n", "cache", "instrs", "ms", "speedup");
+	printf("%-10s %10d %10.2f %10s\n", "none", n, uncached * 1e3, "1.00x");
+	printf("%-10s %10d %10.2f %9.2fx\n", "cold", n, cold * 1e3, uncached / cold);
+	printf("%-10s %10d %10.2f %9.2fx\n", "warm", n, warm * 1e3, uncached / warm);
+	printf("warm: %lu hits, %lu misses, %lu errors\n", stats.hits, stats.misses, stats.errors);
+	return stats.hits != (unsigned long)trials;
+}
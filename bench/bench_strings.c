@@ -0,0 +1,74 @@
+/* Microbenchmarks for the string kernels at each level this CPU supports,
+ * over short, medium and multi-megabyte strings.
+ *
+ *   bench_strings [min_seconds_per_case]
+ */
+#define _POSIX_C_SOURCE 200809L // clock_gettime, fdopen
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "string_kernels.h"
+
+static const char *LEVELS[] = {"scalar", "sse2", "avx2"};
+static const size_t SIZES[] = {8, 256, 4*1024*1024};
+
+static double min_secs = 0.2;
+static volatile long sink;	// keep results live
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* ns per call of op(i), repeating until min_secs has passed */
+#define TIME(result, op) {									\
+	long reps = 0;										\
+	double start = now(), elapsed;						\
+	do {												\
+		for (int i_ = 0; i_ < 64; i_++) { op; }			\
+		reps += 64;										\
+	} while ( (elapsed = now() - start) < min_secs );	\
+	result = elapsed * 1e9 / reps;						\
+}
+
+int main(int argc, char *argv[]) {
+	if ( argc > 1 ) min_secs = atof(argv[1]);
+	printf("%-8s %-7s %10s %12s %12s %12s\n", "level", "op", "bytes", "ns/op", "GB/s", "vs scalar");
+	for (int z = 0; z < sizeof(SIZES)/sizeof(SIZES[0]); z++) {
+		size_t n = SIZES[z];
+		char *a = malloc(n + 1);
+		char *b = malloc(n + 1);
+		char *dst = malloc(n + 1);
+		for (size_t i = 0; i < n; i++) a[i] = b[i] = (char)('a' + i % 26);
+		a[n] = b[n] = '\0';
+		double scalar[3] = {0};
+		for (sk_level l = SK_SCALAR; l <= SK_AVX2; l++) {
+			if ( !sk_use(l) ) continue;
+			double ns[3];
+			TIME(ns[0], sink += sk_eq(a, n, b, n));		// equal strings: worst case
+			TIME(ns[1], sink += sk_cmp(a, n, b, n));
+			TIME(ns[2], sk_copy(dst, a, n); sink += dst[0]);
+			const char *ops[] = {"eq", "cmp", "copy"};
+			for (int k = 0; k < 3; k++) {
+				if ( l == SK_SCALAR ) scalar[k] = ns[k];
+				printf("%-8s %-7s %10zu %12.1f %12.2f %11.2fx\n",
+					   LEVELS[l], ops[k], n, ns[k], n / ns[k], scalar[k] / ns[k]);
+			}
+		}
+		free(a);
+		free(b);
+		free(dst);
+	}
+
+	char buf[12];
+	double ns_itoa, ns_sprintf;
+	int v = 0;
+	TIME(ns_itoa, sink += sk_itoa(v++ * 7919, buf));
+	TIME(ns_sprintf, sink += sprintf(buf, "%d", v++ * 7919));
+	printf("%-8s %-7s %10s %12.1f %12s %11.2fx\n", "-", "itoa", "-", ns_itoa, "-", ns_sprintf / ns_itoa);
+	printf("%-8s %-7s %10s %12.1f\n", "-", "sprintf", "-", ns_sprintf);
+	return 0;
+}
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <string.h>
+#include "allocator.h"
+
+static void *heap_alloc(Allocator *a, size_t size);
+static void heap_free(Allocator *a, void *p);
+static void heap_release(Allocator *a);
+static void heap_destroy(Allocator *a);
+
+Allocator heap_allocator = {heap_alloc, heap_free, heap_release, heap_destroy};
+
+static void *heap_alloc(Allocator *a, size_t size) {
+	__atomic_add_fetch(&a->allocations, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&a->bytes, size, __ATOMIC_RELAXED);
+	return calloc(1, size);
+}
+
+static void heap_free(Allocator *a, void *p) { free(p); }
+static void heap_release(Allocator *a) { }
+static void heap_destroy(Allocator *a) { }
+
+/* Bump allocator over a list of chunks. Each block has its size in an
+ * ALIGN-byte header, so free() can put it on a free list: one per size
+ * (sizes are multiples of ALIGN) up to a quarter chunk, and one first-fit
+ * list for bigger blocks. alloc() takes from those before bumping. All
+ * memory comes back at once with release() (vm_reset) or destroy()
+ * (vm_free). Requests too big for a chunk get a chunk of their own.
+ */
+typedef struct chunk {
+	struct chunk *next;
+	size_t size;
+	char data[];			// malloc alignment, as the header is 2 words
+} Chunk;
+
+typedef struct {
+	Allocator allocator;	// must be first
+	size_t chunk_size;
+	Chunk *chunks;			// most recent first; the current one is chunks
+	char *next;				// bump pointer into chunks->data
+	char *end;
+	void **free_lists;		// by size / ALIGN; blocks link through their first word
+	size_t nclasses;
+	void *large;			// freed blocks too big for a size class
+} Arena;
+
+static const size_t ALIGN = 2*sizeof(void *);
+
+static void *arena_alloc(Allocator *a, size_t size);
+static void arena_free(Allocator *a, void *p);
+static void arena_release(Allocator *a);
+static void arena_destroy(Allocator *a);
+static Chunk *arena_chunk(Arena *arena, size_t size);
+static void *arena_reuse(Arena *arena, size_t size);
+static inline size_t *block_size(void *p) { return (size_t *)((char *)p - ALIGN); }
+
+Allocator *arena_new(size_t chunk_size) {
+	Arena *arena = calloc(1, sizeof(Arena));
+	arena->allocator = (Allocator) {arena_alloc, arena_free, arena_release, arena_destroy};
+	arena->chunk_size = chunk_size;
+	arena->nclasses = chunk_size / 4 / ALIGN + 1;
+	arena->free_lists = calloc(arena->nclasses, sizeof(void *));
+	return &arena->allocator;
+}
+
+size_t arena_footprint(Allocator *a) {
+	size_t bytes = 0;
+	for (Chunk *c = ((Arena *)a)->chunks; c != NULL; c = c->next) bytes += c->size;
+	return bytes;
+}
+
+static void *arena_alloc(Allocator *a, size_t size) {
+	Arena *arena = (Arena *)a;
+	size = size > 0 ? (size + ALIGN - 1) & ~(ALIGN - 1) : ALIGN; // room for the free list link
+	a->allocations++;
+	a->bytes += size;
+	void *p = arena_reuse(arena, size);
+	if ( p != NULL ) return memset(p, 0, size);
+	size_t block = ALIGN + size;
+	if ( block > (size_t)(arena->end - arena->next) ) {
+		if ( block > arena->chunk_size / 4 ) { // don't waste the rest of the current chunk
+			Chunk *c = arena_chunk(arena, block);
+			if ( arena->chunks != NULL ) { // slide in behind the current chunk
+				c->next = arena->chunks->next;
+				arena->chunks->next = c;
+			}
+			else {
+				arena->chunks = c;
+				arena->next = arena->end = c->data + block;
+			}
+			*(size_t *)c->data = size;
+			return c->data + ALIGN;
+		}
+		Chunk *c = arena_chunk(arena, arena->chunk_size);
+		c->next = arena->chunks;
+		arena->chunks = c;
+		arena->next = c->data;
+		arena->end = arena->next + c->size;
+	}
+	p = arena->next + ALIGN;
+	*block_size(p) = size;
+	arena->next += block;
+	return p;
+}
+
+static void arena_free(Allocator *a, void *p) {
+	if ( p == NULL ) return;
+	Arena *arena = (Arena *)a;
+	size_t c = *block_size(p) / ALIGN;
+	void **list = c < arena->nclasses ? &arena->free_lists[c] : &arena->large;
+	*(void **)p = *list;
+	*list = p;
+}
+
+/* keep one regular chunk around for reuse; zero what we hand out again */
+static void arena_release(Allocator *a) {
+	Arena *arena = (Arena *)a;
+	Chunk *keep = NULL;
+	size_t used = 0;
+	Chunk *c = arena->chunks;
+	while ( c != NULL ) {
+		Chunk *next = c->next;
+		if ( keep == NULL && c->size == arena->chunk_size ) {
+			keep = c;
+			used = c == arena->chunks ? (size_t)(arena->next - c->data) : c->size;
+		}
+		else free(c);
+		c = next;
+	}
+	arena->chunks = keep;
+	arena->next = arena->end = NULL;
+	memset(arena->free_lists, 0, arena->nclasses * sizeof(void *));
+	arena->large = NULL;
+	if ( keep != NULL ) {
+		keep->next = NULL;
+		memset(keep->data, 0, used);
+		arena->next = keep->data;
+		arena->end = arena->next + keep->size;
+	}
+}
+
+static void arena_destroy(Allocator *a) {
+	Arena *arena = (Arena *)a;
+	while ( arena->chunks != NULL ) {
+		Chunk *next = arena->chunks->next;
+		free(arena->chunks);
+		arena->chunks = next;
+	}
+	free(arena->free_lists);
+	free(arena);
+}
+
+static Chunk *arena_chunk(Arena *arena, size_t size) {
+	Chunk *c = calloc(1, sizeof(Chunk) + size);
+	c->size = size;
+	return c;
+}
+
+// a freed block of exactly size, or of at least size if it's a big one
+static void *arena_reuse(Arena *arena, size_t size) {
+	size_t c = size / ALIGN;
+	if ( c < arena->nclasses ) {
+		void *p = arena->free_lists[c];
+		if ( p != NULL ) arena->free_lists[c] = *(void **)p;
+		return p;
+	}
+	for (void **link = &arena->large; *link != NULL; link = (void **)*link) {
+		void *p = *link;
+		if ( *block_size(p) >= size ) {
+			*link = *(void **)p;
+			return p;
+		}
+	}
+	return NULL;
+}
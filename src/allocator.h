@@ -0,0 +1,27 @@
+#ifndef ALLOCATOR_H_
+#define ALLOCATOR_H_
+
+#include <stddef.h>
+
+/* Where a VM gets memory for runtime objects (Strings, rope nodes,
+ * flattened text). Embedders may supply their own; see vm_set_allocator().
+ * An allocator is used by one VM, hence one thread, at a time.
+ */
+typedef struct allocator {
+	void *(*alloc)(struct allocator *a, size_t size);	// zeroed memory
+	void (*free)(struct allocator *a, void *p);
+	void (*release)(struct allocator *a);				// drop everything allocated so far
+	void (*destroy)(struct allocator *a);
+	size_t allocations;									// stats, bumped by alloc
+	size_t bytes;
+} Allocator;
+
+// plain calloc/free; release() does nothing. Shared by all threads, so its stats are bumped atomically
+extern Allocator heap_allocator;
+
+extern Allocator *arena_new(size_t chunk_size);
+extern size_t arena_footprint(Allocator *a);	// bytes of chunks it holds
+
+static const size_t ARENA_CHUNK_SIZE = 64*1024;
+
+#endif
@@ -0,0 +1,157 @@
+#define _POSIX_C_SOURCE 200809L // posix_memalign
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "decode.h"
+#include "functions.h"
+#include "memo.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BATCH_X86 1
+#endif
+
+// one int per lane; GCC/clang vector extension, so the ops below are SIMD instructions
+typedef int32_t lanes __attribute__((vector_size(BATCH_LANES * sizeof(int32_t))));
+typedef uint32_t ulanes __attribute__((vector_size(BATCH_LANES * sizeof(int32_t))));
+
+typedef struct {
+	lanes stack[BATCH_FRAMES][BATCH_DEPTH];	// operand stack of each frame, indexed by depth in it
+	lanes locals[BATCH_FRAMES][MAX_LOCALS];
+	lanes retpc[BATCH_FRAMES];				// where RET from each frame goes
+	lanes retsp[BATCH_FRAMES];				// the caller's stack depth with the args popped
+	lanes pc;
+	lanes sp;								// -1 if the frame's stack is empty
+	lanes fp;								// frame; 0 is the batched function
+	lanes live;								// -1 while the lane runs
+} Lanes;
+
+typedef struct {
+	const int *args;
+	int nargs;
+	int index;		// into the caller's results
+} Tuple;
+
+#define SPLAT(v) ((lanes){0} + (v))
+#define WRAP(x, op, y) ((lanes)((ulanes)(x) op (ulanes)(y)))	// idle lanes hold anything; no signed overflow
+#define BLEND(m, a, b) (((m) & (a)) | (~(m) & (b)))	// a in the lanes of m, else b
+// the group moves on together; it keeps going without a new pick
+#define NEXT(m, newsp, newpc) \
+	(L->sp = BLEND(m, SPLAT(newsp), L->sp), L->pc = BLEND(m, SPLAT(newpc), L->pc), s = (newsp), pc = (newpc))
+#define SPILL(m) do { \
+		for (int lane_ = 0; lane_ < BATCH_LANES; lane_++) if ( (m)[lane_] ) spilled |= 1u << lane_; \
+		L->live &= ~(m); \
+		pick = true; \
+	} while (0)
+#define BINARY(expr) \
+	if ( s < 1 ) { SPILL(m); break; } \
+	x = st[s-1]; y = st[s]; \
+	st[s-1] = BLEND(m, (expr), x); \
+	NEXT(m, s-1, pc+1)
+#define UNARY(expr) \
+	if ( s < 0 ) { SPILL(m); break; } \
+	x = st[s]; \
+	st[s] = BLEND(m, (expr), x); \
+	NEXT(m, s, pc+1)
+
+#define BATCH_NAME run_lanes
+#define BATCH_TARGET
+#include "batch_engine.h"
+
+#ifdef BATCH_X86
+#define BATCH_NAME run_lanes_avx2
+#define BATCH_TARGET __attribute__((target("avx2")))
+#include "batch_engine.h"
+#endif
+
+static int call_scalar(VM *vm, Function *f, const int *args, int nargs);
+static int by_args(const void *a, const void *b);
+
+static batch_level level = BATCH_SCALAR;
+
+__attribute__((constructor))
+static void batch_init() {
+	if ( !batch_use(BATCH_AVX2) ) batch_use(BATCH_VECTOR);
+}
+
+bool batch_use(batch_level l) {
+	switch ( l ) {
+		case BATCH_SCALAR :
+		case BATCH_VECTOR :
+			break;
+#ifdef BATCH_X86
+		case BATCH_AVX2 :
+			__builtin_cpu_init();
+			if ( !__builtin_cpu_supports("avx2") ) return false;
+			break;
+#endif
+		default:
+			return false;
+	}
+	level = l;
+	return true;
+}
+
+batch_level batch_current() {
+	return level;
+}
+
+int vm_batch(VM *vm, const char *name, const int *args, int nargs, int n, int *results) {
+	Function *f = function_named(&vm->funcs, name);
+	if ( f == NULL || nargs < 0 || nargs > MAX_LOCALS || (f->nargs >= 0 && f->nargs != nargs) ) return -1;
+	if ( vm->instrs == NULL || vm->lazy != NULL ) vm_decode(vm);
+	memo_find_pure(vm);
+
+	Lanes *L = NULL;
+	if ( level != BATCH_SCALAR && f->pure && nargs + f->nlocals <= MAX_LOCALS &&
+		 posix_memalign((void **)&L, sizeof(lanes), sizeof(Lanes)) != 0 ) L = NULL;
+	if ( L == NULL ) {
+		for (int i = 0; i < n; i++) results[i] = call_scalar(vm, f, &args[i * nargs], nargs);
+		return 0;
+	}
+
+	// equal arguments take the same path, so sorted inputs keep the lanes of a batch together
+	Tuple *in = malloc((size_t)(n > 0 ? n : 1) * sizeof(Tuple));
+	for (int i = 0; i < n; i++) {
+		in[i] = (Tuple) {&args[i * nargs], nargs, i};
+	}
+	qsort(in, (size_t)n, sizeof(Tuple), by_args);
+	int in_lanes = 0;
+	for (int i = 0; i < n; i += BATCH_LANES) {
+		int k = n - i < BATCH_LANES ? n - i : BATCH_LANES;
+		int out[BATCH_LANES];
+		unsigned int spilled;
+#ifdef BATCH_X86
+		if ( level == BATCH_AVX2 ) spilled = run_lanes_avx2(vm, f, L, &in[i], nargs, k, out);
+		else
+#endif
+		spilled = run_lanes(vm, f, L, &in[i], nargs, k, out);
+		for (int lane = 0; lane < k; lane++) {
+			if ( spilled & (1u << lane) ) out[lane] = call_scalar(vm, f, in[i + lane].args, nargs);
+			else in_lanes++;
+			results[in[i + lane].index] = out[lane];
+		}
+	}
+	free(in);
+	free(L);
+	return in_lanes;
+}
+
+// S U P P O R T
+
+/* f(args) on the ordinary engine through vm_call(); 0 if it HALTed */
+static int call_scalar(VM *vm, Function *f, const int *args, int nargs) {
+	element in[MAX_LOCALS], e = {.type = INVALID};
+	for (int i = 0; i < nargs; i++) {
+		in[i] = (element) {.type = INT, .i = args[i]};
+	}
+	vm_call(vm, f, in, nargs, &e); // nothing if it HALTed
+	return e.type == BOOLEAN ? e.b : e.i;
+}
+
+static int by_args(const void *a, const void *b) {
+	const Tuple *x = a, *y = b;
+	for (int i = 0; i < x->nargs; i++) {
+		if ( x->args[i] != y->args[i] ) return x->args[i] < y->args[i] ? -1 : 1;
+	}
+	return x->index - y->index;
+}
@@ -0,0 +1,36 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "vm.h"
+
+/* SPMD execution of one function over many argument tuples. Inputs go
+ * BATCH_LANES at a time into lanes that share one instruction stream:
+ * each step picks a group of lanes at the same instruction, frame depth
+ * and stack depth (deepest frame first, then lowest pc, so lanes that
+ * split at a BRF or a recursive CALL meet up again) and runs that
+ * instruction once for all of them, with the other lanes masked off.
+ * Every lane has its own frames, so recursion works. Arithmetic and
+ * comparisons are 8-wide vector operations; on x86 an AVX2 build of the
+ * loop is picked at startup when the CPU has it, else a generic one.
+ *
+ * Only pure functions (see memo.h: ints, booleans, locals, branches and
+ * calls to pure functions) run in lanes; anything else, and any lane
+ * that outgrows BATCH_FRAMES or BATCH_DEPTH, is run again by itself on
+ * the ordinary engine. Booleans come back as 0 or 1.
+ */
+
+typedef enum { BATCH_SCALAR=0, BATCH_VECTOR, BATCH_AVX2 } batch_level;
+
+#define BATCH_LANES 8
+#define BATCH_FRAMES 128	// call depth per lane
+#define BATCH_DEPTH 16		// operand stack per frame
+
+// args holds n tuples of nargs ints; results[i] gets the value for tuple i.
+// Returns how many ran in lanes (the rest ran scalar), or -1 if there's no
+// such function or it doesn't take nargs arguments.
+extern int vm_batch(VM *vm, const char *name, const int *args, int nargs, int n, int *results);
+
+extern batch_level batch_current();
+extern bool batch_use(batch_level level);	// false if this CPU can't; for tests and benchmarks
+
+#endif
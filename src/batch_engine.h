@@ -0,0 +1,145 @@
+/* The lane loop of vm_batch(), compiled once per instruction set. batch.c
+ * includes this file once per build after defining
+ *
+ *   BATCH_NAME     name of the static function to define
+ *   BATCH_TARGET   its attributes, e.g. __attribute__((target("avx2")))
+ *
+ * It runs up to BATCH_LANES calls of f (the first n lanes, one per tuple
+ * of in) to the end and returns a bit mask of the lanes it gave up on. There is deliberately no
+ * include guard.
+ */
+
+BATCH_TARGET
+static unsigned int BATCH_NAME(VM *vm, Function *f, Lanes *L, const Tuple *in, int nargs, int n, int *results) {
+	unsigned int spilled = 0;
+	for (int lane = 0; lane < BATCH_LANES; lane++) {
+		L->live[lane] = lane < n ? -1 : 0;
+		L->pc[lane] = f->body_pc;
+		L->sp[lane] = -1;
+		L->fp[lane] = 0;
+		for (int i = 0; i < MAX_LOCALS; i++) {
+			L->locals[0][i][lane] = lane < n && i < nargs ? in[lane].args[i] : 0;
+		}
+	}
+
+	int pc = 0, s = 0, c = 0;
+	lanes m = SPLAT(0), *st = NULL, x, y;
+	bool pick = true;
+	for (;;) {
+		if ( pick ) {	// after lanes split or finish: the deepest frame, then the lowest pc
+			int lead = -1;
+			for (int lane = 0; lane < BATCH_LANES; lane++) {
+				if ( !L->live[lane] ) continue;
+				if ( lead < 0 || L->fp[lane] > L->fp[lead] ||
+					 (L->fp[lane] == L->fp[lead] && L->pc[lane] < L->pc[lead]) ) lead = lane;
+			}
+			if ( lead < 0 ) break;
+			pc = L->pc[lead];
+			s = L->sp[lead];
+			c = L->fp[lead];
+			m = L->live & (L->pc == SPLAT(pc)) & (L->sp == SPLAT(s)) & (L->fp == SPLAT(c));
+			st = L->stack[c];
+			pick = false;
+		}
+		Instr *I = &vm->instrs[pc];
+		Function *g;
+
+		switch ( I->opcode ) {
+			case IADD: BINARY(WRAP(x, +, y)); break;
+			case ISUB: BINARY(WRAP(x, -, y)); break;
+			case IMUL: BINARY(WRAP(x, *, y)); break;
+			case IDIV:	// idle lanes divide by 1, not by whatever they hold
+				if ( s < 1 ) { SPILL(m); break; }
+				y = BLEND(m, st[s], SPLAT(1));
+				x = st[s-1];
+				st[s-1] = BLEND(m, x / y, x);
+				NEXT(m, s-1, pc+1);
+				break;
+			case OR:   BINARY(((x | y) != 0) & 1); break;
+			case AND:  BINARY((x != 0) & (y != 0) & 1); break;
+			case IEQ:  BINARY((x == y) & 1); break;
+			case INEQ: BINARY((x != y) & 1); break;
+			case ILT:  BINARY((x < y) & 1); break;
+			case ILE:  BINARY((x <= y) & 1); break;
+			case IGT:  BINARY((x > y) & 1); break;
+			case IGE:  BINARY((x >= y) & 1); break;
+			case INEG: UNARY(WRAP(SPLAT(0), -, x)); break;
+			case NOT:  UNARY((x == 0) & 1); break;
+			case BR:
+				NEXT(m, s, I->a);
+				break;
+			case BRF:	// lanes split here; the ones that branch are masked off until the rest catch up
+				if ( s < 0 ) { SPILL(m); break; }
+				x = m & (st[s] == SPLAT(0));
+				L->sp = BLEND(m, SPLAT(s-1), L->sp);
+				L->pc = BLEND(x, SPLAT(I->a), BLEND(m, SPLAT(pc+1), L->pc));
+				pick = true;
+				break;
+			case ICONST:
+				if ( s + 1 >= BATCH_DEPTH ) { SPILL(m); break; }
+				st[s+1] = BLEND(m, SPLAT(I->a), st[s+1]);
+				NEXT(m, s+1, pc+1);
+				break;
+			case LOAD:
+				if ( s + 1 >= BATCH_DEPTH || I->a < 0 || I->a >= MAX_LOCALS ) { SPILL(m); break; }
+				st[s+1] = BLEND(m, L->locals[c][I->a], st[s+1]);
+				NEXT(m, s+1, pc+1);
+				break;
+			case STORE:
+				if ( s < 0 || I->a < 0 || I->a >= MAX_LOCALS ) { SPILL(m); break; }
+				L->locals[c][I->a] = BLEND(m, st[s], L->locals[c][I->a]);
+				NEXT(m, s-1, pc+1);
+				break;
+			case POP:
+				if ( s < 0 ) { SPILL(m); break; }
+				NEXT(m, s-1, pc+1);
+				break;
+			case LOCALS:
+				NEXT(m, s, pc+1);
+				break;
+			case CALL_CACHED:
+				g = &vm->funcs.functions[I->a];
+				if ( c + 1 >= BATCH_FRAMES || s + 1 < I->b || I->b + g->nlocals > MAX_LOCALS ) { SPILL(m); break; }
+				for (int i = 0; i < I->b; i++) {
+					L->locals[c+1][i] = BLEND(m, st[s - I->b + 1 + i], L->locals[c+1][i]);
+				}
+				for (int i = I->b; i < I->b + g->nlocals; i++) {
+					L->locals[c+1][i] = BLEND(m, SPLAT(0), L->locals[c+1][i]);
+				}
+				L->retpc[c+1] = BLEND(m, SPLAT(pc+1), L->retpc[c+1]);
+				L->retsp[c+1] = BLEND(m, SPLAT(s - I->b), L->retsp[c+1]);
+				L->fp = BLEND(m, SPLAT(c+1), L->fp);
+				NEXT(m, -1, g->body_pc);
+				st = L->stack[++c];
+				break;
+			case RET:	// callers may be at different call sites: one lane at a time
+				if ( s < 0 ) { SPILL(m); break; }
+				for (int lane = 0; lane < BATCH_LANES; lane++) {
+					if ( !m[lane] ) continue;
+					int r = L->retsp[c][lane] + 1;
+					if ( c == 0 ) {
+						results[lane] = st[s][lane];
+						L->live[lane] = 0;
+					}
+					else if ( r >= BATCH_DEPTH ) {
+						spilled |= 1u << lane;
+						L->live[lane] = 0;
+					}
+					else {
+						L->stack[c-1][r][lane] = st[s][lane];
+						L->sp[lane] = r;
+						L->pc[lane] = L->retpc[c][lane];
+						L->fp[lane] = c - 1;
+					}
+				}
+				pick = true;
+				break;
+			default:	// fell through into code that isn't pure
+				SPILL(m);
+		}
+	}
+	return spilled;
+}
+
+#undef BATCH_NAME
+#undef BATCH_TARGET
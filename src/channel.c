@@ -0,0 +1,103 @@
+#define _POSIX_C_SOURCE 200809L // sched_yield
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "channel.h"
+
+#define SPINS 100	// before yielding the CPU
+
+static void backoff(int *spins);
+
+Channel *channel_new(int capacity) {
+	unsigned int size = 1;
+	while ( size < (unsigned int)capacity ) size *= 2;
+	Channel *c = calloc(1, sizeof(Channel));
+	c->ring = calloc(size, sizeof(element));
+	c->mask = size - 1;
+	return c;
+}
+
+void channel_free(Channel *c) {
+	if ( c == NULL ) return;
+	for (unsigned int i = c->head; i != c->tail; i++) {
+		if ( c->ring[i & c->mask].type == STRING ) String_free(c->ring[i & c->mask].s);
+	}
+	free(c->ring);
+	free(c);
+}
+
+void channel_send(Channel *c, element e) {
+	unsigned int tail = c->tail;
+	if ( tail - c->head_seen > c->mask ) {
+		c->full_waits++;
+		int spins = 0;
+		while ( tail - (c->head_seen = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE)) > c->mask ) backoff(&spins);
+	}
+	c->ring[tail & c->mask] = e;
+	c->sends++;
+	__atomic_store_n(&c->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+bool channel_more(Channel *c) {
+	unsigned int head = c->head;
+	if ( head != c->tail_seen ) return true;
+	c->empty_waits++;
+	int spins = 0;
+	for (;;) {
+		bool closed = __atomic_load_n(&c->closed, __ATOMIC_ACQUIRE);
+		c->tail_seen = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+		if ( head != c->tail_seen ) return true;
+		if ( closed ) return false;	// and it was empty after the last send
+		backoff(&spins);
+	}
+}
+
+bool channel_recv(Channel *c, element *e) {
+	if ( !channel_more(c) ) return false;
+	unsigned int head = c->head;
+	*e = c->ring[head & c->mask];
+	c->recvs++;
+	__atomic_store_n(&c->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+void channel_close(Channel *c) {
+	__atomic_store_n(&c->closed, 1, __ATOMIC_RELEASE);
+}
+
+Channel_Stats channel_stats(Channel *c) {
+	return (Channel_Stats) {.sends = c->sends, .recvs = c->recvs, .full_waits = c->full_waits, .empty_waits = c->empty_waits};
+}
+
+void vm_connect(VM *vm, int index, Channel *c) {
+	if ( index < 0 ) return;
+	if ( vm->channels == NULL ) vm->channels = calloc(1, sizeof(VM_Channels));
+	VM_Channels *t = vm->channels;
+	if ( index >= t->n ) {
+		t->channels = realloc(t->channels, (size_t)(index + 1) * sizeof(Channel *));
+		memset(&t->channels[t->n], 0, (size_t)(index + 1 - t->n) * sizeof(Channel *));
+		t->n = index + 1;
+	}
+	t->channels[index] = c;
+}
+
+void vm_channels_free(VM *vm) {
+	VM_Channels *t = vm->channels;
+	if ( t == NULL ) return;
+	free(t->channels);
+	free(t);
+	vm->channels = NULL;
+}
+
+// S U P P O R T
+
+static void backoff(int *spins) {
+	if ( ++*spins < SPINS ) {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+		return;
+	}
+	*spins = 0;
+	sched_yield();
+}
@@ -0,0 +1,77 @@
+#ifndef CHANNEL_H_
+#define CHANNEL_H_
+
+#include <stdint.h>
+
+#include "vm.h"
+
+/* Channels between VMs: bounded rings of element values with exactly one
+ * VM sending and one receiving, each on its own thread, so no locks. The
+ * sender owns tail and the receiver head; each keeps its own copy of the
+ * other's index and only reads the real one (acquire) when the ring looks
+ * full or empty, and they sit on separate cache lines.
+ *
+ * The host makes channels, gives each a number in both VMs with
+ * vm_connect() and closes a channel once its sender's vm_exec() is done.
+ * In bytecode:
+ *
+ *	SEND c	pop a value and put it on channel c; waits while c is full
+ *	MORE c	push true when c has a value, false once it's closed and empty;
+ *			waits while neither
+ *	RECV c	push the next value from c; waits while c is empty
+ *
+ * so a stage is "L: MORE 0; BRF end; RECV 0; ...; BR L". A RECV from a
+ * closed, empty channel or a channel number that isn't connected stops the
+ * program with an error, as an invalid opcode does. Ints, booleans and
+ * short strings go by value. A longer string is copied to the heap by
+ * SEND and into the receiver's allocator by RECV, since allocators are
+ * one VM's only.
+ *
+ * Waiting spins a little, then yields the CPU.
+ */
+
+#define CHANNEL_LINE 64			// cache line
+
+typedef struct {
+	uint64_t sends;
+	uint64_t recvs;
+	uint64_t full_waits;		// SENDs that found it full
+	uint64_t empty_waits;		// RECVs and MOREs that found it empty
+} Channel_Stats;
+
+typedef struct channel {
+	element *ring;
+	unsigned int mask;			// capacity - 1; capacity is a power of 2
+	int closed;
+	char pad0[CHANNEL_LINE];
+	unsigned int tail;			// sender's: next slot to fill
+	unsigned int head_seen;		// sender's copy of head
+	uint64_t sends, full_waits;
+	char pad1[CHANNEL_LINE];
+	unsigned int head;			// receiver's: next slot to empty
+	unsigned int tail_seen;		// receiver's copy of tail
+	uint64_t recvs, empty_waits;
+	char pad2[CHANNEL_LINE];
+} Channel;
+
+typedef struct vm_channels {
+	Channel **channels;			// by number; not the VM's to free
+	int n;
+} VM_Channels;
+
+// capacity is rounded up to a power of 2
+extern Channel *channel_new(int capacity);
+// strings still in it go too
+extern void channel_free(Channel *c);
+extern void channel_send(Channel *c, element e);
+extern bool channel_more(Channel *c);
+extern bool channel_recv(Channel *c, element *e);	// false once it's closed and empty
+extern void channel_close(Channel *c);				// by the sender, after its last send
+// read them once both sides are done
+extern Channel_Stats channel_stats(Channel *c);
+
+// SEND, MORE and RECV with number index use c from now on
+extern void vm_connect(VM *vm, int index, Channel *c);
+extern void vm_channels_free(VM *vm);
+
+#endif
@@ -0,0 +1,255 @@
+#define _POSIX_C_SOURCE 200809L // mkstemp
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "code_cache.h"
+#include "functions.h"
+#include "decode.h"
+#include "memo.h"
+
+/* Image layout, native byte order:
+ *   Image_Header
+ *   num_strings x {uint32 length or NO_STRING, chars}
+ *   num_functions x {Image_Function, name chars}
+ *   code_size bytes of code
+ *   num_instrs x Instr, as vm_decode() and vm_infer_types() left them
+ */
+typedef struct {
+	char magic[4];			// "WVMI"
+	uint32_t version;		// IMAGE_FORMAT and the number of opcodes
+	uint64_t key;
+	uint32_t num_strings;
+	uint32_t num_functions;
+	uint32_t code_size;
+	uint32_t num_instrs;
+	uint32_t untagged;
+	uint32_t reserved;
+} Image_Header;
+
+typedef struct {
+	uint32_t addr;
+	int32_t nargs;
+	int32_t nlocals;
+	uint32_t body;
+	int32_t entry_pc;
+	int32_t body_pc;
+	uint32_t pure;
+	uint32_t name_length;
+} Image_Function;
+
+/* Bump IMAGE_FORMAT with any change to the layout, to Instr or Function,
+ * or to what an opcode means or takes: images store decoded instructions,
+ * so an opcode renumbered or given other operands makes old ones wrong
+ * even when NUM_INSTRS stays the same.
+ */
+#define IMAGE_FORMAT 2
+#define IMAGE_VERSION ((uint32_t)(IMAGE_FORMAT << 16 | NUM_INSTRS))
+static const uint32_t NO_STRING = 0xFFFFFFFF;
+
+static char *cache_dir = NULL;
+static Cache_Stats stats;
+
+static void image_path(char *buf, size_t size, uint64_t key);
+static bool get32(const char **p, const char *end, uint32_t *v);
+
+void vm_set_cache_dir(const char *dir) {
+	free(cache_dir);
+	cache_dir = NULL;
+	if ( dir != NULL ) {
+		cache_dir = malloc(strlen(dir) + 1);
+		strcpy(cache_dir, dir);
+		mkdir(cache_dir, 0755); // fine if it's already there
+	}
+}
+
+const char *vm_cache_dir() { return cache_dir; }
+
+Cache_Stats vm_cache_stats() { return stats; }
+
+void vm_cache_reset_stats() { memset(&stats, 0, sizeof(stats)); }
+
+/* 64-bit multiply-xorshift over 8-byte words; fast, not cryptographic */
+uint64_t cache_key(const char *text, size_t size) {
+	const uint64_t M = 0xff51afd7ed558ccdULL;
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t w;
+		memcpy(&w, text + i, 8);
+		h = (h ^ w) * M;
+		h ^= h >> 32;
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, text + i, size - i);
+	h = (h ^ tail) * M;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h != 0 ? h : 1;
+}
+
+VM *cache_load(uint64_t key) {
+	char path[1024];
+	image_path(path, sizeof(path), key);
+	int fd = open(path, O_RDONLY);
+	if ( fd < 0 ) {
+		__sync_fetch_and_add(&stats.misses, 1);
+		return NULL;
+	}
+	struct stat st;
+	char *image = MAP_FAILED;
+	if ( fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Image_Header) ) {
+		image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if ( image == MAP_FAILED ) {
+		__sync_fetch_and_add(&stats.errors, 1);
+		__sync_fetch_and_add(&stats.misses, 1);
+		return NULL;
+	}
+
+	const char *end = image + st.st_size;
+	Image_Header h;
+	memcpy(&h, image, sizeof(h));
+	const char *p = image + sizeof(h);
+	bool ok = memcmp(h.magic, "WVMI", 4) == 0 && h.version == IMAGE_VERSION && h.key == key;
+
+	VM *vm = vm_alloc();
+	Function *functions = NULL;
+	uint32_t nfuncs = 0;
+	if ( ok ) {
+		vm->num_strings = (int)h.num_strings;
+		vm->strings = calloc(h.num_strings, sizeof(String *));
+		for (uint32_t i = 0; ok && i < h.num_strings; i++) {
+			uint32_t len;
+			ok = get32(&p, end, &len);
+			if ( !ok || len == NO_STRING ) continue;
+			ok = len <= (size_t)(end - p);
+			if ( ok ) vm->strings[i] = String_from_chars(&heap_allocator, p, len); // outlives vm_reset()
+			p += ok ? len : 0;
+		}
+		functions = calloc(h.num_functions, sizeof(Function));
+		for (; ok && nfuncs < h.num_functions; nfuncs++) {
+			Image_Function g;
+			ok = sizeof(g) <= (size_t)(end - p);
+			if ( ok ) memcpy(&g, p, sizeof(g));
+			ok = ok && g.name_length <= (size_t)(end - p) - sizeof(g) &&
+				 g.entry_pc >= 0 && (uint32_t)g.entry_pc <= h.num_instrs &&
+				 g.body_pc >= 0 && (uint32_t)g.body_pc <= h.num_instrs;
+			if ( !ok ) break;
+			p += sizeof(g);
+			Function *f = &functions[nfuncs];
+			f->name = malloc(g.name_length + 1);
+			memcpy(f->name, p, g.name_length);
+			f->name[g.name_length] = '\0';
+			p += g.name_length;
+			f->addr = g.addr;
+			f->nargs = g.nargs;
+			f->nlocals = g.nlocals;
+			f->body = g.body;
+			f->entry_pc = g.entry_pc;
+			f->body_pc = g.body_pc;
+			f->pure = g.pure != 0;
+		}
+		ok = ok && h.code_size <= (size_t)(end - p) &&
+			 (size_t)h.num_instrs * sizeof(Instr) == (size_t)(end - p) - h.code_size;
+	}
+	if ( !ok ) {
+		munmap(image, (size_t)st.st_size);
+		for (uint32_t i = 0; i < nfuncs; i++) free(functions[i].name);
+		free(functions);
+		vm_free(vm);
+		__sync_fetch_and_add(&stats.errors, 1);
+		__sync_fetch_and_add(&stats.misses, 1);
+		return NULL;
+	}
+
+	byte *code = malloc(h.code_size > 0 ? h.code_size : 1);
+	memcpy(code, p, h.code_size);
+	p += h.code_size;
+	Instr *instrs = malloc((h.num_instrs > 0 ? h.num_instrs : 1) * sizeof(Instr));
+	memcpy(instrs, p, h.num_instrs * sizeof(Instr));
+	munmap(image, (size_t)st.st_size);
+	vm_init(vm, code, (int)h.code_size);
+	// stored sorted by addr, so they keep their places; no need to scan the code again
+	Function *decoded = malloc((nfuncs > 0 ? nfuncs : 1) * sizeof(Function));
+	memcpy(decoded, functions, nfuncs * sizeof(Function));
+	function_table_init(&vm->funcs, functions, (int)nfuncs, NULL, (int)h.code_size);
+	for (uint32_t i = 0; i < nfuncs; i++) {
+		functions[i].nargs = decoded[i].nargs;
+		functions[i].nlocals = decoded[i].nlocals;
+		functions[i].body = decoded[i].body;
+		functions[i].entry_pc = decoded[i].entry_pc;
+		functions[i].body_pc = decoded[i].body_pc;
+		functions[i].pure = decoded[i].pure;
+	}
+	free(decoded);
+	vm->instrs = instrs;
+	vm->num_instrs = (int)h.num_instrs;
+	vm->untagged = h.untagged != 0;
+	vm->pure_known = true;
+	__sync_fetch_and_add(&stats.hits, 1);
+	return vm;
+}
+
+void cache_store(VM *vm, uint64_t key) {
+	char path[1024], tmp[1024 + 8];
+	image_path(path, sizeof(path), key);
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+	if ( f == NULL ) {
+		if ( fd >= 0 ) close(fd);
+		__sync_fetch_and_add(&stats.errors, 1);
+		return;
+	}
+
+	if ( vm->instrs == NULL ) vm_decode(vm);
+	memo_find_pure(vm);	// so a hit needn't
+	Image_Header h = {{'W','V','M','I'}, IMAGE_VERSION, key,
+					  (uint32_t)vm->num_strings, (uint32_t)vm->funcs.n, (uint32_t)vm->code_size,
+					  (uint32_t)vm->num_instrs, vm->untagged, 0};
+	fwrite(&h, sizeof(h), 1, f);
+	for (int i = 0; i < vm->num_strings; i++) {
+		String *s = vm->strings[i];
+		uint32_t len = s != NULL ? (uint32_t)s->length : NO_STRING;
+		fwrite(&len, sizeof(len), 1, f);
+		if ( s != NULL ) fwrite(String_str(s), 1, s->length, f);
+	}
+	for (int i = 0; i < vm->funcs.n; i++) {
+		Function *fn = &vm->funcs.functions[i];
+		Image_Function g = {fn->addr, fn->nargs, fn->nlocals, fn->body, fn->entry_pc, fn->body_pc,
+							fn->pure, (uint32_t)strlen(fn->name)};
+		fwrite(&g, sizeof(g), 1, f);
+		fwrite(fn->name, 1, g.name_length, f);
+	}
+	fwrite(vm->code, 1, (size_t)vm->code_size, f);
+	fwrite(vm->instrs, sizeof(Instr), (size_t)vm->num_instrs, f);
+
+	bool ok = !ferror(f);
+	ok = fclose(f) == 0 && ok;
+	if ( ok && rename(tmp, path) == 0 ) {
+		__sync_fetch_and_add(&stats.writes, 1);
+	}
+	else {
+		remove(tmp);
+		__sync_fetch_and_add(&stats.errors, 1);
+	}
+}
+
+// S U P P O R T
+
+static void image_path(char *buf, size_t size, uint64_t key) {
+	snprintf(buf, size, "%s/%016llx.wvm", cache_dir, (unsigned long long)key);
+}
+
+static bool get32(const char **p, const char *end, uint32_t *v) {
+	if ( (size_t)(end - *p) < sizeof(uint32_t) ) return false;
+	memcpy(v, *p, sizeof(uint32_t));
+	*p += sizeof(uint32_t);
+	return true;
+}
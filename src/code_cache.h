@@ -0,0 +1,35 @@
+#ifndef CODE_CACHE_H_
+#define CODE_CACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "vm.h"
+
+/* On-disk cache of loaded programs. An image holds what vm_load_file()
+ * produced from a .bytecode text in <dir>/<key>.wvm, where key is a hash
+ * of the text: strings, functions, the final code, the decoded and
+ * type-annotated instrs and which functions are pure, so a hit runs none
+ * of the load-time passes. Natives are bound after loading and aren't in
+ * it. Images are written to a temporary file and renamed into place so a
+ * reader never sees half of one; an image that doesn't check out is
+ * counted as an error and a miss, and gets rewritten.
+ */
+typedef struct {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long writes;
+	unsigned long errors;	// bad images and failed writes
+} Cache_Stats;
+
+extern void vm_set_cache_dir(const char *dir);	// NULL turns the cache off, the default
+extern const char *vm_cache_dir();
+extern Cache_Stats vm_cache_stats();
+extern void vm_cache_reset_stats();
+
+// used by vm_load_file()
+extern uint64_t cache_key(const char *text, size_t size);	// never 0
+extern VM *cache_load(uint64_t key);						// NULL on a miss
+extern void cache_store(VM *vm, uint64_t key);
+
+#endif
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+#include "decode.h"
+#include "functions.h"
+#include "type_infer.h"
+#include "jit.h"
+#include "natives.h"
+#include "lazy.h"
+
+static int32_t get32(const byte *code, addr32 ip);
+static int16_t get16(const byte *code, addr32 ip);
+
+void vm_decode(VM *vm) {
+	if ( vm->program != NULL ) return; // shared, and decoded when it was made
+	if ( vm->lazy != NULL ) {	// the whole program from now on
+		vm_load_all(vm);
+		vm_lazy_free(vm);
+	}
+	const byte *code = vm->code;
+	addr32 code_size = vm->code_size > 0 ? (addr32)vm->code_size : 0;
+	int *index = malloc((code_size + 1) * sizeof(int)); // bytecode address -> instruction index
+	memset(index, -1, (code_size + 1) * sizeof(int));
+
+	int n = 0;
+	addr32 ip = 0;
+	while ( ip < code_size ) {	// find the instruction boundaries
+		byte opcode = code[ip];
+		if ( opcode >= NUM_INSTRS ) {	// can't tell where the next one starts; runs as an invalid opcode
+			index[ip] = n++;
+			break;
+		}
+		VM_INSTRUCTION *I = &vm_instructions[opcode];
+		addr32 next = ip + 1 + I->opnd_sizes[0] + I->opnd_sizes[1];
+		if ( next > code_size ) {
+			fprintf(stderr, "truncated %s at ip=%d\n", I->name, ip);
+			break;
+		}
+		index[ip] = n++;
+		ip = next;
+	}
+	index[code_size] = n; // falling off the end stops the program, as before
+
+	free(vm->instrs);
+	vm->pure_known = false;
+	vm->instrs = malloc((size_t)(n > 0 ? n : 1) * sizeof(Instr));
+	vm->num_instrs = n;
+	ip = 0;
+	for (int i = 0; i < n; i++) {
+		Instr *d = &vm->instrs[i];
+		addr32 next = decode_instr(vm, d, ip);
+		if ( d->opcode >= NUM_INSTRS && d->opcode != CALL_CACHED && d->opcode != NCALL_CACHED ) break;
+		int target;
+		switch ( d->opcode ) {
+			case CALL: // a call to somewhere without a name is just a jump
+			case BR:
+			case BRF:
+				target = (addr32)d->a <= code_size ? index[d->a] : -1;
+				if ( target < 0 ) { // the old interpreter would have run off into the weeds
+					fprintf(stderr, "%s to %d at ip=%d is not an instruction\n", vm_instructions[d->opcode].name, d->a, ip);
+					target = n;
+				}
+				d->a = target;
+				break;
+			default:
+				break;
+		}
+		ip = next;
+	}
+
+	for (int i = 0; i < vm->funcs.n; i++) {
+		Function *f = &vm->funcs.functions[i];
+		f->entry_pc = f->addr <= code_size && index[f->addr] >= 0 ? index[f->addr] : n;
+		f->body_pc = f->body <= code_size && index[f->body] >= 0 ? index[f->body] : f->entry_pc;
+	}
+	free(index);
+	vm_infer_types(vm);
+	if ( vm->jit != NULL ) jit_flush(vm);
+}
+
+/* The instruction at ip, operands and all, with calls resolved: CALL to a
+ * known function becomes CALL_CACHED (the first call also gives the
+ * function its nargs) and NCALL to a bound native NCALL_CACHED. Branch
+ * targets and other CALLs are left as addresses. Returns the next ip.
+ */
+addr32 decode_instr(VM *vm, Instr *d, addr32 ip) {
+	const byte *code = vm->code;
+	byte opcode = code[ip];
+	*d = (Instr) {.opcode = opcode, .addr = ip};
+	if ( opcode >= NUM_INSTRS ) return ip + 1;
+	VM_INSTRUCTION *I = &vm_instructions[opcode];
+	if ( I->opnd_sizes[0] == 4 ) d->a = get32(code, ip + 1);
+	else if ( I->opnd_sizes[0] == 2 ) d->a = get16(code, ip + 1);
+	if ( I->opnd_sizes[1] == 2 ) d->b = get16(code, ip + 1 + I->opnd_sizes[0]);
+
+	Function *f;
+	int native;
+	switch ( opcode ) {
+		case NCALL:
+			native = d->a >= 0 && d->a < vm->num_strings && vm->strings[d->a] != NULL ?
+					 native_named(vm, String_str(vm->strings[d->a])) : -1;
+			if ( native >= 0 ) {
+				d->opcode = NCALL_CACHED;
+				d->a = native;
+			}
+			break;
+		case CALL:
+			f = function_at(&vm->funcs, (addr32)d->a);
+			if ( f != NULL ) {
+				d->opcode = CALL_CACHED;
+				d->a = function_index(&vm->funcs, f);
+				if ( f->nargs < 0 ) f->nargs = d->b;
+			}
+			break;
+		default:
+			break;
+	}
+	return ip + 1 + I->opnd_sizes[0] + I->opnd_sizes[1];
+}
+
+int vm_instr_index(const VM *vm, addr32 ip) {
+	int lo = 0, hi = vm->num_instrs - 1;
+	while ( lo <= hi ) {
+		int mid = lo + (hi - lo) / 2;
+		if ( vm->instrs[mid].addr == ip ) return mid;
+		if ( vm->instrs[mid].addr < ip ) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return -1;
+}
+
+// S U P P O R T
+
+/* operands are unaligned in the bytecode; memcpy is the defined way to read them */
+static int32_t get32(const byte *code, addr32 ip) {
+	int32_t v;
+	memcpy(&v, &code[ip], sizeof(v));
+	return v;
+}
+
+static int16_t get16(const byte *code, addr32 ip) {
+	int16_t v;
+	memcpy(&v, &code[ip], sizeof(v));
+	return v;
+}
@@ -0,0 +1,20 @@
+#ifndef DECODE_H_
+#define DECODE_H_
+
+#include "vm.h"
+
+/* Load-time translation of vm->code into vm->instrs: one fixed-size,
+ * aligned Instr per bytecode instruction with its operands decoded,
+ * branch targets turned into instruction indexes and every CALL to a
+ * known function resolved to CALL_CACHED. Instr.addr maps back to the
+ * bytecode for traces and error messages. vm->code stays as it is.
+ */
+
+extern void vm_decode(VM *vm);
+// one instruction into d; returns the address of the next
+extern addr32 decode_instr(VM *vm, Instr *d, addr32 ip);
+
+// index of the instruction at bytecode address ip, or -1 if there isn't one
+extern int vm_instr_index(const VM *vm, addr32 ip);
+
+#endif
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include "functions.h"
+
+static unsigned int hash_name(const char *name);
+static unsigned int hash_addr(addr32 addr);
+static int by_addr(const void *a, const void *b);
+static void scan_code(Function_Table *t, const byte *code, int code_size);
+static int get(const byte *code, addr32 ip, int size);
+
+void function_table_init(Function_Table *t, Function *functions, int n, const byte *code, int code_size) {
+	t->functions = functions;
+	t->n = n;
+	qsort(functions, (size_t)n, sizeof(Function), by_addr);
+
+	unsigned int size = 8;
+	while ( size < 2 * (unsigned int)n ) size *= 2; // load factor <= 1/2
+	t->mask = size - 1;
+	t->by_name = malloc(size * sizeof(int));
+	t->by_addr = malloc(size * sizeof(int));
+	memset(t->by_name, -1, size * sizeof(int));
+	memset(t->by_addr, -1, size * sizeof(int));
+	for (int i = 0; i < n; i++) {
+		unsigned int h = hash_name(functions[i].name) & t->mask;
+		while ( t->by_name[h] >= 0 ) h = (h + 1) & t->mask;
+		t->by_name[h] = i;
+		h = hash_addr(functions[i].addr) & t->mask;
+		while ( t->by_addr[h] >= 0 ) h = (h + 1) & t->mask;
+		t->by_addr[h] = i;
+	}
+
+	for (int i = 0; i < n; i++) {
+		addr32 end = i + 1 < n ? functions[i+1].addr : (addr32)code_size;
+		functions[i].code_length = end - functions[i].addr;
+		functions[i].nargs = -1;
+		functions[i].nlocals = 0;
+		functions[i].body = functions[i].addr;
+	}
+	if ( code != NULL ) scan_code(t, code, code_size);
+}
+
+void function_table_free(Function_Table *t) {
+	for (int i = 0; i < t->n; i++) {
+		free(t->functions[i].name);
+	}
+	free(t->functions);
+	free(t->by_name);
+	free(t->by_addr);
+	memset(t, 0, sizeof(Function_Table));
+}
+
+void function_table_relocate(Function_Table *t, const addr32 *new_addr, addr32 old_size,
+							 const byte *code, int code_size) {
+	for (int i = 0; i < t->n; i++) {
+		Function *f = &t->functions[i];
+		f->addr = new_addr[f->addr <= old_size ? f->addr : old_size];
+	}
+	free(t->by_name);
+	free(t->by_addr);
+	function_table_init(t, t->functions, t->n, code, code_size);
+}
+
+Function *function_named(const Function_Table *t, const char *name) {
+	if ( t->n == 0 ) return NULL;
+	for (unsigned int h = hash_name(name) & t->mask; t->by_name[h] >= 0; h = (h + 1) & t->mask) {
+		Function *f = &t->functions[t->by_name[h]];
+		if ( strcmp(f->name, name) == 0 ) return f;
+	}
+	return NULL;
+}
+
+Function *function_at(const Function_Table *t, addr32 addr) {
+	if ( t->n == 0 ) return NULL;
+	for (unsigned int h = hash_addr(addr) & t->mask; t->by_addr[h] >= 0; h = (h + 1) & t->mask) {
+		Function *f = &t->functions[t->by_addr[h]];
+		if ( f->addr == addr ) return f;
+	}
+	return NULL;
+}
+
+Function *function_containing(const Function_Table *t, addr32 ip) {
+	int lo = 0, hi = t->n - 1;
+	Function *found = NULL;
+	while ( lo <= hi ) {	// last function starting at or before ip
+		int mid = lo + (hi - lo) / 2;
+		if ( t->functions[mid].addr <= ip ) {
+			found = &t->functions[mid];
+			lo = mid + 1;
+		}
+		else hi = mid - 1;
+	}
+	if ( found != NULL && ip - found->addr >= found->code_length ) return NULL;
+	return found;
+}
+
+// S U P P O R T
+
+static unsigned int hash_name(const char *name) {
+	unsigned int h = 2166136261u; // FNV-1a
+	for (const char *p = name; *p; p++) {
+		h = (h ^ (unsigned char)*p) * 16777619u;
+	}
+	return h;
+}
+
+static unsigned int hash_addr(addr32 addr) {
+	return addr * 2654435761u; // Knuth's multiplicative hash
+}
+
+static int by_addr(const void *a, const void *b) {
+	const Function *x = a, *y = b;
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* one pass over the instructions: nlocals from LOCALS at an entry point,
+ * nargs from the first CALL to each function
+ */
+static void scan_code(Function_Table *t, const byte *code, int code_size) {
+	addr32 ip = 0;
+	while ( ip < (addr32)code_size ) {
+		byte opcode = code[ip];
+		if ( opcode >= NUM_OPCODES ) break;
+		VM_INSTRUCTION *I = &vm_instructions[opcode];
+		addr32 next = ip + 1 + I->opnd_sizes[0] + I->opnd_sizes[1];
+		if ( next > (addr32)code_size ) break;
+		if ( opcode == LOCALS ) {
+			Function *f = function_at(t, ip);
+			if ( f != NULL ) {
+				f->nlocals = get(code, ip+1, 2);
+				f->body = next;
+			}
+		}
+		else if ( opcode == CALL ) {
+			Function *f = function_at(t, (addr32)get(code, ip+1, 4));
+			if ( f != NULL && f->nargs < 0 ) f->nargs = get(code, ip+5, 2);
+		}
+		ip = next;
+	}
+}
+
+/* signed operand of 2 or 4 bytes; unaligned, so memcpy rather than a pointer cast */
+static int get(const byte *code, addr32 ip, int size) {
+	if ( size == 2 ) {
+		int16_t v;
+		memcpy(&v, &code[ip], sizeof(v));
+		return v;
+	}
+	int32_t v;
+	memcpy(&v, &code[ip], sizeof(v));
+	return v;
+}
@@ -0,0 +1,26 @@
+#ifndef FUNCTIONS_H_
+#define FUNCTIONS_H_
+
+#include "vm.h"
+
+/* The function table: the header's functions sorted by address plus
+ * hash indexes by name and by entry address, so CALL, the tracer and
+ * host lookups cost the same no matter how big the program is.
+ */
+
+// takes ownership of functions and their names; code is scanned for nargs/nlocals
+extern void function_table_init(Function_Table *t, Function *functions, int n, const byte *code, int code_size);
+extern void function_table_free(Function_Table *t);
+// the code was rewritten: move every function to new_addr[old addr] and rescan
+extern void function_table_relocate(Function_Table *t, const addr32 *new_addr, addr32 old_size,
+									const byte *code, int code_size);
+
+extern Function *function_named(const Function_Table *t, const char *name);
+extern Function *function_at(const Function_Table *t, addr32 addr);			// entry address only
+extern Function *function_containing(const Function_Table *t, addr32 ip);	// any address in its body
+
+static inline int function_index(const Function_Table *t, const Function *f) {
+	return (int)(f - t->functions);
+}
+
+#endif
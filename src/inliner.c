@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <string.h>
+#include "inliner.h"
+#include "functions.h"
+#include "decode.h"
+
+typedef struct {
+	byte *code;
+	addr32 size;
+	addr32 capacity;
+} Emitter;
+
+typedef struct {
+	addr32 pos;				// where the 32-bit operand is in the new code
+	addr32 target;			// old address it has to point at
+} Fixup;
+
+static int func_end(const VM *vm, int i);
+static int slots_used(const VM *vm, int from, int to, int declared);
+static bool inlinable(const VM *vm, int i, int max_bytes);
+static addr32 old_target(const VM *vm, const Instr *I);
+static int old_operand(const VM *vm, const Instr *I);
+static void emit_inline(Emitter *out, const VM *vm, int callee, int base);
+static addr32 emit(Emitter *out, int opcode, int a, int b);
+static int instr_size(int opcode);
+
+int vm_inline(VM *vm, int max_bytes) {
+	if ( vm->program != NULL ) return 0; // shared code stays as it is
+	if ( vm->instrs == NULL || vm->lazy != NULL ) vm_decode(vm);
+	Function_Table *t = &vm->funcs;
+	int n = vm->num_instrs;
+	for (int pc = 0; pc < n; pc++) {
+		int opcode = vm->instrs[pc].opcode;
+		if ( opcode >= NUM_INSTRS && opcode != CALL_CACHED && opcode != NCALL_CACHED ) return 0; // can't re-encode
+	}
+
+	int *slots = calloc((size_t)t->n + 1, sizeof(int));		// frame slots each function uses
+	int *extra = calloc((size_t)t->n + 1, sizeof(int));		// slots added for inlined bodies
+	bool *leaf = calloc((size_t)t->n + 1, sizeof(bool));
+	int *inline_at = malloc(((size_t)n + 1) * sizeof(int));	// callee to substitute at each pc, or -1
+	for (int i = 0; i < t->n; i++) {
+		Function *f = &t->functions[i];
+		slots[i] = slots_used(vm, f->entry_pc, func_end(vm, i), (f->nargs > 0 ? f->nargs : 0) + f->nlocals);
+		leaf[i] = inlinable(vm, i, max_bytes);
+	}
+	int ninlined = 0;
+	for (int pc = 0; pc < n; pc++) inline_at[pc] = -1;
+	for (int i = 0; i < t->n; i++) {
+		for (int pc = t->functions[i].entry_pc; pc < func_end(vm, i); pc++) {
+			Instr *I = &vm->instrs[pc];
+			if ( I->opcode != CALL_CACHED || I->a == i || !leaf[I->a] ) continue;
+			if ( I->b != t->functions[I->a].nargs || slots[i] + slots[I->a] > MAX_LOCALS ) continue;
+			inline_at[pc] = I->a;
+			if ( slots[I->a] > extra[i] ) extra[i] = slots[I->a]; // copies never overlap in time: share slots
+			ninlined++;
+		}
+	}
+
+	if ( ninlined > 0 ) {
+		Emitter out = {malloc((size_t)vm->code_size + 64), 0, (addr32)vm->code_size + 64};
+		addr32 old_size = (addr32)vm->code_size;
+		addr32 *map = malloc((old_size + 1) * sizeof(addr32));	// old address -> new
+		for (addr32 a = 0; a <= old_size; a++) map[a] = UINT32_MAX;
+		Fixup *fixups = malloc(((size_t)n + 1) * sizeof(Fixup));
+		int nfixups = 0;
+		int cur = -1, next = 0;
+		for (int pc = 0; pc < n; pc++) {
+			Instr *I = &vm->instrs[pc];
+			bool entry = false;
+			while ( next < t->n && t->functions[next].entry_pc <= pc ) {
+				cur = next++;
+				entry = t->functions[cur].entry_pc == pc;
+			}
+			map[I->addr] = out.size;
+			if ( entry && extra[cur] > 0 ) {
+				Function *f = &t->functions[cur];
+				int nlocals = slots[cur] + extra[cur] - (f->nargs > 0 ? f->nargs : 0);
+				emit(&out, LOCALS, nlocals, 0);
+				if ( I->opcode == LOCALS ) continue; // replaced
+			}
+			if ( inline_at[pc] >= 0 ) {
+				emit_inline(&out, vm, inline_at[pc], slots[cur]);
+				continue;
+			}
+			switch ( I->opcode ) {
+				case BR:
+				case BRF:
+				case CALL:
+				case CALL_CACHED:
+					fixups[nfixups++] = (Fixup) {emit(&out, I->opcode == CALL_CACHED ? CALL : I->opcode, 0, I->b) + 1,
+												 old_target(vm, I)};
+					break;
+				case NCALL_CACHED: // back to the name's string index
+					emit(&out, NCALL, old_operand(vm, I), I->b);
+					break;
+				default:
+					emit(&out, I->opcode, I->a, I->b);
+					break;
+			}
+		}
+		map[old_size] = out.size;
+		for (addr32 a = old_size; a-- > 0;) {	// addresses inside an instruction go with the next one
+			if ( map[a] == UINT32_MAX ) map[a] = map[a+1];
+		}
+		for (int i = 0; i < nfixups; i++) {
+			int32_t target = (int32_t)map[fixups[i].target];
+			memcpy(&out.code[fixups[i].pos], &target, sizeof(target));
+		}
+
+		free(vm->code);
+		vm->code = out.code;
+		vm->code_size = (int)out.size;
+		function_table_relocate(t, map, old_size, vm->code, vm->code_size);
+		vm_decode(vm);
+		free(fixups);
+		free(map);
+	}
+	free(slots);
+	free(extra);
+	free(leaf);
+	free(inline_at);
+	return ninlined;
+}
+
+// S U P P O R T
+
+static int func_end(const VM *vm, int i) {
+	const Function_Table *t = &vm->funcs;
+	return i + 1 < t->n ? t->functions[i+1].entry_pc : vm->num_instrs;
+}
+
+/* declared args + locals, or more if the code uses higher slots anyway */
+static int slots_used(const VM *vm, int from, int to, int declared) {
+	int n = declared;
+	for (int pc = from; pc < to; pc++) {
+		const Instr *I = &vm->instrs[pc];
+		if ( (I->opcode == LOAD || I->opcode == STORE || I->opcode == SFREE) && I->a + 1 > n ) n = I->a + 1;
+	}
+	return n;
+}
+
+static bool inlinable(const VM *vm, int i, int max_bytes) {
+	const Function *f = &vm->funcs.functions[i];
+	int from = f->entry_pc, to = func_end(vm, i);
+	if ( f->nargs < 0 || from >= to || f->code_length > (addr32)max_bytes ) return false;
+	for (int pc = from; pc < to; pc++) {
+		const Instr *I = &vm->instrs[pc];
+		if ( I->opcode == CALL || I->opcode == CALL_CACHED ) return false;
+		if ( (I->opcode == BR || I->opcode == BRF) && (I->a < from || I->a >= to) ) return false;
+	}
+	return true;
+}
+
+static addr32 old_target(const VM *vm, const Instr *I) {
+	if ( I->opcode == CALL_CACHED ) return vm->funcs.functions[I->a].addr;
+	return I->a < vm->num_instrs ? vm->instrs[I->a].addr : (addr32)vm->code_size;
+}
+
+/* first operand as it is in vm->code, before decoding resolved it */
+static int old_operand(const VM *vm, const Instr *I) {
+	int32_t a;
+	memcpy(&a, &vm->code[I->addr + 1], sizeof(a));
+	return a;
+}
+
+/* args off the stack into slots base.., then the body with its locals moved up by base */
+static void emit_inline(Emitter *out, const VM *vm, int callee, int base) {
+	const Function *f = &vm->funcs.functions[callee];
+	int from = f->entry_pc, to = func_end(vm, callee);
+	for (int k = f->nargs - 1; k >= 0; k--) {
+		emit(out, STORE, base + k, 0);
+	}
+	addr32 *at = malloc(((size_t)(to - from) + 1) * sizeof(addr32));	// offset of each body instruction
+	addr32 size = 0;
+	for (int pc = from; pc < to; pc++) {
+		int opcode = vm->instrs[pc].opcode;
+		at[pc - from] = size;
+		if ( opcode == LOCALS || (opcode == RET && pc == to - 1) ) continue; // the last RET just falls through
+		size += instr_size(opcode == RET ? BR : opcode);
+	}
+	at[to - from] = size;
+	addr32 start = out->size;
+	for (int pc = from; pc < to; pc++) {
+		const Instr *I = &vm->instrs[pc];
+		switch ( I->opcode ) {
+			case LOCALS:
+				break;
+			case RET:
+				if ( pc < to - 1 ) emit(out, BR, (int)(start + at[to - from]), 0);
+				break;
+			case BR:
+			case BRF:
+				emit(out, I->opcode, (int)(start + at[I->a - from]), 0);
+				break;
+			case LOAD:
+			case STORE:
+			case SFREE:
+				emit(out, I->opcode, I->a + base, 0);
+				break;
+			case NCALL_CACHED:
+				emit(out, NCALL, old_operand(vm, I), I->b);
+				break;
+			default:
+				emit(out, I->opcode, I->a, I->b);
+				break;
+		}
+	}
+	free(at);
+}
+
+/* append one instruction; returns its address */
+static addr32 emit(Emitter *out, int opcode, int a, int b) {
+	VM_INSTRUCTION *I = &vm_instructions[opcode];
+	if ( out->size + 7 > out->capacity ) {
+		out->capacity *= 2;
+		out->code = realloc(out->code, out->capacity);
+	}
+	addr32 ip = out->size;
+	out->code[out->size++] = (byte)opcode;
+	if ( I->opnd_sizes[0] == 4 ) {
+		int32_t v = a;
+		memcpy(&out->code[out->size], &v, sizeof(v));
+	}
+	else if ( I->opnd_sizes[0] == 2 ) {
+		int16_t v = (int16_t)a;
+		memcpy(&out->code[out->size], &v, sizeof(v));
+	}
+	out->size += I->opnd_sizes[0];
+	if ( I->opnd_sizes[1] == 2 ) {
+		int16_t v = (int16_t)b;
+		memcpy(&out->code[out->size], &v, sizeof(v));
+	}
+	out->size += I->opnd_sizes[1];
+	return ip;
+}
+
+static int instr_size(int opcode) {
+	return 1 + vm_instructions[opcode].opnd_sizes[0] + vm_instructions[opcode].opnd_sizes[1];
+}
@@ -0,0 +1,20 @@
+#ifndef INLINER_H_
+#define INLINER_H_
+
+#include "vm.h"
+
+/* Bytecode inliner. Every CALL to a small leaf function (at most
+ * max_bytes of code, no calls of its own, branches only within itself)
+ * is replaced by a copy of its body: the arguments are STOREd into
+ * fresh locals of the caller, the callee's locals are renumbered onto
+ * them, LOCALS goes away and each RET becomes a BR past the copy. The
+ * caller's LOCALS grows to cover the new slots (or one is added), every
+ * branch and CALL target is moved and the function table is rebuilt for
+ * the new code. Sites whose caller would need more than MAX_LOCALS are
+ * left alone. The callees themselves stay, for other callers and hosts.
+ * Returns the number of call sites inlined.
+ */
+
+extern int vm_inline(VM *vm, int max_bytes);
+
+#endif
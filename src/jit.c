@@ -0,0 +1,507 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include "jit.h"
+#include "decode.h"
+#include "profiler.h"
+
+#if defined(__x86_64__)
+#define JIT_X86_64 1
+#endif
+
+#define JIT_MAX_DEPTH 5		// operand stack slots, one register each
+#define JIT_LOCAL_REGS 5	// locals kept in registers while in the trace
+#define JIT_CODE_MAX (JIT_MAX_TRACE * 32 + MAX_LOCALS * 24 + \
+					  JIT_MAX_EXITS * (JIT_LOCAL_REGS + JIT_MAX_DEPTH) * 20 + 128)
+
+/* one recorded instruction */
+typedef struct {
+	int opcode;
+	int a;
+	int pc;					// IDIV: where to deoptimize to
+	element_type tag;		// LOAD, STORE: the type of the value
+	int exit_pc;			// BRF: where the side exit goes, the way the recording didn't
+	bool taken;				// BRF: branched while recording
+} Rec;
+
+typedef struct {
+	Rec rec[JIT_MAX_TRACE];
+	int n;
+	element_type guard[MAX_LOCALS];	// type a local must have on entry; INVALID if not read first
+	Jit_Trace *t;						// set if the loop closed
+} Recording;
+
+static void jit_tables(VM *vm);
+static void free_traces(VM_Jit *j);
+static int record(VM *vm, int header, Recording *r);
+static bool compile(VM *vm, Recording *r);
+
+bool vm_jit_enable(VM *vm, bool perf_map) {
+#ifdef JIT_X86_64
+	vm_jit_disable(vm);
+	if ( vm->instrs == NULL ) vm_decode(vm);
+	vm->jit = calloc(1, sizeof(VM_Jit));
+	if ( perf_map ) vm->jit->perf_map = perf_map_open();
+	jit_tables(vm);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void vm_jit_disable(VM *vm) {
+	if ( vm->jit == NULL ) return;
+	free_traces(vm->jit);
+	free(vm->jit->counts);
+	free(vm->jit->traces);
+	perf_map_close(vm->jit->perf_map);
+	free(vm->jit);
+	vm->jit = NULL;
+}
+
+Jit_Stats vm_jit_stats(VM *vm) {
+	Jit_Stats none = {0};
+	return vm->jit != NULL ? vm->jit->stats : none;
+}
+
+void vm_jit_report(VM *vm, FILE *f) {
+	VM_Jit *j = vm->jit;
+	if ( j == NULL ) return;
+	Jit_Stats s = j->stats;
+	fprintf(f, "jit: %llu traces, %llu aborted, %llu entries, %llu side exits, %llu deopts, %llu guard failures\n",
+			(unsigned long long)s.compiled, (unsigned long long)s.aborted, (unsigned long long)s.entries,
+			(unsigned long long)s.side_exits, (unsigned long long)s.deopts, (unsigned long long)s.guard_fails);
+	for (int pc = 0; pc < j->n; pc++) {
+		Jit_Trace *t = j->traces[pc];
+		if ( t == NULL ) continue;
+		fprintf(f, "  loop at %04d: %d instrs, %llu entries, %llu iterations%s\n",
+				vm->instrs[pc].addr, t->length, (unsigned long long)t->entries,
+				(unsigned long long)t->iterations, t->dropped ? " (dropped)" : "");
+		for (int e = 1; e < t->nexits; e++) {
+			fprintf(f, "    %s to %04d: %llu\n", t->exits[e].deopt ? "deopt" : "exit",
+					t->exits[e].pc < vm->num_instrs ? vm->instrs[t->exits[e].pc].addr : vm->code_size,
+					(unsigned long long)t->exits[e].count);
+		}
+	}
+}
+
+int jit_loop(VM *vm, int header) {
+	VM_Jit *j = vm->jit;
+	Jit_Trace *t = j->traces[header];
+	if ( t == NULL ) {
+		if ( j->counts[header] < 0 || ++j->counts[header] < JIT_HOT ) return header;
+		Recording r;
+		int pc = record(vm, header, &r);
+		if ( r.t == NULL || !compile(vm, &r) ) {
+			j->counts[header] = -1; // not again
+			j->stats.aborted++;
+			return pc;
+		}
+		t = j->traces[header] = r.t;
+		j->stats.compiled++;
+	}
+	if ( t->dropped || vm->sp + JIT_MAX_DEPTH >= MAX_OPND_STACK ) return header;
+
+	t->entries++;
+	j->stats.entries++;
+	int e = t->code(vm->call_stack[vm->callsp].locals, &t->iterations, &vm->stack[vm->sp + 1]);
+	if ( e == 0 ) {
+		j->stats.guard_fails++;
+		if ( ++t->guard_fails >= JIT_MAX_GUARD_FAILS ) t->dropped = true;
+		return header;
+	}
+	t->guard_fails = 0;
+	t->exits[e].count++;
+	if ( t->exits[e].deopt ) j->stats.deopts++;
+	else j->stats.side_exits++;
+	vm->sp += t->exits[e].depth; // the exit stub left them just above sp
+	return t->exits[e].pc;
+}
+
+void jit_flush(VM *vm) {
+	free_traces(vm->jit);
+	jit_tables(vm);
+}
+
+// S U P P O R T
+
+static void jit_tables(VM *vm) {
+	VM_Jit *j = vm->jit;
+	free(j->counts);
+	free(j->traces);
+	j->n = vm->num_instrs;
+	j->counts = calloc((size_t)j->n + 1, sizeof(int));
+	j->traces = calloc((size_t)j->n + 1, sizeof(Jit_Trace *));
+}
+
+static void free_traces(VM_Jit *j) {
+	for (int pc = 0; pc < j->n; pc++) {
+		Jit_Trace *t = j->traces[pc];
+		if ( t == NULL ) continue;
+		munmap((void *)t->code, t->code_size);
+		free(t);
+	}
+}
+
+/* Interpret from header until it comes round again, keeping each
+ * instruction. It runs for real on vm's stacks, so wherever it stops the
+ * engine can carry on from the pc it returns: header if the loop closed,
+ * else the instruction that couldn't be traced (not yet executed).
+ */
+static int record(VM *vm, int header, Recording *r) {
+	Activation_Record *frame = &vm->call_stack[vm->callsp];
+	int base = vm->sp;
+	bool stored[MAX_LOCALS] = {false};
+	element x, y;
+	memset(r, 0, sizeof(Recording));
+	int pc = header;
+	do {
+		Instr *I = &vm->instrs[pc];
+		int depth = vm->sp - base;
+		if ( r->n == JIT_MAX_TRACE ) return pc;
+		Rec *rec = &r->rec[r->n];
+		*rec = (Rec) {.opcode = I->opcode, .a = I->a, .pc = pc};
+		switch ( I->opcode ) {
+			case IADD: case ISUB: case IMUL:
+			case IEQ: case INEQ: case ILT: case ILE: case IGT: case IGE:
+			case AND: case OR:
+				if ( depth < 2 ) return pc;
+				y = vm->stack[vm->sp--];
+				x = vm->stack[vm->sp--];
+				switch ( I->opcode ) {
+					case IADD: x = (element) {.type = INT, .i = x.i + y.i}; break;
+					case ISUB: x = (element) {.type = INT, .i = x.i - y.i}; break;
+					case IMUL: x = (element) {.type = INT, .i = x.i * y.i}; break;
+					case IEQ:  x = (element) {.type = BOOLEAN, .b = x.i == y.i}; break;
+					case INEQ: x = (element) {.type = BOOLEAN, .b = x.i != y.i}; break;
+					case ILT:  x = (element) {.type = BOOLEAN, .b = x.i < y.i}; break;
+					case ILE:  x = (element) {.type = BOOLEAN, .b = x.i <= y.i}; break;
+					case IGT:  x = (element) {.type = BOOLEAN, .b = x.i > y.i}; break;
+					case IGE:  x = (element) {.type = BOOLEAN, .b = x.i >= y.i}; break;
+					case AND:  x = (element) {.type = BOOLEAN, .b = x.b && y.b}; break;
+					default:   x = (element) {.type = BOOLEAN, .b = x.b || y.b}; break;
+				}
+				vm->stack[++vm->sp] = x;
+				pc++;
+				break;
+			case IDIV:	// the trace deoptimizes on 0 and -1, so leave those to the interpreter here too
+				if ( depth < 2 || vm->stack[vm->sp].i == 0 || vm->stack[vm->sp].i == -1 ) return pc;
+				y = vm->stack[vm->sp--];
+				vm->stack[vm->sp].i /= y.i;
+				pc++;
+				break;
+			case INEG:
+				if ( depth < 1 ) return pc;
+				vm->stack[vm->sp].i = -vm->stack[vm->sp].i;
+				pc++;
+				break;
+			case NOT:
+				if ( depth < 1 ) return pc;
+				vm->stack[vm->sp].b = !vm->stack[vm->sp].b;
+				pc++;
+				break;
+			case ICONST:
+				if ( depth == JIT_MAX_DEPTH ) return pc;
+				vm->stack[++vm->sp] = (element) {.type = INT, .i = I->a};
+				pc++;
+				break;
+			case LOAD:
+				if ( I->a < 0 || I->a >= MAX_LOCALS ) return pc;
+				x = frame->locals[I->a];
+				if ( depth == JIT_MAX_DEPTH || (x.type != INT && x.type != BOOLEAN) ) return pc;
+				if ( !stored[I->a] && r->guard[I->a] == INVALID ) r->guard[I->a] = x.type;
+				rec->tag = x.type;
+				vm->stack[++vm->sp] = x;
+				pc++;
+				break;
+			case STORE:
+				if ( depth < 1 || I->a < 0 || I->a >= MAX_LOCALS ) return pc;
+				x = vm->stack[vm->sp--];
+				rec->tag = x.type;
+				stored[I->a] = true;
+				frame->locals[I->a] = x;
+				pc++;
+				break;
+			case POP:
+				if ( depth < 1 ) return pc;
+				vm->sp--;
+				pc++;
+				break;
+			case BR:
+				pc = I->a;
+				break;
+			case BRF:
+				if ( depth < 1 ) return pc;
+				rec->taken = !vm->stack[vm->sp--].b;
+				rec->exit_pc = rec->taken ? pc + 1 : I->a;
+				pc = rec->taken ? I->a : pc + 1;
+				break;
+			default:
+				return pc;
+		}
+		r->n++;
+	} while ( pc != header && pc < vm->num_instrs );
+	if ( pc != header || vm->sp != base ) return pc;
+	for (int i = 0; i < MAX_LOCALS; i++) {	// the next trip must meet the same guards
+		if ( r->guard[i] != INVALID && frame->locals[i].type != r->guard[i] ) return pc;
+	}
+
+	r->t = calloc(1, sizeof(Jit_Trace));
+	r->t->header = header;
+	r->t->length = r->n;
+	r->t->nexits = 1;
+	r->t->exits[0].pc = header;
+	return pc;
+}
+
+#ifdef JIT_X86_64
+
+enum { RAX=0, RCX=1, RDX=2, RBX=3, RBP=5, RSI=6, RDI=7, R8=8, R9=9, R10=10, R11=11, R12=12, R13=13, R14=14, R15=15 };
+enum { CC_E=0x4, CC_NE=0x5, CC_L=0xC, CC_GE=0xD, CC_LE=0xE, CC_G=0xF };
+
+static const int REG[JIT_MAX_DEPTH] = {R8, R9, R10, R11, RCX};			// operand stack slot -> register
+static const int LREG[JIT_LOCAL_REGS] = {RBX, R12, R13, R14, R15};		// callee saved
+static const int SAVED[] = {RBX, RBP, R12, R13, R14, R15};
+
+typedef struct {
+	byte buf[JIT_CODE_MAX];
+	int n;
+} Asm;
+
+/* what the interpreter's state looks like at an exit, for the stub to rebuild it */
+typedef struct {
+	int depth;								// operand stack slots live in REG[]
+	element_type stack[JIT_MAX_DEPTH];
+	element_type local[JIT_LOCAL_REGS];		// types of the locals in LREG[]
+} Exit_State;
+
+static void b1(Asm *a, int x) { a->buf[a->n++] = (byte)x; }
+static void b4(Asm *a, int32_t x) { memcpy(&a->buf[a->n], &x, 4); a->n += 4; }
+static void rex(Asm *a, int reg, int rm) { b1(a, 0x40 | (reg >> 3 & 1) << 2 | (rm >> 3 & 1)); }
+static void modrm(Asm *a, int mod, int reg, int rm) { b1(a, mod << 6 | (reg & 7) << 3 | (rm & 7)); }
+
+// op r/m32, r32 between registers: add 01, or 09, and 21, sub 29, cmp 39, test 85, mov 89
+static void alu(Asm *a, int op, int dst, int src) { rex(a, src, dst); b1(a, op); modrm(a, 3, src, dst); }
+// 32-bit load, byte load (zero extended) and store at [base + disp]; base is rdi or rbp
+static void load32(Asm *a, int r, int base, int disp) { rex(a, r, base); b1(a, 0x8B); modrm(a, 2, r, base); b4(a, disp); }
+static void load8(Asm *a, int r, int base, int disp) { rex(a, r, base); b1(a, 0x0F); b1(a, 0xB6); modrm(a, 2, r, base); b4(a, disp); }
+static void store32(Asm *a, int r, int base, int disp) { rex(a, r, base); b1(a, 0x89); modrm(a, 2, r, base); b4(a, disp); }
+static void store_imm(Asm *a, int base, int disp, int32_t v) { rex(a, 0, base); b1(a, 0xC7); modrm(a, 2, 0, base); b4(a, disp); b4(a, v); }
+static void cmp_imm(Asm *a, int disp, int32_t v) { b1(a, 0x81); modrm(a, 2, 7, RDI); b4(a, disp); b4(a, v); }
+static void mov_imm(Asm *a, int r, int32_t v) { rex(a, 0, r); b1(a, 0xB8 + (r & 7)); b4(a, v); }
+static void push(Asm *a, int r) { if ( r >= 8 ) b1(a, 0x41); b1(a, 0x50 + (r & 7)); }
+static void pop(Asm *a, int r) { if ( r >= 8 ) b1(a, 0x41); b1(a, 0x58 + (r & 7)); }
+// dst = cc ? 1 : 0
+static void setcc(Asm *a, int cc, int dst) {
+	rex(a, 0, dst); b1(a, 0x0F); b1(a, 0x90 + cc); modrm(a, 3, 0, dst);
+	rex(a, dst, dst); b1(a, 0x0F); b1(a, 0xB6); modrm(a, 3, dst, dst);
+}
+// jcc/jmp rel32 to be patched; returns where the rel32 is
+static int jcc(Asm *a, int cc) { b1(a, 0x0F); b1(a, 0x80 + cc); b4(a, 0); return a->n - 4; }
+static int jmp(Asm *a) { b1(a, 0xE9); b4(a, 0); return a->n - 4; }
+static void patch(Asm *a, int at, int target) { int32_t rel = target - (at + 4); memcpy(&a->buf[at], &rel, 4); }
+
+static int local_disp(int i, size_t field) { return (int)(i * sizeof(element) + field); }
+
+/* new exit to pc with the interpreter state as it is now, or -1 if there's no room */
+static int add_exit(Jit_Trace *t, Exit_State *states, int pc, bool deopt,
+					int depth, const element_type *stype, const element_type *ltype) {
+	if ( t->nexits == JIT_MAX_EXITS ) return -1;
+	int e = t->nexits++;
+	t->exits[e] = (Jit_Exit) {.pc = pc, .depth = depth, .deopt = deopt};
+	states[e].depth = depth;
+	memcpy(states[e].stack, stype, sizeof(states[e].stack));
+	memcpy(states[e].local, ltype, sizeof(states[e].local));
+	return e;
+}
+
+/* trace(locals = rdi, iterations = rsi, stack = rdx): save registers and
+ * keep the stack pointer in rbp; guards; the hottest locals read on entry
+ * move into LREG[]; the body, back to the top. Every exit but a failed
+ * guard writes the locals in registers back and pushes what's left on the
+ * trace's operand stack, so the interpreter picks up from that exact state.
+ */
+static bool compile(VM *vm, Recording *r) {
+	Asm as;
+	Asm *a = &as;
+	a->n = 0;
+	Jit_Trace *t = r->t;
+	Exit_State states[JIT_MAX_EXITS] = {{0}};
+	int exit_at[JIT_MAX_TRACE * 2 + MAX_LOCALS];	// rel32s to patch, and the exit each goes to
+	int exit_id[JIT_MAX_TRACE * 2 + MAX_LOCALS];
+	int njumps = 0;
+
+	// registers for the locals used most, of those with a known type on entry
+	int uses[MAX_LOCALS] = {0}, lreg[MAX_LOCALS];
+	bool stored[MAX_LOCALS] = {false};
+	for (int i = 0; i < r->n; i++) {
+		Rec *rec = &r->rec[i];
+		if ( rec->opcode == LOAD || rec->opcode == STORE ) uses[rec->a]++;
+		if ( rec->opcode == STORE ) stored[rec->a] = true;
+	}
+	int promoted[JIT_LOCAL_REGS], npromoted = 0;
+	for (int i = 0; i < MAX_LOCALS; i++) lreg[i] = -1;
+	while ( npromoted < JIT_LOCAL_REGS ) {
+		int best = -1;
+		for (int i = 0; i < MAX_LOCALS; i++) {
+			if ( r->guard[i] == INVALID || lreg[i] >= 0 ) continue;
+			if ( best < 0 || uses[i] > uses[best] ) best = i;
+		}
+		if ( best < 0 ) break;
+		lreg[best] = npromoted;
+		promoted[npromoted++] = best;
+	}
+
+	for (int k = 0; k < 6; k++) push(a, SAVED[k]);
+	b1(a, 0x48); b1(a, 0x89); modrm(a, 3, RDX, RBP);	// mov rbp, rdx
+	for (int i = 0; i < MAX_LOCALS; i++) {
+		if ( r->guard[i] == INVALID ) continue;
+		cmp_imm(a, local_disp(i, offsetof(element, type)), r->guard[i]);
+		exit_at[njumps] = jcc(a, CC_NE);
+		exit_id[njumps++] = 0;
+	}
+	element_type ltype[JIT_LOCAL_REGS] = {INVALID}, stype[JIT_MAX_DEPTH] = {INVALID};
+	for (int k = 0; k < npromoted; k++) {
+		int i = promoted[k];
+		ltype[k] = r->guard[i];
+		if ( r->guard[i] == BOOLEAN ) load8(a, LREG[k], RDI, local_disp(i, offsetof(element, b)));
+		else load32(a, LREG[k], RDI, local_disp(i, offsetof(element, i)));
+	}
+
+	int top = a->n;
+	int sp = 0;	// operand stack depth; REG[sp-1] is the top
+	for (int i = 0; i < r->n; i++) {
+		Rec *rec = &r->rec[i];
+		int x = sp >= 2 ? REG[sp-2] : RAX, y = sp >= 1 ? REG[sp-1] : RAX;
+		int e;
+		switch ( rec->opcode ) {
+			case IADD: alu(a, 0x01, x, y); sp--; stype[sp-1] = INT; break;
+			case ISUB: alu(a, 0x29, x, y); sp--; stype[sp-1] = INT; break;
+			case AND:  alu(a, 0x21, x, y); sp--; stype[sp-1] = BOOLEAN; break;
+			case OR:   alu(a, 0x09, x, y); sp--; stype[sp-1] = BOOLEAN; break;
+			case IMUL: rex(a, x, y); b1(a, 0x0F); b1(a, 0xAF); modrm(a, 3, x, y); sp--; stype[sp-1] = INT; break;
+			case IEQ:  alu(a, 0x39, x, y); setcc(a, CC_E, x); sp--; stype[sp-1] = BOOLEAN; break;
+			case INEQ: alu(a, 0x39, x, y); setcc(a, CC_NE, x); sp--; stype[sp-1] = BOOLEAN; break;
+			case ILT:  alu(a, 0x39, x, y); setcc(a, CC_L, x); sp--; stype[sp-1] = BOOLEAN; break;
+			case ILE:  alu(a, 0x39, x, y); setcc(a, CC_LE, x); sp--; stype[sp-1] = BOOLEAN; break;
+			case IGT:  alu(a, 0x39, x, y); setcc(a, CC_G, x); sp--; stype[sp-1] = BOOLEAN; break;
+			case IGE:  alu(a, 0x39, x, y); setcc(a, CC_GE, x); sp--; stype[sp-1] = BOOLEAN; break;
+			case IDIV:	// deoptimize before dividing by 0 or -1 (INT_MIN / -1 traps); the interpreter redoes it
+				e = add_exit(t, states, rec->pc, true, sp, stype, ltype);
+				if ( e < 0 ) {
+					free(t);
+					return false;
+				}
+				alu(a, 0x85, y, y);
+				exit_at[njumps] = jcc(a, CC_E);
+				exit_id[njumps++] = e;
+				rex(a, 0, y); b1(a, 0x83); modrm(a, 3, 7, y); b1(a, 0xFF);	// cmp y, -1
+				exit_at[njumps] = jcc(a, CC_E);
+				exit_id[njumps++] = e;
+				alu(a, 0x89, RAX, x);
+				b1(a, 0x99);											// cdq
+				rex(a, 0, y); b1(a, 0xF7); modrm(a, 3, 7, y);			// idiv y
+				alu(a, 0x89, x, RAX);
+				sp--;
+				stype[sp-1] = INT;
+				break;
+			case INEG: rex(a, 0, y); b1(a, 0xF7); modrm(a, 3, 3, y); break;
+			case NOT:  rex(a, 0, y); b1(a, 0x83); modrm(a, 3, 6, y); b1(a, 1); break; // xor y, 1
+			case ICONST:
+				stype[sp] = INT;
+				mov_imm(a, REG[sp++], rec->a);
+				break;
+			case LOAD:
+				stype[sp] = rec->tag;
+				if ( lreg[rec->a] >= 0 ) alu(a, 0x89, REG[sp++], LREG[lreg[rec->a]]);
+				else if ( rec->tag == BOOLEAN ) load8(a, REG[sp++], RDI, local_disp(rec->a, offsetof(element, b)));
+				else load32(a, REG[sp++], RDI, local_disp(rec->a, offsetof(element, i)));
+				break;
+			case STORE:
+				if ( lreg[rec->a] >= 0 ) {
+					alu(a, 0x89, LREG[lreg[rec->a]], y);
+					ltype[lreg[rec->a]] = rec->tag;
+				}
+				else {
+					store32(a, y, RDI, local_disp(rec->a, offsetof(element, i)));
+					store_imm(a, RDI, local_disp(rec->a, offsetof(element, type)), rec->tag);
+				}
+				sp--;
+				break;
+			case POP:
+				sp--;
+				break;
+			case BR:
+				break;
+			case BRF:	// leave where the recording didn't go
+				e = add_exit(t, states, rec->exit_pc, false, sp - 1, stype, ltype);
+				if ( e < 0 ) {
+					free(t);
+					return false;
+				}
+				alu(a, 0x85, y, y);
+				exit_at[njumps] = jcc(a, rec->taken ? CC_NE : CC_E);
+				exit_id[njumps++] = e;
+				sp--;
+				break;
+			default:
+				free(t);
+				return false;
+		}
+	}
+	b1(a, 0x48); b1(a, 0xFF); b1(a, 0x06);	// inc qword [rsi]
+	patch(a, jmp(a), top);
+
+	int stub[JIT_MAX_EXITS], ret_at[JIT_MAX_EXITS];
+	for (int e = 0; e < t->nexits; e++) {
+		stub[e] = a->n;
+		for (int k = 0; e > 0 && k < npromoted; k++) {	// exit 0 is before the locals were loaded
+			int i = promoted[k];
+			if ( !stored[i] ) continue;
+			store32(a, LREG[k], RDI, local_disp(i, offsetof(element, i)));
+			store_imm(a, RDI, local_disp(i, offsetof(element, type)), states[e].local[k]);
+		}
+		for (int s = 0; s < states[e].depth; s++) {
+			store32(a, REG[s], RBP, local_disp(s, offsetof(element, i)));
+			store_imm(a, RBP, local_disp(s, offsetof(element, type)), states[e].stack[s]);
+		}
+		b1(a, 0xB8); b4(a, e);	// mov eax, e
+		ret_at[e] = jmp(a);
+	}
+	int epilogue = a->n;
+	for (int k = 5; k >= 0; k--) pop(a, SAVED[k]);
+	b1(a, 0xC3);
+	for (int e = 0; e < t->nexits; e++) patch(a, ret_at[e], epilogue);
+	for (int k = 0; k < njumps; k++) patch(a, exit_at[k], stub[exit_id[k]]);
+
+	size_t size = (size_t)a->n;
+	void *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( code == MAP_FAILED ) {
+		free(t);
+		return false;
+	}
+	memcpy(code, a->buf, size);
+	if ( mprotect(code, size, PROT_READ | PROT_EXEC) != 0 ) {
+		munmap(code, size);
+		free(t);
+		return false;
+	}
+	t->code = (int (*)(element *, uint64_t *, element *))code;
+	t->code_size = size;
+
+	char name[64];
+	snprintf(name, sizeof(name), "trace_%04d", vm->instrs[t->header].addr);
+	perf_map_add(vm->jit->perf_map, code, size, name);
+	return true;
+}
+
+#else
+
+static bool compile(VM *vm, Recording *r) {
+	free(r->t);
+	return false;
+}
+
+#endif
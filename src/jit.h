@@ -0,0 +1,87 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+
+/* Tracing JIT for loops, x86-64 only. The plain and untagged engines
+ * count backward BR/BRF targets (loop headers); once a header has been
+ * reached JIT_HOT times the next trip around the loop is interpreted by
+ * a recorder, which keeps the path taken as a linear trace. The trace is
+ * compiled to native code: guards that the locals it reads still have
+ * the types they had while recording, then the body with the operand
+ * stack in registers, then a jump back to the top. Each BRF becomes a
+ * side exit to the direction that wasn't recorded.
+ *
+ * Entry is on-stack replacement: the engine is mid-function, so the trace
+ * takes over the live frame, moving the most used locals into registers,
+ * and works on top of whatever the operand stack already holds. Leaving
+ * is the reverse: a side exit, or a deopt where an assumption made while
+ * recording fails part way through an instruction (an IDIV by 0 or -1),
+ * writes the locals back and pushes the values the trace had on its
+ * stack, and vm_exec() carries on from that pc as if it had been
+ * interpreting all along.
+ *
+ * Only int/boolean arithmetic, comparisons, LOAD, STORE, ICONST, POP and
+ * branches can be traced; a loop with anything else (calls, strings,
+ * PRINT, deep expressions) is left to the interpreter for good. A trace
+ * whose guards keep failing is dropped.
+ */
+
+#define JIT_HOT 50				// backward branches to a header before it is traced
+#define JIT_MAX_TRACE 256		// instructions in a trace
+#define JIT_MAX_EXITS 32		// exit 0 is a failed type guard
+#define JIT_MAX_GUARD_FAILS 16	// in a row, then the trace goes
+
+typedef struct {
+	int pc;					// where vm_exec() goes on
+	int depth;				// values the exit pushes on the operand stack
+	bool deopt;				// a failed assumption, not a branch
+	uint64_t count;
+} Jit_Exit;
+
+typedef struct {
+	int header;				// loop header, an index into vm->instrs
+	int length;				// instructions recorded
+	int (*code)(element *locals, uint64_t *iterations, element *stack); // returns the exit taken
+	size_t code_size;
+	uint64_t entries;
+	uint64_t iterations;	// trips around the loop in native code
+	int guard_fails;		// in a row
+	bool dropped;
+	int nexits;
+	Jit_Exit exits[JIT_MAX_EXITS];
+} Jit_Trace;
+
+typedef struct {
+	uint64_t compiled;
+	uint64_t aborted;		// recordings that hit something that can't be traced
+	uint64_t entries;
+	uint64_t side_exits;
+	uint64_t deopts;
+	uint64_t guard_fails;
+} Jit_Stats;
+
+typedef struct vm_jit {
+	int n;					// vm->num_instrs when the tables were made
+	int *counts;			// per instruction: backward branches to it, -1 if it can't be traced
+	Jit_Trace **traces;		// per loop header
+	FILE *perf_map;			// so perf can name the traces; NULL if not asked for
+	Jit_Stats stats;
+} VM_Jit;
+
+// false if there's no native code generator for this machine
+extern bool vm_jit_enable(VM *vm, bool perf_map);
+extern void vm_jit_disable(VM *vm);
+extern Jit_Stats vm_jit_stats(VM *vm);
+extern void vm_jit_report(VM *vm, FILE *f);
+
+// called by the engines on a backward branch to header; returns where to go on
+extern int jit_loop(VM *vm, int header);
+// traces are for one decoding of the code; vm_decode() drops them
+extern void jit_flush(VM *vm);
+
+#endif
@@ -0,0 +1,165 @@
+#define _POSIX_C_SOURCE 200809L // munmap
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "lazy.h"
+#include "loader.h"
+#include "functions.h"
+#include "decode.h"
+
+static void load_region(VM *vm, int r);
+static int region_at(const VM_Lazy *L, addr32 addr);
+static int instr_in(const VM *vm, const Lazy_Region *g, addr32 addr);
+
+void vm_lazy_init(VM *vm, const char *text, size_t size, const char *instrs, int ninstr, int nbytes) {
+	VM_Lazy *L = calloc(1, sizeof(VM_Lazy));
+	L->text = text;
+	L->size = size;
+	Function_Table *t = &vm->funcs;
+	L->nregions = t->n + 1;
+	L->regions = calloc((size_t)L->nregions, sizeof(Lazy_Region));
+	for (int r = 0; r < L->nregions; r++) {
+		Lazy_Region *g = &L->regions[r];
+		g->addr = r > 0 ? t->functions[r-1].addr : 0;
+		g->end = r < t->n ? t->functions[r].addr : (addr32)nbytes;
+		g->first = -1;
+	}
+	pthread_mutex_init(&L->lock, NULL);
+
+	// sizes only: where each region's lines start and which instruction is its first
+	Scanner in = {instrs, text + size};
+	int n = 0, r = 0, lines;
+	addr32 ip = 0;
+	for (int i = 0; i < ninstr; i++) {
+		for (; r < L->nregions && L->regions[r].addr <= ip; r++) {
+			L->regions[r].text = in.p;
+			L->regions[r].first = n;
+		}
+		addr32 next = scan_instrs(NULL, &in, 1, NULL, ip, (addr32)nbytes, &lines);
+		if ( lines == 0 ) break;
+		if ( next > ip ) n++; // unknown mnemonics take no space
+		ip = next;
+	}
+	for (; r < L->nregions; r++) {
+		L->regions[r].text = in.p;
+		L->regions[r].first = n;
+	}
+	for (r = 0; r < L->nregions; r++) {
+		L->regions[r].count = (r + 1 < L->nregions ? L->regions[r+1].first : n) - L->regions[r].first;
+	}
+
+	vm_init(vm, calloc((size_t)nbytes, sizeof(byte)), nbytes); // untouched pages cost nothing until loaded
+	vm->instrs = calloc((size_t)(n > 0 ? n : 1), sizeof(Instr));
+	vm->num_instrs = n;
+	for (int i = 0; i < t->n; i++) {
+		t->functions[i].lazy = true;
+		t->functions[i].entry_pc = t->functions[i].body_pc = L->regions[i+1].first;
+	}
+	vm->lazy = L;
+	load_region(vm, 0); // where vm_exec() starts if there's no main
+}
+
+void vm_load_function(VM *vm, Function *f) {
+	VM_Lazy *L = vm->lazy;
+	if ( L == NULL ) return;
+	pthread_mutex_lock(&L->lock);
+	load_region(vm, function_index(&vm->funcs, f) + 1);
+	pthread_mutex_unlock(&L->lock);
+}
+
+void vm_load_all(VM *vm) {
+	VM_Lazy *L = vm->lazy;
+	if ( L == NULL ) return;
+	pthread_mutex_lock(&L->lock);
+	for (int r = 0; r < L->nregions; r++) load_region(vm, r);
+	pthread_mutex_unlock(&L->lock);
+}
+
+void vm_lazy_free(VM *vm) {
+	VM_Lazy *L = vm->lazy;
+	if ( L == NULL ) return;
+	munmap((void *)L->text, L->size);
+	free(L->regions);
+	pthread_mutex_destroy(&L->lock);
+	free(L);
+	vm->lazy = NULL;
+}
+
+int vm_lazy_loaded(VM *vm) {
+	int n = 0;
+	for (int i = 0; i < vm->funcs.n; i++) {
+		if ( !__atomic_load_n(&vm->funcs.functions[i].lazy, __ATOMIC_ACQUIRE) ) n++;
+	}
+	return n;
+}
+
+// S U P P O R T
+
+/* assemble region r into vm->code, decode it into vm->instrs and, if it's
+ * a function, fill in its LOCALS and let it run. The lock is held.
+ */
+static void load_region(VM *vm, int r) {
+	VM_Lazy *L = vm->lazy;
+	Lazy_Region *g = &L->regions[r];
+	if ( g->loaded ) return;
+	g->loaded = true;	// before branch targets, which may lead back here
+	L->loaded++;
+
+	Scanner in = {g->text, L->text + L->size};
+	scan_instrs(vm, &in, g->count, vm->code, g->addr, g->end, NULL);
+	addr32 ip = g->addr;
+	for (int i = g->first; i < g->first + g->count && ip < g->end; i++) {
+		ip = decode_instr(vm, &vm->instrs[i], ip);
+	}
+	for (int i = g->first; i < g->first + g->count; i++) {
+		Instr *d = &vm->instrs[i];
+		if ( d->opcode != BR && d->opcode != BRF && d->opcode != CALL ) continue;
+		addr32 target = (addr32)d->a;
+		int t = region_at(L, target);
+		if ( t >= 0 ) load_region(vm, t);
+		d->a = t >= 0 ? instr_in(vm, &L->regions[t], target) : -1;
+		if ( target == (addr32)vm->code_size ) d->a = vm->num_instrs; // falling off the end stops the program
+		else if ( d->a < 0 ) { // as vm_decode() would have it
+			fprintf(stderr, "%s to %d at ip=%d is not an instruction\n", vm_instructions[d->opcode].name, target, d->addr);
+			d->a = vm->num_instrs;
+		}
+	}
+
+	if ( r == 0 ) return;
+	Function *f = &vm->funcs.functions[r - 1];
+	f->entry_pc = g->first;
+	f->body_pc = g->first;
+	if ( g->count > 0 && vm->instrs[g->first].opcode == LOCALS ) {
+		f->nlocals = vm->instrs[g->first].a;
+		f->body = f->addr + 3;
+		f->body_pc = g->first + 1;
+	}
+	__atomic_store_n(&f->lazy, false, __ATOMIC_RELEASE);
+}
+
+// the region holding addr, -1 if it's past the end
+static int region_at(const VM_Lazy *L, addr32 addr) {
+	int lo = 0, hi = L->nregions - 1, found = -1;
+	while ( lo <= hi ) {
+		int mid = lo + (hi - lo) / 2;
+		if ( L->regions[mid].addr <= addr ) {
+			found = mid;
+			lo = mid + 1;
+		}
+		else hi = mid - 1;
+	}
+	return found >= 0 && addr < L->regions[found].end ? found : -1;
+}
+
+// index of the instruction at addr in a loaded region, -1 if none starts there
+static int instr_in(const VM *vm, const Lazy_Region *g, addr32 addr) {
+	int lo = g->first, hi = g->first + g->count - 1;
+	while ( lo <= hi ) {
+		int mid = lo + (hi - lo) / 2;
+		if ( vm->instrs[mid].addr == addr ) return mid;
+		if ( vm->instrs[mid].addr < addr ) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return -1;
+}
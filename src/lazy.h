@@ -0,0 +1,54 @@
+#ifndef LAZY_H_
+#define LAZY_H_
+
+#include <pthread.h>
+
+#include "vm.h"
+
+/* Lazy loading for big programs that only run a little of themselves.
+ * vm_load_file_lazy() (loader.h) reads the header and skims the
+ * instruction lines for their sizes only, which is enough to find where
+ * each function's lines start and how many instructions and bytes it
+ * has. vm->code and vm->instrs are allocated at full size but stay
+ * untouched (zero pages) except for the code before the first function.
+ *
+ * A function is assembled and decoded the first time it's reached: by
+ * CALL, vm_exec() of main, vm_call() or a branch into it from code being
+ * loaded. Until then Function.lazy is set. Loading takes a lock and
+ * publishes the body before clearing the flag, so a host thread calling
+ * vm_load_function() while the VM runs elsewhere can't leave it half a
+ * function.
+ *
+ * Code loaded this way runs tagged (no type inference). Anything that
+ * needs the whole program (vm_decode(), the inliner, memoization, batch)
+ * loads the rest first and the VM stops being lazy.
+ */
+
+typedef struct {
+	addr32 addr, end;		// its bytes of code
+	int first, count;		// its instructions
+	const char *text;		// its first instruction line
+	bool loaded;
+} Lazy_Region;
+
+typedef struct vm_lazy {
+	const char *text;		// the mapped .bytecode file
+	size_t size;
+	Lazy_Region *regions;	// 0: code before the first function; then one per function, by address
+	int nregions;
+	int loaded;				// regions
+	pthread_mutex_t lock;
+} VM_Lazy;
+
+/* Called by the loader once the header is read and vm->funcs is set up;
+ * text[0..size) is the mapped file, which the VM keeps, and instrs is
+ * where its ninstr instruction lines start.
+ */
+extern void vm_lazy_init(VM *vm, const char *text, size_t size, const char *instrs, int ninstr, int nbytes);
+extern void vm_load_function(VM *vm, Function *f);
+extern void vm_load_all(VM *vm);
+extern void vm_lazy_free(VM *vm);
+// functions loaded so far
+extern int vm_lazy_loaded(VM *vm);
+
+#endif
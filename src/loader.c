@@ -21,12 +21,86 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
+#define _POSIX_C_SOURCE 200809L // sysconf(_SC_NPROCESSORS_ONLN)
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include "vm.h"
 #include "loader.h"
+#include "functions.h"
+#include "decode.h"
+#include "code_cache.h"
+#include "lazy.h"
 
-static void inline vm_write32(byte *data, int n)   { *((int32_t *)data) = (int32_t)n; }
-static void inline vm_write16(byte *data, int n) { *((int16_t *)data) = (int16_t)n; }
+static void inline vm_write32(byte *data, int n) { int32_t v = (int32_t)n; memcpy(data, &v, sizeof(v)); }
+static void inline vm_write16(byte *data, int n) { int16_t v = (int16_t)n; memcpy(data, &v, sizeof(v)); }
+
+#define MNEMONIC_SLOTS 256
+#define MAX_LOAD_THREADS 64
+static const size_t PARALLEL_LOAD_MIN_BYTES = 1024 * 1024; // instruction text; smaller files load on one thread
+
+// hand-written scanning over the in-memory text; no per-line copies
+static inline void skip_blanks(Scanner *in) {
+	while ( in->p < in->end && (*in->p == ' ' || *in->p == '\t' || *in->p == '\r') ) in->p++;
+}
+
+static inline void skip_line(Scanner *in) {
+	while ( in->p < in->end && *in->p != '\n' ) in->p++;
+	if ( in->p < in->end ) in->p++;
+}
+
+static inline bool scan_char(Scanner *in, char c) {
+	if ( in->p < in->end && *in->p == c ) {
+		in->p++;
+		return true;
+	}
+	return false;
+}
+
+/* skip to the next (optionally negative) decimal integer and return it;
+ * anything in between, like "strings" or "instr,", is skipped
+ */
+static int scan_int(Scanner *in) {
+	while ( in->p < in->end && !(*in->p >= '0' && *in->p <= '9') &&
+			!(*in->p == '-' && in->p + 1 < in->end && in->p[1] >= '0' && in->p[1] <= '9') ) {
+		in->p++;
+	}
+	bool negative = scan_char(in, '-');
+	unsigned int v = 0;
+	while ( in->p < in->end && *in->p >= '0' && *in->p <= '9' ) v = v * 10 + (unsigned int)(*in->p++ - '0');
+	return negative ? -(int)v : (int)v;
+}
+
+// an operand on the current line: blanks, an optional comma, blanks, an integer
+static inline bool scan_opnd(Scanner *in, int *v) {
+	skip_blanks(in);
+	const char *p = in->p;
+	if ( scan_char(in, ',') ) skip_blanks(in);
+	if ( in->p < in->end && ((*in->p >= '0' && *in->p <= '9') || *in->p == '-') ) {
+		*v = scan_int(in);
+		return true;
+	}
+	in->p = p;
+	return false;
+}
+
+// "<index>: <size>/" as in the strings and functions sections
+static inline void scan_entry(Scanner *in, int *index, int *size) {
+	*index = scan_int(in);
+	scan_char(in, ':');
+	*size = scan_int(in);
+	scan_char(in, '/');
+}
+
+// up to n chars (like fgets, stops at a newline) and a '\0'
+static inline void scan_chars(Scanner *in, char *buf, int n) {
+	int i = 0;
+	while ( i < n && in->p < in->end && *in->p != '\n' ) buf[i++] = *in->p++;
+	buf[i] = '\0';
+}
 
 /*
 Create a VM from a bytecode object/asm file, .bytecode; files look like:
@@ -44,101 +118,357 @@ Create a VM from a bytecode object/asm file, .bytecode; files look like:
     CALL 20,0   ; CALL addr32, nargs16
     ...
  */
-VM *vm_load(FILE *f)
+typedef struct {
+	Function *functions;
+	int num_functions;
+	int ninstr;
+	int nbytes;
+} Header;
+
+/* strings and functions sections plus the "N instr, M bytes" line */
+static VM *scan_header(Scanner *in, Header *h)
 {
     VM *vm = vm_alloc();
-
-    fscanf(f, "%d strings\n", &vm->num_strings);
+	vm->num_strings = scan_int(in);
+	skip_line(in);
 	if ( vm->num_strings>0 ) {
 		vm->strings = (String **)calloc((size_t) vm->num_strings, sizeof(String *));
 		for (int i = 0; i < vm->num_strings; i++) {
 			int index, name_size;
-			fscanf(f, "%d: %d/", &index, &name_size);
-			String *s = String_alloc((size_t) name_size);
-			fgets(s->str, name_size + 1, f);
-			vm->strings[index] = s;
+			scan_entry(in, &index, &name_size);
+			String *s = String_alloc(&heap_allocator, (size_t) name_size); // outlives vm_reset()
+			scan_chars(in, s->str, name_size);
+			if ( index >= 0 && index < vm->num_strings ) vm->strings[index] = s;
+			else String_free(s);
+		}
+	}
+
+	h->num_functions = scan_int(in);
+	skip_line(in);
+	h->functions = calloc((size_t) h->num_functions, sizeof(Function));
+	for (int i = 0; i < h->num_functions; i++) {
+		int addr, name_size;
+		scan_entry(in, &addr, &name_size);
+		h->functions[i].addr = (addr32) addr;
+		h->functions[i].name = malloc((size_t) name_size + 1);
+		scan_chars(in, h->functions[i].name, name_size);
+	}
+
+	h->ninstr = scan_int(in);
+	h->nbytes = scan_int(in);	// skips " instr, "
+	skip_line(in);
+	return vm;
+}
+
+typedef struct {
+	const char *begin, *end;	// whole lines of the instruction section
+	int max_lines;
+	int lines;					// measured
+	addr32 bytes;
+	addr32 offset;				// where this chunk's code starts
+	byte *code;					// NULL while measuring
+	int errors;					// from the assembling pass
+} Load_Chunk;
+
+static void *load_chunk(void *arg) {
+	Load_Chunk *k = arg;
+	Scanner sc = {k->begin, k->end};
+	if ( k->code == NULL ) {
+		k->bytes = scan_instrs(NULL, &sc, k->max_lines, NULL, 0, UINT32_MAX, &k->lines);
+	}
+	else {
+		scan_instrs(NULL, &sc, k->max_lines, k->code, k->offset, k->offset + k->bytes, NULL);
+		k->errors = sc.errors;
+	}
+	return NULL;
+}
+
+// chunk 0 on this thread, the others on their own
+static void run_chunks(Load_Chunk *chunks, int n) {
+	pthread_t threads[MAX_LOAD_THREADS];
+	bool started[MAX_LOAD_THREADS];
+	for (int c = 1; c < n; c++) {
+		started[c] = pthread_create(&threads[c], NULL, load_chunk, &chunks[c]) == 0;
+		if ( !started[c] ) load_chunk(&chunks[c]);
+	}
+	load_chunk(&chunks[0]);
+	for (int c = 1; c < n; c++) {
+		if ( started[c] ) pthread_join(threads[c], NULL);
+	}
+}
+
+VM *vm_load(FILE *f)
+{
+	size_t size = 0, capacity = 64 * 1024;
+	char *text = malloc(capacity);
+	size_t n;
+	while ( (n = fread(text + size, 1, capacity - size, f)) > 0 ) {
+		size += n;
+		if ( size == capacity ) {
+			capacity *= 2;
+			text = realloc(text, capacity);
+		}
+	}
+	VM *vm = vm_load_text(text, size);
+	free(text);
+	return vm;
+}
+
+VM *vm_load_text(const char *text, size_t size)
+{
+	Scanner in = {text, text + size};
+	Header h;
+	VM *vm = scan_header(&in, &h);
+    byte *code = calloc((size_t)h.nbytes, sizeof(byte));
+	addr32 ip = scan_instrs(vm, &in, h.ninstr, code, 0, (addr32)h.nbytes, NULL);
+	if ( ip != (addr32)h.nbytes ) {
+		fprintf(stderr, "code is %d bytes; expecting %d\n", ip, h.nbytes);
+	}
+    vm_init(vm, code, h.nbytes);
+    function_table_init(&vm->funcs, h.functions, h.num_functions, code, h.nbytes);
+    vm_decode(vm);
+    return vm;
+}
+
+static VM *load_mapped(const char *text, size_t size, int nthreads, bool *errors);
+
+/* Memory-map a .bytecode file and assemble its instructions on nthreads
+ * threads (0: one per CPU, and only if the instruction section is big
+ * enough to be worth it). The section is cut into chunks at line
+ * boundaries; a first parallel pass measures each chunk's lines and
+ * bytes, a prefix sum gives every chunk its code offset, and a second
+ * parallel pass writes straight into the final code buffer. Operand
+ * mismatches only go to stderr on this path, not into vm->output.
+ * With a cache directory set (see code_cache.h) a cached image of the
+ * same text is used instead, and a fresh load without errors writes one.
+ */
+VM *vm_load_file(const char *fname, int nthreads)
+{
+	int fd = open(fname, O_RDONLY);
+	if ( fd < 0 ) return NULL;
+	struct stat st;
+	if ( fstat(fd, &st) != 0 ) {
+		close(fd);
+		return NULL;
+	}
+	size_t size = (size_t)st.st_size;
+	if ( size == 0 ) {
+		close(fd);
+		return vm_load_text("", 0);
+	}
+	char *text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ( text == MAP_FAILED ) return NULL;
+
+	uint64_t key = 0;
+	if ( vm_cache_dir() != NULL ) {
+		key = cache_key(text, size);
+		VM *vm = cache_load(key);
+		if ( vm != NULL ) {
+			munmap(text, size);
+			return vm;
 		}
 	}
+	bool errors;
+	VM *vm = load_mapped(text, size, nthreads, &errors);
+	munmap(text, size);
+	if ( key != 0 && !errors ) cache_store(vm, key); // no images of programs with errors
+	return vm;
+}
+
+/* Map a .bytecode file and keep it mapped: only the header is read now
+ * and each function's instructions are assembled when it's first called.
+ */
+VM *vm_load_file_lazy(const char *fname)
+{
+	int fd = open(fname, O_RDONLY);
+	if ( fd < 0 ) return NULL;
+	struct stat st;
+	if ( fstat(fd, &st) != 0 ) {
+		close(fd);
+		return NULL;
+	}
+	size_t size = (size_t)st.st_size;
+	if ( size == 0 ) {
+		close(fd);
+		return vm_load_text("", 0);
+	}
+	char *text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ( text == MAP_FAILED ) return NULL;
+
+	Scanner in = {text, text + size};
+	Header h;
+	VM *vm = scan_header(&in, &h);
+	function_table_init(&vm->funcs, h.functions, h.num_functions, NULL, h.nbytes);
+	vm_lazy_init(vm, text, size, in.p, h.ninstr, h.nbytes);
+	return vm;
+}
 
-    fscanf(f, "%d functions maxaddr=%d\n", &vm->num_functions, &vm->max_func_addr);
-	if ( vm->num_functions>0 ) {
-		vm->func_names = calloc((size_t) vm->max_func_addr + 1, sizeof(char *));
-		for (int i = 1; i <= vm->num_functions; i++) {
-			int name_size;
-			addr32 addr;
-			fscanf(f, "%d: %d/", &addr, &name_size);
-			char name[name_size + 1];
-			fgets(name, name_size + 1, f);
-			// we want a map from byte addr to name of func at that addr
-			vm->func_names[addr] = strdup(name);
+// *errors says whether anything didn't load as written
+static VM *load_mapped(const char *text, size_t size, int nthreads, bool *errors)
+{
+	Scanner in = {text, text + size};
+	Header h;
+	VM *vm = scan_header(&in, &h);
+	size_t section = (size_t)(in.end - in.p);
+	if ( nthreads <= 0 ) {
+		nthreads = section < PARALLEL_LOAD_MIN_BYTES ? 1 : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if ( nthreads > MAX_LOAD_THREADS ) nthreads = MAX_LOAD_THREADS;
+	if ( nthreads <= 1 ) { // one pass straight into a buffer of the declared size
+		byte *code = calloc((size_t)h.nbytes, sizeof(byte));
+		addr32 ip = scan_instrs(vm, &in, h.ninstr, code, 0, (addr32)h.nbytes, NULL);
+		if ( ip != (addr32)h.nbytes ) {
+			fprintf(stderr, "code is %d bytes; expecting %d\n", ip, h.nbytes);
+		}
+		*errors = in.errors > 0 || ip != (addr32)h.nbytes;
+		vm_init(vm, code, h.nbytes);
+		function_table_init(&vm->funcs, h.functions, h.num_functions, code, h.nbytes);
+		vm_decode(vm);
+		return vm;
+	}
+
+	Load_Chunk chunks[MAX_LOAD_THREADS];
+	const char *begin = in.p;
+	for (int c = 0; c < nthreads; c++) {
+		const char *end = c == nthreads-1 ? in.end : in.p + section * (size_t)(c+1) / (size_t)nthreads;
+		if ( end < begin ) end = begin;
+		while ( end < in.end && end[-1] != '\n' ) end++;	// finish the line
+		chunks[c] = (Load_Chunk) {.begin = begin, .end = end, .max_lines = INT32_MAX};
+		begin = end;
+	}
+
+	run_chunks(chunks, nthreads);	// measure
+	int lines = 0;
+	addr32 offset = 0;
+	for (int c = 0; c < nthreads; c++) {	// prefix sums, dropping lines past ninstr
+		Load_Chunk *k = &chunks[c];
+		if ( lines + k->lines > h.ninstr ) {
+			k->max_lines = h.ninstr - lines > 0 ? h.ninstr - lines : 0;
+			Scanner sc = {k->begin, k->end};
+			k->bytes = scan_instrs(NULL, &sc, k->max_lines, NULL, 0, UINT32_MAX, &k->lines);
 		}
+		k->offset = offset;
+		lines += k->lines;
+		offset += k->bytes;
+	}
+	if ( offset != (addr32)h.nbytes ) {
+		fprintf(stderr, "code is %d bytes; expecting %d\n", offset, h.nbytes);
 	}
 
-    int ninstr, nbytes;
-    fscanf(f, "%d instr, %d bytes\n", &ninstr, &nbytes);
-    byte *code = calloc((size_t)nbytes, sizeof(byte));
-    addr32 ip = 0;
-    for (int i=1; i<=ninstr; i++) {
-        char instr[80+1];
-        fgets(instr, 80+1, f);
-        char name[80];
-        int opnd1, opnd2;
-        int n = sscanf(instr, "%s %d, %d", name, &opnd1, &opnd2);
-        VM_INSTRUCTION *I = vm_instr(name);
+	byte *code = calloc(offset > (addr32)h.nbytes ? offset : (size_t)h.nbytes, sizeof(byte));
+	for (int c = 0; c < nthreads; c++) chunks[c].code = code;
+	run_chunks(chunks, nthreads);	// assemble
+	*errors = offset != (addr32)h.nbytes;
+	for (int c = 0; c < nthreads; c++) *errors = *errors || chunks[c].errors > 0;
+
+    vm_init(vm, code, h.nbytes);
+    function_table_init(&vm->funcs, h.functions, h.num_functions, code, h.nbytes);
+    vm_decode(vm);
+    return vm;
+}
+
+/* Assemble up to ninstr instruction lines into code[ip..limit), one per line:
+ * mnemonic then 0-2 integer operands separated by blanks and/or a comma.
+ * Anything after the operands (e.g. "; comment") is ignored. Returns the
+ * address after the last instruction; bad lines are counted in in->errors.
+ */
+addr32 scan_instrs(VM *vm, Scanner *in, int ninstr, byte *code, addr32 ip, addr32 limit, int *nlines)
+{
+	int i;
+	for (i=1; i<=ninstr && in->p < in->end; i++) {
+		skip_blanks(in);
+		const char *name = in->p;
+		while ( in->p < in->end && *in->p > ' ' ) in->p++;
+		size_t len = (size_t)(in->p - name);
+		int opnds[2];
+		int n = 0;
+		while ( n < 2 && scan_opnd(in, &opnds[n]) ) n++;
+		skip_line(in);
+
+		VM_INSTRUCTION *I = vm_instr_n(name, len);
 		if ( I==NULL ) {
-			fprintf(stderr, "unknown bytecode %s; ignoring\n", name);
+			if ( code!=NULL ) fprintf(stderr, "unknown bytecode %.*s; ignoring\n", (int)len, name);
+			in->errors++;
 			continue;
 		}
-        code[ip] = I->opcode;
-        ip++;
 		int num_required_opnds = 0;
 		if ( I->opnd_sizes[0]>0 ) num_required_opnds++;
 		if ( I->opnd_sizes[1]>0 ) num_required_opnds++;
-		if ( n-1 != num_required_opnds ) {
-			char *output = print(vm->output, "operand mismatch; expecting %d, found %d\n", num_required_opnds, n-1);
-			fprintf(stderr, "%s", output);
+		if ( ip + 1 + I->opnd_sizes[0] + I->opnd_sizes[1] > limit ) {
+			fprintf(stderr, "%s at %d doesn't fit in %d bytes of code\n", I->name, ip, limit);
+			in->errors++;
+			break;
+		}
+		if ( code==NULL ) { // just measuring
+			ip += 1 + (n == num_required_opnds ? I->opnd_sizes[0] + I->opnd_sizes[1] : 0);
+			continue;
+		}
+        code[ip] = I->opcode;
+        ip++;
+		if ( n != num_required_opnds ) {
+			if ( vm!=NULL ) {
+				char *output = print(vm->output, "operand mismatch; expecting %d, found %d\n", num_required_opnds, n);
+				fprintf(stderr, "%s", output);
+			}
+			else fprintf(stderr, "operand mismatch; expecting %d, found %d\n", num_required_opnds, n);
+			in->errors++;
 			continue;
 		}
 		// deal with operands
-        if ( n>=2 ) { // got an instruction and 1 operand
-            if ( I->opnd_sizes[0]==2 ) {
-                vm_write16(&code[ip], opnd1);
-            }
-            else { // must be 4 bytes
-                vm_write32(&code[ip], opnd1);
-            }
-            ip += I->opnd_sizes[0];
-        }
-        if ( n==3 ) { // got an instruction with 2 operands; fill in 2nd operand
-			if ( I->opnd_sizes[1]==2 ) {
-				vm_write16(&code[ip], opnd2);
+		for (int o = 0; o < n; o++) {
+			if ( I->opnd_sizes[o]==2 ) {
+				vm_write16(&code[ip], opnds[o]);
 			}
 			else { // must be 4 bytes
-				vm_write32(&code[ip], opnd2);
+				vm_write32(&code[ip], opnds[o]);
 			}
-			ip += I->opnd_sizes[1];
-        }
+			ip += I->opnd_sizes[o];
+		}
     }
-    fclose(f);
-    vm_init(vm, code, nbytes);
-    return vm;
+	if ( nlines!=NULL ) *nlines = i - 1;
+	return ip;
+}
+
+/* Mnemonic lookup through a perfect hash: MNEMONIC_SEED was picked by
+ * trying seeds from 1 up until every mnemonic in vm_instructions[] landed
+ * in its own slot, so a lookup is one hash over <= 6 chars, one table load
+ * and one compare. The table is filled on first use. The mnemonics test in
+ * test_core fails when a new mnemonic collides; search for a new seed (or
+ * double MNEMONIC_SLOTS) then.
+ */
+#define MNEMONIC_SEED 16
+static byte mnemonic_slots[MNEMONIC_SLOTS];	// opcode+1, 0 is empty
+static pthread_once_t mnemonic_once = PTHREAD_ONCE_INIT;
+
+static inline unsigned int mnemonic_hash(const char *name, size_t len) {
+	unsigned int h = MNEMONIC_SEED;
+	for (size_t i = 0; i < len; i++) h = h * 31 + (unsigned char)name[i];
+	return (h ^ (h >> 7)) & (MNEMONIC_SLOTS - 1);
+}
+
+static void mnemonic_init() {
+	for (int i = 0; i < NUM_INSTRS; ++i) {
+		const char *name = vm_instructions[i].name;
+		mnemonic_slots[mnemonic_hash(name, strlen(name))] = (byte)(i + 1);
+	}
+}
+
+VM_INSTRUCTION *vm_instr_n(const char *name, size_t len) {
+	pthread_once(&mnemonic_once, mnemonic_init);
+	byte slot = mnemonic_slots[mnemonic_hash(name, len)];
+	if ( slot == 0 ) return NULL;
+	VM_INSTRUCTION *I = &vm_instructions[slot - 1];
+	if ( strncmp(I->name, name, len) != 0 || I->name[len] != '\0' ) return NULL;
+	return I;
 }
 
 VM_INSTRUCTION *vm_instr(char *name) {
-    for (int i = 0; i < NUM_INSTRS; ++i) {
-        if ( strcmp(name, vm_instructions[i].name)==0 ) {
-            return &vm_instructions[i];
-        }
-    }
-    return NULL;
+	return vm_instr_n(name, strlen(name));
 }
 
 addr32 vm_function(VM *vm, char *name) {
-    for (addr32 a = 0; a <= vm->max_func_addr; ++a) {
-		char *fname = vm->func_names[a];
-        if ( fname!=NULL && strcmp(name, fname)==0 ) {
-            return a;
-        }
-    }
-    return 0xFFFFFFFF;
-}
\ No newline at end of file
+	Function *f = function_named(&vm->funcs, name);
+	return f != NULL ? f->addr : 0xFFFFFFFF;
+}
@@ -26,7 +26,18 @@ SOFTWARE.
 #include <string.h>
 #include "vm.h"
 
+typedef struct {
+	const char *p;		// next char to scan
+	const char *end;
+	int errors;			// lines scan_instrs() couldn't assemble
+} Scanner;
+
 extern VM *vm_load(FILE *f);
+extern VM *vm_load_text(const char *text, size_t size);
+extern VM *vm_load_file(const char *fname, int nthreads);	// NULL if it can't be read
+extern VM *vm_load_file_lazy(const char *fname);			// functions load on first call; see lazy.h
+extern addr32 scan_instrs(VM *vm, Scanner *in, int ninstr, byte *code, addr32 ip, addr32 limit, int *nlines);
 extern BYTECODE vm_opcode(char *name);
 extern VM_INSTRUCTION *vm_instr(char *name);
+extern VM_INSTRUCTION *vm_instr_n(const char *name, size_t len);
 extern addr32 vm_function(VM *vm, char *name);
@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <string.h>
+#include "memo.h"
+#include "decode.h"
+
+static bool pure_opcode(int opcode);
+static bool memoizable(element e);
+static unsigned int hash_call(int func, const int *args, int nargs, unsigned int bools);
+
+void vm_memo_enable(VM *vm, int max_entries) {
+	vm_memo_disable(vm);
+	if ( vm->instrs == NULL || vm->lazy != NULL ) vm_decode(vm);
+	memo_find_pure(vm);
+	unsigned int nsets = 1;
+	while ( nsets * 2 * MEMO_WAYS <= (unsigned int)max_entries ) nsets *= 2;
+	VM_Memo *m = calloc(1, sizeof(VM_Memo));
+	m->nsets = nsets;
+	m->entries = malloc(nsets * MEMO_WAYS * sizeof(Memo_Entry));
+	for (unsigned int i = 0; i < nsets * MEMO_WAYS; i++) {
+		m->entries[i].func = -1;
+	}
+	vm->memo = m;
+}
+
+void vm_memo_disable(VM *vm) {
+	if ( vm->memo == NULL ) return;
+	free(vm->memo->entries);
+	free(vm->memo);
+	vm->memo = NULL;
+}
+
+Memo_Stats vm_memo_stats(VM *vm) {
+	Memo_Stats none = {0};
+	return vm->memo != NULL ? vm->memo->stats : none;
+}
+
+void vm_memo_report(VM *vm, FILE *f) {
+	if ( vm->memo == NULL ) return;
+	Memo_Stats s = vm->memo->stats;
+	fprintf(f, "memo: %d entries, %llu hits, %llu misses, %llu evictions, %llu dropped\n",
+			(int)(vm->memo->nsets * MEMO_WAYS), (unsigned long long)s.hits, (unsigned long long)s.misses,
+			(unsigned long long)s.evictions, (unsigned long long)s.dropped);
+	for (int i = 0; i < vm->funcs.n; i++) {
+		if ( vm->funcs.functions[i].pure ) fprintf(f, "  pure: %s\n", vm->funcs.functions[i].name);
+	}
+}
+
+bool memo_lookup(VM_Memo *m, int func, const element *args, int nargs,
+				 element *result, int *slot, unsigned int *stamp)
+{
+	*stamp = 0;
+	if ( nargs > MEMO_MAX_ARGS ) return false;
+	int key[MEMO_MAX_ARGS];
+	unsigned int bools = 0;
+	for (int i = 0; i < nargs; i++) {
+		if ( !memoizable(args[i]) ) return false;
+		if ( args[i].type == BOOLEAN ) bools |= 1u << i;
+		key[i] = args[i].type == BOOLEAN ? args[i].b : args[i].i;
+	}
+
+	Memo_Entry *set = &m->entries[(hash_call(func, key, nargs, bools) & (m->nsets - 1)) * MEMO_WAYS];
+	Memo_Entry *victim = &set[0];
+	for (int w = 0; w < MEMO_WAYS; w++) {
+		Memo_Entry *e = &set[w];
+		if ( e->func == func && e->nargs == nargs && e->bools == bools &&
+			 memcmp(e->args, key, (size_t)nargs * sizeof(int)) == 0 ) {
+			if ( e->result.type == INVALID ) break; // still running: recursion on the same arguments
+			m->stats.hits++;
+			*result = e->result;
+			return true;
+		}
+		// prefer empty, then finished, then oldest
+		bool e_free = e->func < 0, v_free = victim->func < 0;
+		bool e_done = e->result.type != INVALID, v_done = victim->result.type != INVALID;
+		if ( v_free ) continue;
+		if ( e_free || (e_done && !v_done) || (e_done == v_done && e->stamp < victim->stamp) ) victim = e;
+	}
+	m->stats.misses++;
+	if ( victim->func >= 0 ) m->stats.evictions++;
+	if ( ++m->clock == 0 ) m->clock = 1;
+	*victim = (Memo_Entry) {.func = func, .stamp = m->clock, .nargs = nargs, .bools = bools};
+	memcpy(victim->args, key, (size_t)nargs * sizeof(int));
+	*slot = (int)(victim - m->entries);
+	*stamp = m->clock;
+	return false;
+}
+
+void memo_fill(VM_Memo *m, int slot, unsigned int stamp, element result) {
+	Memo_Entry *e = &m->entries[slot];
+	if ( e->stamp != stamp ) {	// evicted while the call ran
+		m->stats.dropped++;
+		return;
+	}
+	if ( memoizable(result) ) e->result = result;
+	else e->func = -1;
+}
+
+/* Optimistic: every function with only pure opcodes starts out pure, then
+ * callers of impure functions are knocked out until nothing changes, so
+ * (mutually) recursive functions like fib stay pure.
+ */
+void memo_find_pure(VM *vm) {
+	if ( vm->program != NULL ) return; // shared, and worked out when it was made
+	if ( vm->pure_known ) return;	// and nothing has decoded the code again since
+	Function_Table *t = &vm->funcs;
+	for (int i = 0; i < t->n; i++) {
+		Function *f = &t->functions[i];
+		int end = i + 1 < t->n ? t->functions[i+1].entry_pc : vm->num_instrs;
+		f->pure = f->entry_pc < end;
+		for (int pc = f->entry_pc; f->pure && pc < end; pc++) {
+			Instr *I = &vm->instrs[pc];
+			if ( !pure_opcode(I->opcode) ) f->pure = false;
+			if ( (I->opcode == BR || I->opcode == BRF) && (I->a < f->entry_pc || I->a >= end) ) f->pure = false;
+		}
+	}
+	bool changed = true;
+	while ( changed ) {
+		changed = false;
+		for (int i = 0; i < t->n; i++) {
+			Function *f = &t->functions[i];
+			int end = i + 1 < t->n ? t->functions[i+1].entry_pc : vm->num_instrs;
+			for (int pc = f->entry_pc; f->pure && pc < end; pc++) {
+				Instr *I = &vm->instrs[pc];
+				if ( I->opcode == CALL_CACHED && !t->functions[I->a].pure ) {
+					f->pure = false;
+					changed = true;
+				}
+			}
+		}
+	}
+	vm->pure_known = true;
+}
+
+// S U P P O R T
+
+static bool pure_opcode(int opcode) {
+	switch ( opcode ) {
+		case IADD: case ISUB: case IMUL: case IDIV:
+		case OR: case AND: case INEG: case NOT:
+		case IEQ: case INEQ: case ILT: case ILE: case IGT: case IGE:
+		case BR: case BRF: case ICONST:
+		case LOAD: case STORE: case POP:
+		case CALL_CACHED: case LOCALS: case RET:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool memoizable(element e) {
+	return e.type == INT || e.type == BOOLEAN;
+}
+
+static unsigned int hash_call(int func, const int *args, int nargs, unsigned int bools) {
+	uint64_t h = (uint64_t)(unsigned int)func * 0x9e3779b97f4a7c15ULL ^ bools;
+	for (int i = 0; i < nargs; i++) {
+		h = (h ^ (unsigned int)args[i]) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	return (unsigned int)(h ^ (h >> 29));
+}
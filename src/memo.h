@@ -0,0 +1,62 @@
+#ifndef MEMO_H_
+#define MEMO_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+
+/* Optional memoization of pure functions. vm_memo_enable() marks as
+ * pure every function whose body only does integer/boolean arithmetic,
+ * locals, branches within itself and calls to other pure functions (no
+ * PRINT, no strings, no HALT), then CALL consults a table keyed by the
+ * function and its argument values before running it. Only calls whose
+ * arguments and result are all ints or booleans are remembered. The
+ * table is a fixed number of 4-way sets, so memory is bounded; the
+ * oldest entry in a full set goes. A hit shows in a trace as the CALL
+ * with the result on the stack and no body.
+ */
+
+#define MEMO_MAX_ARGS 4
+#define MEMO_WAYS 4
+
+typedef struct {
+	int func;				// function index; -1 if empty
+	unsigned int stamp;		// the call that made it, see memo_fill(); ages entries
+	int nargs;
+	unsigned int bools;		// bit i set if args[i] is a boolean
+	int args[MEMO_MAX_ARGS];
+	element result;			// INVALID while that call is still running
+} Memo_Entry;
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t dropped;		// results not kept because their entry was evicted during the call
+} Memo_Stats;
+
+typedef struct vm_memo {
+	Memo_Entry *entries;
+	unsigned int nsets;		// power of 2
+	unsigned int clock;		// last stamp handed out; 0 is never used
+	Memo_Stats stats;
+} VM_Memo;
+
+// at most max_entries results (rounded down to whole sets); replaces any table already there
+extern void vm_memo_enable(VM *vm, int max_entries);
+extern void vm_memo_disable(VM *vm);
+extern Memo_Stats vm_memo_stats(VM *vm);
+extern void vm_memo_report(VM *vm, FILE *f);
+
+// called by vm_exec when vm->memo != NULL
+// true and *result on a hit; on a miss *stamp != 0 if the result should be passed to memo_fill()
+extern bool memo_lookup(VM_Memo *m, int func, const element *args, int nargs,
+						element *result, int *slot, unsigned int *stamp);
+extern void memo_fill(VM_Memo *m, int slot, unsigned int stamp, element result);
+
+// sets Function.pure for every function, once per decode; vm_memo_enable() and vm_batch() call it
+extern void memo_find_pure(VM *vm);
+
+#endif
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "natives.h"
+#include "decode.h"
+#include "lazy.h"
+
+void vm_bind_native(VM *vm, const char *name, vm_native fn) {
+	if ( vm->program != NULL ) {
+		fprintf(stderr, "can't bind %s: the program is shared\n", name);
+		return;
+	}
+	if ( vm->natives == NULL ) vm->natives = calloc(1, sizeof(VM_Natives));
+	VM_Natives *t = vm->natives;
+	int i = native_named(vm, name);
+	if ( i < 0 ) {
+		if ( t->n == t->max ) {
+			t->max = t->max > 0 ? 2 * t->max : 8;
+			t->natives = realloc(t->natives, (size_t)t->max * sizeof(Native));
+		}
+		i = t->n++;
+		t->natives[i].name = malloc(strlen(name) + 1);
+		strcpy(t->natives[i].name, name);
+	}
+	t->natives[i].fn = fn;
+	if ( vm->lazy != NULL ) {	// just what's loaded; the rest resolves as it loads
+		for (int k = 0; k < vm->num_instrs; k++) {
+			Instr *d = &vm->instrs[k];
+			if ( d->opcode == NCALL && d->a >= 0 && d->a < vm->num_strings && vm->strings[d->a] != NULL &&
+				 strcmp(String_str(vm->strings[d->a]), name) == 0 ) {
+				d->opcode = NCALL_CACHED;
+				d->a = i;
+			}
+		}
+	}
+	else if ( vm->instrs != NULL ) vm_decode(vm);
+}
+
+void vm_natives_free(VM *vm) {
+	VM_Natives *t = vm->natives;
+	if ( t == NULL ) return;
+	for (int i = 0; i < t->n; i++) {
+		free(t->natives[i].name);
+	}
+	free(t->natives);
+	free(t);
+	vm->natives = NULL;
+}
+
+int native_named(const VM *vm, const char *name) {
+	const VM_Natives *t = vm->natives;
+	for (int i = 0; t != NULL && i < t->n; i++) {	// a handful, and only looked up at decode time
+		if ( strcmp(t->natives[i].name, name) == 0 ) return i;
+	}
+	return -1;
+}
@@ -0,0 +1,36 @@
+#ifndef NATIVES_H_
+#define NATIVES_H_
+
+#include "vm.h"
+
+/* Host C functions that bytecode can call. The host binds each to a name
+ * right after loading; NCALL s, n calls the one named by string s with
+ * the top n stack values, and vm_decode() resolves the name once so the
+ * engine sees an index. The native reads its arguments where they sit on
+ * vm->stack (no frame is pushed) and its result replaces them. Arguments
+ * always come tagged. A native may vm_call() back into the program.
+ *
+ * An NCALL whose name isn't bound stops the program with an error when
+ * it runs, as an invalid opcode does.
+ */
+
+typedef element (*vm_native)(VM *vm, element *args, int nargs);
+
+typedef struct {
+	char *name;
+	vm_native fn;
+} Native;
+
+typedef struct vm_natives {
+	Native *natives;
+	int n;
+	int max;
+} VM_Natives;
+
+// binding a name again replaces it; decoded code is resolved again
+extern void vm_bind_native(VM *vm, const char *name, vm_native fn);
+extern void vm_natives_free(VM *vm);
+// index into vm->natives->natives, or -1
+extern int native_named(const VM *vm, const char *name);
+
+#endif
@@ -0,0 +1,196 @@
+#define _GNU_SOURCE // syscall()
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "perf_counters.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+static const char *COUNTER_NAMES[] = {"cycles", "instructions", "branch-misses", "L1d-misses", "LLC-misses"};
+
+static void perf_open_counters(VM_Perf *p);
+static void perf_close_counters(VM_Perf *p);
+static long this_thread();
+static void perf_read(VM_Perf *p, uint64_t *values);
+static void perf_charge(VM_Perf *p);
+
+bool vm_perf_enable(VM *vm) {
+	if ( vm->perf == NULL ) {
+		VM_Perf *p = calloc(1, sizeof(VM_Perf));
+		p->nfunctions = vm->funcs.n + 1; // + code outside any known function
+		p->functions = calloc((size_t)p->nfunctions, sizeof(Perf_Counts));
+		p->call_stack = calloc((size_t)MAX_CALL_STACK, sizeof(int));
+		p->callsp = -1;
+		perf_open_counters(p);
+		vm->perf = p;
+	}
+	return vm->perf->group_fd >= 0;
+}
+
+void vm_perf_disable(VM *vm) {
+	VM_Perf *p = vm->perf;
+	if ( p == NULL ) return;
+	perf_close_counters(p);
+	free(p->functions);
+	free(p->call_stack);
+	free(p);
+	vm->perf = NULL;
+}
+
+void perf_start(VM_Perf *p, int main_func) {
+	p->callsp = -1;
+	perf_call(p, main_func);
+	p->functions[p->call_stack[p->callsp]].calls--; // main wasn't CALLed
+	if ( p->thread != this_thread() ) { // enabled, or last run, on another thread
+		perf_close_counters(p);
+		perf_open_counters(p);
+	}
+#ifdef __linux__
+	if ( p->group_fd >= 0 ) ioctl(p->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+	perf_read(p, p->last);
+}
+
+void perf_call(VM_Perf *p, int func) {
+	if ( func < 0 ) func = p->nfunctions - 1;
+	if ( p->callsp >= 0 ) perf_charge(p);
+	p->call_stack[++p->callsp] = func;
+	p->functions[func].calls++;
+}
+
+void perf_ret(VM_Perf *p) {
+	perf_charge(p);
+	p->callsp--;
+}
+
+void perf_stop(VM_Perf *p) {
+	perf_charge(p);
+#ifdef __linux__
+	if ( p->group_fd >= 0 ) ioctl(p->group_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+#endif
+	p->callsp = -1;
+
+	memset(&p->total, 0, sizeof(Perf_Counts));
+	for (int a = 0; a < p->nfunctions; a++) {
+		for (int c = 0; c < NUM_PERF_COUNTERS; c++) p->total.counts[c] += p->functions[a].counts[c];
+		p->total.bytecodes += p->functions[a].bytecodes;
+		p->total.calls += p->functions[a].calls;
+	}
+}
+
+/* charge counts since the last boundary to the function on top */
+static void perf_charge(VM_Perf *p) {
+	uint64_t now[PC_LLC_MISSES+1];
+	perf_read(p, now);
+	Perf_Counts *f = &p->functions[p->call_stack[p->callsp]];
+	for (int c = 0; c < NUM_PERF_COUNTERS; c++) {
+		f->counts[c] += now[c] - p->last[c];
+		p->last[c] = now[c];
+	}
+}
+
+void vm_perf_report(VM *vm, FILE *f) {
+	VM_Perf *p = vm->perf;
+	if ( p == NULL ) return;
+
+	fprintf(f, "%-16s %8s %12s", "function", "calls", "bytecodes");
+	for (int c = 0; c < NUM_PERF_COUNTERS; c++) {
+		if ( p->fds[c] >= 0 ) fprintf(f, " %14s", COUNTER_NAMES[c]);
+	}
+	if ( p->fds[PC_CYCLES] >= 0 && p->fds[PC_INSTRUCTIONS] >= 0 ) fprintf(f, " %6s", "IPC");
+	fprintf(f, "\n");
+	for (int a = 0; a <= p->nfunctions; a++) {
+		Perf_Counts *pc = a < p->nfunctions ? &p->functions[a] : &p->total;
+		char *name = a < vm->funcs.n ? vm->funcs.functions[a].name : a < p->nfunctions ? "?" : "total";
+		if ( name == NULL || (pc->bytecodes == 0 && pc->calls == 0 && a < p->nfunctions) ) continue;
+		fprintf(f, "%-16s %8llu %12llu", name, (unsigned long long)pc->calls, (unsigned long long)pc->bytecodes);
+		for (int c = 0; c < NUM_PERF_COUNTERS; c++) {
+			if ( p->fds[c] >= 0 ) fprintf(f, " %14llu", (unsigned long long)pc->counts[c]);
+		}
+		if ( p->fds[PC_CYCLES] >= 0 && p->fds[PC_INSTRUCTIONS] >= 0 ) {
+			double cycles = (double)pc->counts[PC_CYCLES];
+			fprintf(f, " %6.2f", cycles > 0 ? pc->counts[PC_INSTRUCTIONS] / cycles : 0.0);
+		}
+		fprintf(f, "\n");
+	}
+	if ( p->group_fd < 0 ) fprintf(f, "(hardware counters unavailable; bytecode counts only)\n");
+}
+
+// S U P P O R T
+
+static void perf_close_counters(VM_Perf *p) {
+	for (int c = 0; c < NUM_PERF_COUNTERS; c++) {
+		if ( p->fds[c] >= 0 ) close(p->fds[c]);
+		p->fds[c] = -1;
+	}
+	p->group_fd = -1;
+}
+
+#ifdef __linux__
+static int perf_event_open(struct perf_event_attr *attr, int group_fd) {
+	return (int)syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0); // this thread, any CPU; see perf_start()
+}
+
+static void perf_open_counters(VM_Perf *p) {
+	static const struct { uint32_t type; uint64_t config; } EVENTS[] = {
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+		{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+		{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+	};
+	p->group_fd = -1;
+	p->nopen = 0;
+	p->thread = this_thread();
+	for (int c = 0; c < NUM_PERF_COUNTERS; c++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = EVENTS[c].type;
+		attr.config = EVENTS[c].config;
+		attr.disabled = p->group_fd < 0;	// the leader starts the whole group
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		p->fds[c] = perf_event_open(&attr, p->group_fd);
+		p->slot[c] = -1;
+		if ( p->fds[c] < 0 ) continue;
+		if ( p->group_fd < 0 ) p->group_fd = p->fds[c];
+		p->slot[c] = p->nopen++;
+	}
+}
+
+static long this_thread() {
+	return (long)syscall(SYS_gettid);
+}
+
+/* one read() gets the whole group: {nr, values[nr]} */
+static void perf_read(VM_Perf *p, uint64_t *values) {
+	memset(values, 0, sizeof(uint64_t) * NUM_PERF_COUNTERS);
+	if ( p->group_fd < 0 ) return;
+	uint64_t buf[1 + PC_LLC_MISSES+1];
+	if ( read(p->group_fd, buf, sizeof(buf)) <= 0 ) return;
+	for (int c = 0; c < NUM_PERF_COUNTERS; c++) {
+		if ( p->slot[c] >= 0 ) values[c] = buf[1 + p->slot[c]];
+	}
+}
+#else
+static void perf_open_counters(VM_Perf *p) {
+	p->group_fd = -1;
+	for (int c = 0; c < NUM_PERF_COUNTERS; c++) p->fds[c] = p->slot[c] = -1;
+}
+
+static long this_thread() {
+	return 0;
+}
+
+static void perf_read(VM_Perf *p, uint64_t *values) {
+	memset(values, 0, sizeof(uint64_t) * NUM_PERF_COUNTERS);
+}
+#endif
@@ -0,0 +1,63 @@
+#ifndef PERF_COUNTERS_H_
+#define PERF_COUNTERS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+
+/* Optional hardware counters around vm_exec() via Linux perf_event_open.
+ * Counts are attributed to the bytecode function that was running
+ * (exclusive of its callees) by switching at CALL/RET. Counters the
+ * kernel or CPU refuses are simply reported as unavailable; bytecode
+ * instruction counts are always collected. Counters count one thread,
+ * so a vm_exec() on another thread than the last one reopens them there.
+ */
+typedef enum {
+	PC_CYCLES=0,
+	PC_INSTRUCTIONS,
+	PC_BRANCH_MISSES,
+	PC_L1D_MISSES,
+	PC_LLC_MISSES,
+} perf_counter;
+
+static const int NUM_PERF_COUNTERS = PC_LLC_MISSES+1;
+
+typedef struct {
+	uint64_t counts[PC_LLC_MISSES+1];
+	uint64_t bytecodes;		// bytecode instructions executed
+	uint64_t calls;
+} Perf_Counts;
+
+typedef struct vm_perf {
+	int group_fd;					// -1 if no hardware counters at all
+	int fds[PC_LLC_MISSES+1];		// -1 if unavailable
+	int slot[PC_LLC_MISSES+1];		// position in a group read, -1 if not in the group
+	int nopen;
+	long thread;					// the counters count this thread only
+	uint64_t last[PC_LLC_MISSES+1];	// counter values at the last CALL/RET boundary
+
+	int nfunctions;					// vm->funcs.n + 1; indexed like vm->funcs.functions, last is "?"
+	Perf_Counts *functions;
+	Perf_Counts total;
+
+	int *call_stack;				// function indexes, to know who to charge
+	int callsp;
+} VM_Perf;
+
+extern bool vm_perf_enable(VM *vm);	// false if no hardware counters; bytecodes still counted
+extern void vm_perf_disable(VM *vm);
+extern void vm_perf_report(VM *vm, FILE *f);
+
+// called by vm_exec when vm->perf != NULL
+extern void perf_start(VM_Perf *p, int main_func);	// function indexes; -1 if unknown
+extern void perf_call(VM_Perf *p, int func);
+extern void perf_ret(VM_Perf *p);
+extern void perf_stop(VM_Perf *p);
+
+static inline void perf_bytecode(VM_Perf *p) {
+	p->functions[p->call_stack[p->callsp]].bytecodes++;
+}
+
+#endif
@@ -0,0 +1,282 @@
+#define _GNU_SOURCE // timer_create with SIGEV_THREAD_ID, gettid
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "profiler.h"
+#include "functions.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid	// glibc < 2.35 doesn't name it
+#endif
+#endif
+
+static Profiler * volatile active = NULL;
+static struct sigaction old_action;
+
+static void on_sigprof(int sig);
+static bool start_timer(Profiler *prof);
+static void stop_timer(Profiler *prof);
+static void chain_str(Profile_Sample *s, char *buf, size_t size);
+static int by_count_desc(const void *a, const void *b);
+static int by_ip(const void *a, const void *b);
+static int by_chain(const void *a, const void *b);
+
+typedef struct {
+	char *name;
+	int self;
+	int total;
+	addr32 ip;
+} Tally;
+
+Profiler *vm_profile_start(VM *vm, int hz, int max_samples) {
+	if ( active != NULL || hz <= 0 || max_samples <= 0 ) return NULL;
+	Profiler *prof = calloc(1, sizeof(Profiler));
+	prof->vm = vm;
+	prof->hz = hz;
+	prof->capacity = max_samples;
+	prof->samples = calloc((size_t)max_samples, sizeof(Profile_Sample));
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sigprof;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	active = prof;
+	sigaction(SIGPROF, &sa, &old_action);
+	if ( !start_timer(prof) ) {
+		sigaction(SIGPROF, &old_action, NULL);
+		active = NULL;
+		vm_profile_free(prof);
+		return NULL;
+	}
+	vm->sampled = true; // vm_exec() picks an engine that keeps vm->ip current
+	return prof;
+}
+
+void vm_profile_stop(Profiler *prof) {
+	if ( prof == NULL || active != prof ) return;
+	stop_timer(prof);
+	active = NULL;
+	prof->vm->sampled = false;
+	// a tick already in flight would kill us under SIG_DFL; our handler is a no-op now
+	if ( old_action.sa_handler != SIG_DFL ) sigaction(SIGPROF, &old_action, NULL);
+}
+
+void vm_profile_free(Profiler *prof) {
+	if ( prof == NULL ) return;
+	vm_profile_stop(prof);
+	free(prof->samples);
+	free(prof);
+}
+
+/* Runs in the signal handler: only plain loads and stores into memory we own. */
+void vm_profile_sample(Profiler *prof) {
+	if ( prof->nsamples >= prof->capacity ) {
+		prof->dropped++;
+		return;
+	}
+	VM *vm = prof->vm;
+	Profile_Sample *s = &prof->samples[prof->nsamples];
+	int callsp = vm->callsp;
+	if ( callsp >= MAX_CALL_STACK ) callsp = MAX_CALL_STACK - 1;
+	int first = callsp + 1 > PROFILE_MAX_DEPTH ? callsp + 1 - PROFILE_MAX_DEPTH : 0;
+	s->ip = vm->ip;
+	s->depth = 0;
+	for (int i = first; i <= callsp; i++) {
+		s->chain[s->depth++] = vm->call_stack[i].name;
+	}
+	prof->nsamples++;
+}
+
+void vm_profile_report(Profiler *prof, FILE *f) {
+	int n = prof->nsamples;
+	fprintf(f, "%d samples at %d Hz", n, prof->hz);
+	if ( prof->dropped > 0 ) fprintf(f, " (%d dropped, buffer full)", (int)prof->dropped);
+	fprintf(f, "\n");
+	if ( n == 0 ) return;
+
+	// self = innermost frame; total = anywhere in the chain, once per sample
+	int max_funcs = prof->vm->funcs.n + 2; // + "?" for unnamed
+	Tally *funcs = calloc((size_t)max_funcs, sizeof(Tally));
+	int nfuncs = 0;
+	for (int i = 0; i < n; i++) {
+		Profile_Sample *s = &prof->samples[i];
+		for (int d = 0; d < s->depth; d++) {
+			char *name = s->chain[d] != NULL ? s->chain[d] : "?";
+			bool seen = false;
+			for (int e = 0; e < d; e++) {
+				if ( s->chain[e] == s->chain[d] ) seen = true;
+			}
+			int t = 0;
+			while ( t < nfuncs && strcmp(funcs[t].name, name) != 0 ) t++;
+			if ( t == nfuncs ) {
+				if ( nfuncs == max_funcs ) {
+					max_funcs *= 2;
+					funcs = realloc(funcs, max_funcs * sizeof(Tally));
+				}
+				funcs[nfuncs++] = (Tally) {.name = name};
+			}
+			if ( !seen ) funcs[t].total++;
+			if ( d == s->depth - 1 ) funcs[t].self++;
+		}
+	}
+	qsort(funcs, (size_t)nfuncs, sizeof(Tally), by_count_desc);
+	fprintf(f, "\n%-16s %8s %7s %8s %7s\n", "function", "self", "self%", "total", "total%");
+	for (int t = 0; t < nfuncs; t++) {
+		fprintf(f, "%-16s %8d %6.1f%% %8d %6.1f%%\n", funcs[t].name,
+				funcs[t].self, 100.0 * funcs[t].self / n, funcs[t].total, 100.0 * funcs[t].total / n);
+	}
+
+	// hottest bytecode addresses
+	Tally *ips = calloc((size_t)n, sizeof(Tally));
+	for (int i = 0; i < n; i++) {
+		Profile_Sample *s = &prof->samples[i];
+		ips[i].ip = s->ip;
+		Function *fn = function_containing(&prof->vm->funcs, s->ip);
+		ips[i].name = fn != NULL ? fn->name : "?";
+	}
+	qsort(ips, (size_t)n, sizeof(Tally), by_ip);
+	int nips = 0;
+	for (int i = 0; i < n; i++) {
+		if ( nips > 0 && ips[nips-1].ip == ips[i].ip ) ips[nips-1].self++;
+		else {
+			ips[nips] = ips[i];
+			ips[nips++].self = 1;
+		}
+	}
+	qsort(ips, (size_t)nips, sizeof(Tally), by_count_desc);
+	fprintf(f, "\n%-8s %-8s %-16s %8s\n", "ip", "opcode", "function", "samples");
+	for (int i = 0; i < nips && i < 20; i++) {
+		byte opcode = ips[i].ip < (addr32)prof->vm->code_size ? prof->vm->code[ips[i].ip] : HALT;
+		char *mnemonic = opcode < NUM_OPCODES ? vm_instructions[opcode].name : "?";
+		fprintf(f, "%04d     %-8s %-16s %8d\n", ips[i].ip, mnemonic, ips[i].name, ips[i].self);
+	}
+
+	// hottest call chains; samples of one chain share the same name pointers
+	Profile_Sample **sorted = calloc((size_t)n, sizeof(Profile_Sample *));
+	for (int i = 0; i < n; i++) sorted[i] = &prof->samples[i];
+	qsort(sorted, (size_t)n, sizeof(Profile_Sample *), by_chain);
+	Tally *stacks = calloc((size_t)n, sizeof(Tally));
+	int nstacks = 0;
+	for (int i = 0; i < n; i++) {
+		if ( nstacks > 0 && by_chain(&sorted[i-1], &sorted[i]) == 0 ) stacks[nstacks-1].self++;
+		else {
+			stacks[nstacks].ip = (addr32)i; // index into sorted
+			stacks[nstacks++].self = 1;
+		}
+	}
+	qsort(stacks, (size_t)nstacks, sizeof(Tally), by_count_desc);
+	char chain[PROFILE_MAX_DEPTH * 64];
+	fprintf(f, "\n%8s  %s\n", "samples", "call chain");
+	for (int i = 0; i < nstacks && i < 20; i++) {
+		chain_str(sorted[stacks[i].ip], chain, sizeof(chain));
+		fprintf(f, "%8d  %s\n", stacks[i].self, chain);
+	}
+
+	free(sorted);
+	free(stacks);
+	free(ips);
+	free(funcs);
+}
+
+FILE *perf_map_open() {
+	char fname[64];
+	snprintf(fname, sizeof(fname), "/tmp/perf-%d.map", (int)getpid());
+	return fopen(fname, "a");
+}
+
+void perf_map_add(FILE *map, const void *start, size_t size, const char *name) {
+	if ( map == NULL ) return;
+	fprintf(map, "%lx %zx %s\n", (unsigned long)(uintptr_t)start, size, name);
+	fflush(map); // perf may read it while we're still running
+}
+
+void perf_map_close(FILE *map) {
+	if ( map != NULL ) fclose(map);
+}
+
+// S U P P O R T
+
+static void on_sigprof(int sig) {
+	if ( active != NULL ) vm_profile_sample(active);
+}
+
+/* Prefer a per-thread CPU-time timer aimed at the calling thread so samples
+ * always land on the interpreter; fall back to the process-wide ITIMER_PROF.
+ */
+static bool start_timer(Profiler *prof) {
+	long period_ns = 1000000000L / prof->hz;
+#if defined(__linux__) && defined(SIGEV_THREAD_ID)
+	timer_t *timer = malloc(sizeof(timer_t));
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGPROF;
+	sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+	if ( timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, timer) == 0 ) {
+		struct itimerspec its;
+		its.it_interval.tv_sec = period_ns / 1000000000L;
+		its.it_interval.tv_nsec = period_ns % 1000000000L;
+		its.it_value = its.it_interval;
+		if ( timer_settime(*timer, 0, &its, NULL) == 0 ) {
+			prof->timer = timer;
+			return true;
+		}
+		timer_delete(*timer);
+	}
+	free(timer);
+#endif
+	struct itimerval itv;
+	itv.it_interval.tv_sec = period_ns / 1000000000L;
+	itv.it_interval.tv_usec = (period_ns % 1000000000L) / 1000;
+	if ( itv.it_interval.tv_sec == 0 && itv.it_interval.tv_usec == 0 ) itv.it_interval.tv_usec = 1;
+	itv.it_value = itv.it_interval;
+	return setitimer(ITIMER_PROF, &itv, NULL) == 0;
+}
+
+static void stop_timer(Profiler *prof) {
+#if defined(__linux__) && defined(SIGEV_THREAD_ID)
+	if ( prof->timer != NULL ) {
+		timer_delete(*(timer_t *)prof->timer);
+		free(prof->timer);
+		prof->timer = NULL;
+		return;
+	}
+#endif
+	struct itimerval itv;
+	memset(&itv, 0, sizeof(itv));
+	setitimer(ITIMER_PROF, &itv, NULL);
+}
+
+static void chain_str(Profile_Sample *s, char *buf, size_t size) {
+	size_t len = 0;
+	buf[0] = '\0';
+	for (int d = 0; d < s->depth && len < size; d++) {
+		len += (size_t)snprintf(buf + len, size - len, "%s%s", d > 0 ? ";" : "", s->chain[d] != NULL ? s->chain[d] : "?");
+	}
+}
+
+static int by_count_desc(const void *a, const void *b) {
+	const Tally *x = a, *y = b;
+	if ( x->self != y->self ) return y->self - x->self;
+	return y->total - x->total;
+}
+
+static int by_ip(const void *a, const void *b) {
+	const Tally *x = a, *y = b;
+	return x->ip < y->ip ? -1 : x->ip > y->ip;
+}
+
+static int by_chain(const void *a, const void *b) {
+	const Profile_Sample *x = *(Profile_Sample * const *)a, *y = *(Profile_Sample * const *)b;
+	if ( x->depth != y->depth ) return x->depth - y->depth;
+	for (int d = 0; d < x->depth; d++) {
+		if ( x->chain[d] != y->chain[d] ) return (uintptr_t)x->chain[d] < (uintptr_t)y->chain[d] ? -1 : 1;
+	}
+	return 0;
+}
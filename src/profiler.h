@@ -0,0 +1,53 @@
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <signal.h>
+
+#include "vm.h"
+
+/* Sampling profiler. A SIGPROF timer interrupts the thread running
+ * vm_exec() and the handler copies vm->ip plus the function names on
+ * vm->call_stack into a preallocated buffer; nothing is allocated or
+ * printed from the handler. The report aggregates samples afterwards:
+ * self/total per function, hottest bytecode addresses and call chains
+ * (innermost last, "main;fib;fib" like collapsed flame graph stacks).
+ *
+ * Only one profiler can be running at a time per process.
+ */
+
+#define PROFILE_MAX_DEPTH 32	// deeper chains keep their innermost frames
+
+typedef struct {
+	addr32 ip;
+	int depth;						// frames in chain, <= PROFILE_MAX_DEPTH
+	char *chain[PROFILE_MAX_DEPTH];	// function names, outermost first
+} Profile_Sample;
+
+typedef struct {
+	VM *vm;
+	int hz;
+	Profile_Sample *samples;
+	int capacity;
+	volatile sig_atomic_t nsamples;
+	volatile sig_atomic_t dropped;	// ticks after the buffer filled up
+	void *timer;					// timer_t when timer_create worked, else NULL (setitimer)
+} Profiler;
+
+extern Profiler *vm_profile_start(VM *vm, int hz, int max_samples);
+extern void vm_profile_stop(Profiler *prof);
+extern void vm_profile_report(Profiler *prof, FILE *f);
+extern void vm_profile_free(Profiler *prof);
+
+// what the signal handler does; exposed so tests can take samples deterministically
+extern void vm_profile_sample(Profiler *prof);
+
+/* /tmp/perf-<pid>.map lets Linux perf symbolize natively generated code.
+ * One line per code region: "<start hex> <size hex> <name>".
+ */
+extern FILE *perf_map_open();
+extern void perf_map_add(FILE *map, const void *start, size_t size, const char *name);
+extern void perf_map_close(FILE *map);
+
+#endif
@@ -0,0 +1,149 @@
+#define _POSIX_C_SOURCE 200809L // sched_yield
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "program.h"
+#include "functions.h"
+#include "decode.h"
+#include "memo.h"
+#include "jit.h"
+#include "natives.h"
+#include "perf_counters.h"
+
+static void program_free(Program *p);
+static void program_use(VM *vm, Program *p);
+
+Program *vm_program_new(VM *vm) {
+	if ( vm->instrs == NULL || vm->lazy != NULL ) vm_decode(vm);
+	memo_find_pure(vm);	// now, so VMs sharing it never write to it
+	Program *p = calloc(1, sizeof(Program));
+	p->code = vm->code;
+	p->code_size = vm->code_size;
+	p->instrs = vm->instrs;
+	p->num_instrs = vm->num_instrs;
+	p->funcs = vm->funcs;
+	p->num_strings = vm->num_strings;
+	p->strings = vm->strings;
+	p->natives = vm->natives;
+	p->untagged = vm->untagged;
+	p->refs = 1;
+
+	vm->code = NULL;
+	vm->instrs = NULL;
+	memset(&vm->funcs, 0, sizeof(Function_Table));
+	vm->num_strings = 0;
+	vm->strings = NULL;
+	vm->natives = NULL;
+	vm_free(vm);
+	return p;
+}
+
+/* The reference is taken while s->readers is up, so program_publish()
+ * knows not to let go of what this may have loaded until it's counted.
+ */
+Program *program_acquire(Program_Slot *s) {
+	__atomic_add_fetch(&s->readers, 1, __ATOMIC_SEQ_CST);
+	Program *p = __atomic_load_n(&s->current, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&s->readers, 1, __ATOMIC_RELEASE);
+	return p;
+}
+
+void program_release(Program *p) {
+	if ( p != NULL && __atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) == 0 ) program_free(p);
+}
+
+Program_Slot *program_slot_new(Program *p) {
+	Program_Slot *s = calloc(1, sizeof(Program_Slot));
+	p->version = ++s->versions;
+	s->current = p;
+	return s;
+}
+
+// no VM may be attached any more
+void program_slot_free(Program_Slot *s) {
+	program_release(s->current);
+	free(s);
+}
+
+void program_publish(Program_Slot *s, Program *p) {
+	p->version = __atomic_add_fetch(&s->versions, 1, __ATOMIC_RELAXED);
+	Program *old = __atomic_exchange_n(&s->current, p, __ATOMIC_SEQ_CST);
+	while ( __atomic_load_n(&s->readers, __ATOMIC_SEQ_CST) != 0 ) sched_yield(); // grace period
+	program_release(old);
+}
+
+VM *vm_attach(Program_Slot *s) {
+	VM *vm = vm_alloc();
+	vm->sp = -1;
+	vm->callsp = -1;
+	vm->slot = s;
+	program_refresh(vm);
+	return vm;
+}
+
+void program_refresh(VM *vm) {
+	if ( vm->slot == NULL || __atomic_load_n(&vm->slot->current, __ATOMIC_ACQUIRE) == vm->program ) return;
+	Program *p = program_acquire(vm->slot);
+	if ( p == vm->program ) program_release(p);
+	else program_use(vm, p);
+}
+
+void program_detach(VM *vm) {
+	Program *p = vm->program;
+	if ( p == NULL ) return;
+	vm->code = NULL;
+	vm->code_size = 0;
+	vm->instrs = NULL;
+	vm->num_instrs = 0;
+	memset(&vm->funcs, 0, sizeof(Function_Table));
+	vm->num_strings = 0;
+	vm->strings = NULL;
+	vm->natives = NULL;
+	vm->untagged = false;
+	vm->program = NULL;
+	program_release(p);
+}
+
+// S U P P O R T
+
+static void program_free(Program *p) {
+	for (int i = 0; i < p->num_strings; i++) {
+		String_free(p->strings[i]);
+	}
+	free(p->strings);
+	function_table_free(&p->funcs);
+	free(p->instrs);
+	free(p->code);
+	if ( p->natives != NULL ) {
+		for (int i = 0; i < p->natives->n; i++) {
+			free(p->natives->natives[i].name);
+		}
+		free(p->natives->natives);
+		free(p->natives);
+	}
+	free(p);
+}
+
+// vm runs p from now on, with the reference it was given
+static void program_use(VM *vm, Program *p) {
+	program_detach(vm);
+	vm->program = p;
+	vm->code = p->code;
+	vm->code_size = p->code_size;
+	vm->instrs = p->instrs;
+	vm->num_instrs = p->num_instrs;
+	vm->funcs = p->funcs;
+	vm->num_strings = p->num_strings;
+	vm->strings = p->strings;
+	vm->natives = p->natives;
+	vm->untagged = p->untagged;
+
+	// what was learned about the old code doesn't hold for the new
+	if ( vm->jit != NULL ) jit_flush(vm);
+	if ( vm->memo != NULL ) vm_memo_enable(vm, (int)(vm->memo->nsets * MEMO_WAYS));
+	if ( vm->perf != NULL ) {
+		vm_perf_disable(vm);
+		vm_perf_enable(vm);
+	}
+}
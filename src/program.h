@@ -0,0 +1,67 @@
+#ifndef PROGRAM_H_
+#define PROGRAM_H_
+
+#include <stdint.h>
+
+#include "vm.h"
+
+/* Hot program swap. A Program is a loaded, decoded program image (code,
+ * instrs, the function table with its names, the string constants and
+ * the natives bound to it) that any number of VMs, on any threads, run
+ * at once without copying it. It is never changed once made.
+ *
+ * A Program_Slot publishes the current version. VMs made with
+ * vm_attach() look at the slot each time vm_exec() starts a run and move
+ * to whatever is there; a run already going finishes on the image it
+ * started with. program_publish() swaps the new image in with one atomic
+ * exchange, waits out the readers that may still be picking up the old
+ * one (a grace period, as in RCU) and drops the slot's reference. Each
+ * VM holds a reference to the image it runs, so the old one is freed by
+ * whoever lets go of it last: the publisher, a VM's next vm_exec() or
+ * vm_free().
+ *
+ * Per-VM state tied to an image goes when the VM moves: JIT traces and
+ * memoized results are dropped, perf counts start over; the allocator
+ * and output stay. Code of an attached VM is shared, so
+ * vm_decode(), vm_inline() and vm_bind_native() leave it alone; bind
+ * natives before vm_program_new().
+ */
+
+typedef struct vm_program {
+	byte *code;
+	int code_size;
+	Instr *instrs;
+	int num_instrs;
+	Function_Table funcs;
+	int num_strings;
+	String **strings;
+	struct vm_natives *natives;
+	bool untagged;
+	uint64_t version;		// set by program_publish()
+	int refs;
+} Program;
+
+typedef struct program_slot {
+	Program *current;
+	int readers;			// in program_acquire() right now
+	uint64_t versions;		// published so far
+} Program_Slot;
+
+// takes the program of a freshly loaded vm, decoding it if need be, and frees the vm
+extern Program *vm_program_new(VM *vm);
+extern Program *program_acquire(Program_Slot *s);	// the current image, with a reference
+extern void program_release(Program *p);			// freed with the last reference
+
+// the slot takes the reference to p
+extern Program_Slot *program_slot_new(Program *p);
+extern void program_slot_free(Program_Slot *s);
+extern void program_publish(Program_Slot *s, Program *p);
+
+// a VM that runs whatever s holds when each vm_exec() starts
+extern VM *vm_attach(Program_Slot *s);
+// move vm to the slot's current image if it isn't on it; at the start of vm_exec()
+extern void program_refresh(VM *vm);
+// vm lets go of its image; vm_free() does this
+extern void program_detach(VM *vm);
+
+#endif
@@ -0,0 +1,142 @@
+#include <string.h>
+#include "string_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SK_X86 1
+#endif
+
+/* index of the first byte where s and t differ, or n if they don't */
+static size_t mismatch_scalar(const char *s, const char *t, size_t n);
+#ifdef SK_X86
+static size_t mismatch_sse2(const char *s, const char *t, size_t n);
+static size_t mismatch_avx2(const char *s, const char *t, size_t n);
+#endif
+
+static size_t (*mismatch)(const char *s, const char *t, size_t n) = mismatch_scalar;
+static sk_level level = SK_SCALAR;
+
+__attribute__((constructor))
+static void sk_init() {
+	if ( !sk_use(SK_AVX2) ) sk_use(SK_SSE2);
+}
+
+bool sk_use(sk_level l) {
+	switch ( l ) {
+		case SK_SCALAR :
+			mismatch = mismatch_scalar;
+			break;
+#ifdef SK_X86
+		case SK_SSE2 :
+			__builtin_cpu_init();
+			if ( !__builtin_cpu_supports("sse2") ) return false;
+			mismatch = mismatch_sse2;
+			break;
+		case SK_AVX2 :
+			__builtin_cpu_init();
+			if ( !__builtin_cpu_supports("avx2") ) return false;
+			mismatch = mismatch_avx2;
+			break;
+#endif
+		default:
+			return false;
+	}
+	level = l;
+	return true;
+}
+
+sk_level sk_current() {
+	return level;
+}
+
+bool sk_eq(const char *s, size_t n, const char *t, size_t m) {
+	if ( n != m ) return false;
+	if ( s == t ) return true;
+	return mismatch(s, t, n) == n;
+}
+
+int sk_cmp(const char *s, size_t n, const char *t, size_t m) {
+	size_t len = n < m ? n : m;
+	size_t i = s == t ? len : mismatch(s, t, len);
+	if ( i < len ) return (unsigned char)s[i] - (unsigned char)t[i];
+	return n < m ? -1 : n > m;
+}
+
+/* libc's memcpy is already vectorized and tuned per CPU; don't compete with it */
+void sk_copy(char *dst, const char *src, size_t n) {
+	memcpy(dst, src, n);
+}
+
+static const char DIGIT_PAIRS[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/* two digits per division, written backwards into a scratch buffer */
+size_t sk_itoa(int value, char *buf) {
+	char tmp[12];
+	char *p = tmp + sizeof(tmp);
+	unsigned int u = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+	while ( u >= 100 ) {
+		unsigned int r = u % 100;
+		u /= 100;
+		p -= 2;
+		memcpy(p, &DIGIT_PAIRS[2*r], 2);
+	}
+	if ( u >= 10 ) {
+		p -= 2;
+		memcpy(p, &DIGIT_PAIRS[2*u], 2);
+	}
+	else {
+		*--p = (char)('0' + u);
+	}
+	if ( value < 0 ) *--p = '-';
+	size_t n = (size_t)(tmp + sizeof(tmp) - p);
+	memcpy(buf, p, n);
+	buf[n] = '\0';
+	return n;
+}
+
+static size_t mismatch_scalar(const char *s, const char *t, size_t n) {
+	size_t i = 0;
+	while ( i < n && s[i] == t[i] ) i++;
+	return i;
+}
+
+#ifdef SK_X86
+__attribute__((target("sse2")))
+static size_t mismatch_sse2(const char *s, const char *t, size_t n) {
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(t + i));
+		unsigned int eq = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+		if ( eq != 0xFFFF ) return i + __builtin_ctz(~eq);
+	}
+	return i + mismatch_scalar(s + i, t + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t mismatch_avx2(const char *s, const char *t, size_t n) {
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(t + i));
+		unsigned int eq = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+		if ( eq != 0xFFFFFFFFu ) return i + __builtin_ctz(~eq);
+	}
+	if ( i + 16 <= n ) {
+		size_t j = mismatch_sse2(s + i, t + i, 16);
+		if ( j < 16 ) return i + j;
+		i += 16;
+	}
+	return i + mismatch_scalar(s + i, t + i, n - i);
+}
+#endif
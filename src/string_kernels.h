@@ -0,0 +1,21 @@
+#ifndef STRING_KERNELS_H_
+#define STRING_KERNELS_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Length-aware string primitives used by vm_strings and the string
+ * opcodes. Equality and ordering pick an SSE2 or AVX2 implementation at
+ * startup when the CPU has it; everything has a scalar fallback.
+ */
+typedef enum { SK_SCALAR=0, SK_SSE2, SK_AVX2 } sk_level;
+
+extern bool sk_eq(const char *s, size_t n, const char *t, size_t m);
+extern int sk_cmp(const char *s, size_t n, const char *t, size_t m);	// strcmp() ordering
+extern void sk_copy(char *dst, const char *src, size_t n);
+extern size_t sk_itoa(int value, char *buf);	// buf needs 12 chars; '\0' terminated; returns length
+
+extern sk_level sk_current();
+extern bool sk_use(sk_level level);	// false if this CPU can't; for tests and benchmarks
+
+#endif
@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+#include "type_infer.h"
+#include "functions.h"
+
+#define UNTAGGED 0x8	// or'ed into a static_type: the slot may hold a value pushed without its tag
+
+typedef struct {
+	int depth;					// -1 until a path reaches the block
+	byte stack[TYPE_MAX_DEPTH];
+	byte locals[MAX_LOCALS];
+} State;
+
+typedef struct {
+	VM *vm;
+	int from, to;		// the function's instructions
+	int *block;			// block number of each leader (indexed by pc - from), else -1
+	int *leader;		// first pc of each block
+	State *in;			// state on entry to each block
+	int *work;			// blocks whose entry state changed
+	bool *queued;
+	int nwork;
+} Check;
+
+static bool check_function(VM *vm, int from, int to);
+static bool run_block(Check *c, int b);
+static bool merge(Check *c, int pc, const State *s);
+static bool step(State *s, Instr *I);
+static int boundary_tag(byte t);
+static byte join(byte a, byte b);
+static bool push(State *s, byte t);
+static bool pop(State *s, byte *t);
+
+bool vm_infer_types(VM *vm) {
+	vm->untagged = false;
+	for (int pc = 0; pc < vm->num_instrs; pc++) {
+		vm->instrs[pc].types = 0;
+	}
+	Function_Table *t = &vm->funcs;
+	if ( function_named(t, "main") == NULL ) {	// vm_exec() starts at 0, ahead of any function
+		int to = t->n > 0 ? t->functions[0].entry_pc : vm->num_instrs;
+		if ( to == 0 || !check_function(vm, 0, to) ) return false;
+	}
+	for (int i = 0; i < t->n; i++) {
+		int from = t->functions[i].entry_pc;
+		int to = i + 1 < t->n ? t->functions[i+1].entry_pc : vm->num_instrs;
+		if ( from < to && !check_function(vm, from, to) ) return false;
+	}
+	vm->untagged = true;
+	return true;
+}
+
+// S U P P O R T
+
+static bool check_function(VM *vm, int from, int to) {
+	int len = to - from;
+	Check c = {vm, from, to};
+	c.block = malloc((size_t)len * sizeof(int));
+	for (int i = 0; i < len; i++) c.block[i] = -1;
+	c.block[0] = 0;
+	bool ok = true;
+	for (int pc = from; pc < to; pc++) {	// leaders: the entry, branch targets and what follows a jump
+		Instr *I = &vm->instrs[pc];
+		if ( I->opcode == BR || I->opcode == BRF ) {
+			if ( I->a >= from && I->a < to ) c.block[I->a - from] = 0;
+			else if ( I->a != vm->num_instrs ) ok = false;
+		}
+		if ( (I->opcode == BR || I->opcode == BRF || I->opcode == RET || I->opcode == HALT) && pc + 1 < to ) {
+			c.block[pc + 1 - from] = 0;
+		}
+	}
+	int nblocks = 0;
+	for (int i = 0; i < len; i++) {
+		if ( c.block[i] >= 0 ) c.block[i] = nblocks++;
+	}
+	c.leader = malloc((size_t)nblocks * sizeof(int));
+	c.in = malloc((size_t)nblocks * sizeof(State));
+	c.work = malloc((size_t)nblocks * sizeof(int));
+	c.queued = calloc((size_t)nblocks, sizeof(bool));
+	for (int i = 0; i < len; i++) {
+		if ( c.block[i] >= 0 ) c.leader[c.block[i]] = from + i;
+	}
+	for (int b = 0; b < nblocks; b++) c.in[b].depth = -1;
+
+	State entry = {0};
+	memset(entry.locals, TYPE_DYN, sizeof(entry.locals)); // args come tagged; the rest start INVALID
+	ok = ok && merge(&c, from, &entry);
+	while ( ok && c.nwork > 0 ) {
+		int b = c.work[--c.nwork];
+		c.queued[b] = false;
+		ok = run_block(&c, b);
+	}
+	for (int b = 0; ok && b < nblocks; b++) {	// once more at the fixed point, for the final Instr.types
+		if ( c.in[b].depth >= 0 ) ok = run_block(&c, b);
+	}
+
+	free(c.block);
+	free(c.leader);
+	free(c.in);
+	free(c.work);
+	free(c.queued);
+	return ok;
+}
+
+static bool run_block(Check *c, int b) {
+	State s = c->in[b];
+	for (int pc = c->leader[b]; ; ) {
+		Instr *I = &c->vm->instrs[pc];
+		if ( !step(&s, I) ) return false;
+		switch ( I->opcode ) {
+			case BR:
+				return merge(c, I->a, &s);
+			case BRF:
+				return merge(c, I->a, &s) && merge(c, pc + 1, &s);
+			case RET:
+			case HALT:
+				return true;
+			default:
+				break;
+		}
+		if ( ++pc >= c->to ) return merge(c, pc, &s);
+		if ( c->block[pc - c->from] >= 0 ) return merge(c, pc, &s);
+	}
+}
+
+static bool merge(Check *c, int pc, const State *s) {
+	if ( pc == c->vm->num_instrs ) return true;	// off the end: vm_exec() stops
+	if ( pc >= c->to ) return false;			// into the next function
+	int b = c->block[pc - c->from];
+	State *in = &c->in[b];
+	bool changed = false;
+	if ( in->depth < 0 ) {
+		*in = *s;
+		changed = true;
+	}
+	else {
+		if ( in->depth != s->depth ) return false;
+		for (int i = 0; i < s->depth; i++) {
+			byte t = join(in->stack[i], s->stack[i]);
+			changed |= t != in->stack[i];
+			in->stack[i] = t;
+		}
+		for (int i = 0; i < MAX_LOCALS; i++) {
+			byte t = join(in->locals[i], s->locals[i]);
+			changed |= t != in->locals[i];
+			in->locals[i] = t;
+		}
+	}
+	if ( changed && !c->queued[b] ) {
+		c->queued[b] = true;
+		c->work[c->nwork++] = b;
+	}
+	return true;
+}
+
+/* abstract execution of one instruction; false if it can't be run untagged */
+static bool step(State *s, Instr *I) {
+	byte a, b;
+	int tag;
+	switch ( I->opcode ) {
+		case HALT:
+		case BR:
+		case LOCALS:
+			return true;
+		case IADD:
+		case ISUB:
+		case IMUL:
+		case IDIV:
+			return pop(s, &b) && pop(s, &a) && push(s, TYPE_INT | UNTAGGED);
+		case OR:
+		case AND:
+		case IEQ:
+		case INEQ:
+		case ILT:
+		case ILE:
+		case IGT:
+		case IGE:
+			return pop(s, &b) && pop(s, &a) && push(s, TYPE_BOOL | UNTAGGED);
+		case SEQ:
+		case SNEQ:
+		case SGT:
+		case SGE:
+		case SLT:
+		case SLE:	// strings are read through their tags
+			return pop(s, &b) && pop(s, &a) && !((a | b) & UNTAGGED) && push(s, TYPE_BOOL | UNTAGGED);
+		case SADD:
+			return pop(s, &b) && pop(s, &a) && !((a | b) & UNTAGGED) && push(s, TYPE_STR);
+		case INEG:	// in place: the tag stays whatever it was
+			return pop(s, &a) && push(s, TYPE_INT | (a & UNTAGGED));
+		case NOT:
+			return pop(s, &a) && push(s, TYPE_BOOL | (a & UNTAGGED));
+		case I2S:
+			return pop(s, &a) && push(s, TYPE_STR);
+		case BRF:
+			return pop(s, &a);
+		case ICONST:
+			return push(s, TYPE_INT | UNTAGGED);
+		case SCONST:
+			return push(s, TYPE_STR);
+		case LOAD:
+			return I->a >= 0 && I->a < MAX_LOCALS && push(s, s->locals[I->a]);
+		case STORE:
+			if ( I->a < 0 || I->a >= MAX_LOCALS || !pop(s, &a) || (tag = boundary_tag(a)) < 0 ) return false;
+			s->locals[I->a] = a & ~UNTAGGED;
+			I->types = (uint16_t)tag;
+			return true;
+		case SINDEX:
+			return pop(s, &b) && pop(s, &a) && !(a & UNTAGGED) && push(s, TYPE_STR);
+		case POP:
+			return pop(s, &a);
+		case CALL_CACHED:
+		case NCALL_CACHED:
+			if ( I->b < 0 || I->b > TYPE_MAX_ARGS ) return false;
+			I->types = 0;
+			for (int i = I->b - 1; i >= 0; i--) {
+				if ( !pop(s, &a) || (tag = boundary_tag(a)) < 0 ) return false;
+				I->types |= (uint16_t)(tag << (2 * i));
+			}
+			return push(s, TYPE_DYN); // RET or the native tags it
+		case RET:
+		case PRINT:
+			if ( !pop(s, &a) || (tag = boundary_tag(a)) < 0 ) return false;
+			I->types = (uint16_t)tag;
+			return true;
+		case SLEN:
+			return pop(s, &a) && !(a & UNTAGGED) && push(s, TYPE_INT | UNTAGGED);
+		case SFREE:
+			if ( I->a < 0 || I->a >= MAX_LOCALS ) return false;
+			s->locals[I->a] = TYPE_DYN;
+			return true;
+		case SEND:	// tagged for the other VM
+			if ( !pop(s, &a) || (tag = boundary_tag(a)) < 0 ) return false;
+			I->types = (uint16_t)tag;
+			return true;
+		case RECV:
+			return push(s, TYPE_DYN);
+		case MORE:
+			return push(s, TYPE_BOOL | UNTAGGED);
+		default:	// CALL to no known function, invalid opcodes
+			return false;
+	}
+}
+
+/* the tag a value needs when it leaves the stack for a local, a frame or
+ * PRINT: INT or BOOLEAN if that's its static type, INVALID (0) if it
+ * has a tag already and -1 if it may be untagged with no known type
+ */
+static int boundary_tag(byte t) {
+	if ( (t & ~UNTAGGED) == TYPE_INT ) return INT;
+	if ( (t & ~UNTAGGED) == TYPE_BOOL ) return BOOLEAN;
+	return t & UNTAGGED ? -1 : INVALID;
+}
+
+static byte join(byte a, byte b) {
+	byte ta = a & ~UNTAGGED, tb = b & ~UNTAGGED;
+	byte t = ta == TYPE_NONE ? tb : tb == TYPE_NONE || ta == tb ? ta : TYPE_DYN;
+	return t | ((a | b) & UNTAGGED);
+}
+
+static bool push(State *s, byte t) {
+	if ( s->depth >= TYPE_MAX_DEPTH ) return false;
+	s->stack[s->depth++] = t;
+	return true;
+}
+
+static bool pop(State *s, byte *t) {
+	if ( s->depth <= 0 ) return false; // the caller's part of the stack
+	*t = s->stack[--s->depth];
+	return true;
+}
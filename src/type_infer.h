@@ -0,0 +1,39 @@
+#ifndef TYPE_INFER_H_
+#define TYPE_INFER_H_
+
+#include "vm.h"
+
+/* Static types for the decoded code, so vm_exec() can leave the type
+ * tag off INT and BOOLEAN values on the operand stack.
+ *
+ * Each function is interpreted abstractly over its basic blocks: every
+ * stack slot and local gets one of the types below, joined at merge
+ * points. Values the typed opcodes produce (ICONST, IADD, ILT, SEQ, SLEN,
+ * ...) may then be pushed untagged. Locals, frames and call boundaries
+ * stay tagged: STORE, PRINT, RET and the arguments of a CALL find the
+ * static type of their operand in Instr.types and tag it on the way if
+ * needed. Everything else on the stack (call results, strings, LOADs of
+ * locals) is tagged as always.
+ *
+ * The program is only run untagged if every function checks out: no
+ * untagged value may reach an opcode that reads tags without a static
+ * type (a merge of an int with a string, say), stack depths must agree
+ * where paths meet, branches stay inside their function and every CALL
+ * is resolved. Anything else runs fully tagged, as before.
+ */
+
+typedef enum {
+	TYPE_NONE=0,	// not reached yet
+	TYPE_INT,
+	TYPE_BOOL,
+	TYPE_STR,		// STRING or SHORT_STRING, always tagged
+	TYPE_DYN,		// could be anything; tagged
+} static_type;
+
+#define TYPE_MAX_DEPTH 32	// deeper operand stacks within a function fall back to tagged
+#define TYPE_MAX_ARGS 8		// Instr.types has 2 bits per CALL argument
+
+// sets vm->untagged and every Instr.types; called by vm_decode()
+extern bool vm_infer_types(VM *vm);
+
+#endif
@@ -28,6 +28,16 @@ SOFTWARE.
 
 #include "vm.h"
 #include "loader.h"
+#include "string_kernels.h"
+#include "perf_counters.h"
+#include "functions.h"
+#include "decode.h"
+#include "memo.h"
+#include "jit.h"
+#include "natives.h"
+#include "lazy.h"
+#include "program.h"
+#include "channel.h"
 
 VM_INSTRUCTION vm_instructions[] = {
 	{"HALT",  HALT,  {}, 0},
@@ -75,392 +85,317 @@ VM_INSTRUCTION vm_instructions[] = {
 
 	{"PRINT",	PRINT,	   	{},  1},
 	{"SLEN",	SLEN,	   	{},  1},
-	{"SFREE",	SFREE,	   	{2}, 0} // free a str in a local
+	{"SFREE",	SFREE,	   	{2}, 0}, // free a str in a local
+	{"NCALL",	NCALL,		{4,2}, 0}, // string index of the native's name, num stack operands
+	{"SEND",	SEND,		{2}, 1}, // channel number
+	{"RECV",	RECV,		{2}, 0},
+	{"MORE",	MORE,		{2}, 0},
+
+	{"CALL",	CALL_CACHED,	{4,2}, 0}, // decoded only; traced from the CALL in vm->code
+	{"NCALL",	NCALL_CACHED,	{4,2}, 0},
 };
 
 static void vm_print_instr(VM *vm, addr32 ip);
 static void vm_print_stack(VM *vm);
-static char *vm_print_element(char *buffer, element el);
+static void vm_print_element(VM *vm, element el);
+static void trace_print(VM *vm, const char *fmt, ...);
+static void vm_invalid_opcode(const Instr *I);
+static void vm_unbound_native(VM *vm, const Instr *I);
+static void vm_bad_index(const Instr *I, int index, size_t n);
+static inline Channel *vm_channel(VM *vm, const Instr *I);
+static void vm_channel_error(const Instr *I, const char *what);
 static inline int32_t int32(const byte *data, addr32 ip);
 static inline int16_t int16(const byte *data, addr32 ip);
 static void vm_trace_print_element(VM *vm, element el);
+static String *vm_append(VM *vm, String *output, String *s);
+static String *vm_flush_output(VM *vm, String *output);
+static element el_string(String *s);
+static element el_chars(VM *vm, const char *chars, size_t n);
+static char *el_str(element *e, size_t *n);
+static int el_compare(element *a, element *b);
+static element el_add(VM *vm, element *a, element *b);
+static void el_free(element e);
 
 VM *vm_alloc() {
 	VM *vm = calloc(1, sizeof(VM));
-	vm->trace = (char *) malloc((999)*sizeof(char));
-	vm->output = (char *) malloc((999)*sizeof(char));
+	vm->trace_max = 4096;
+	vm->trace = (char *) calloc(vm->trace_max, sizeof(char));
+	vm->output = (char *) calloc(MAX_OUTPUT, sizeof(char));
+	vm->allocator = arena_new(ARENA_CHUNK_SIZE);
+	vm->owns_allocator = true;
 	return vm;
 }
 
+/* Use a for runtime objects from now on; the caller keeps ownership of a.
+ * Must not be called while the VM holds runtime strings.
+ */
+void vm_set_allocator(VM *vm, Allocator *a) {
+	if ( vm->owns_allocator ) vm->allocator->destroy(vm->allocator);
+	vm->allocator = a;
+	vm->owns_allocator = false;
+}
+
 void vm_init(VM *vm, byte *code, int code_size)
 {
 	vm->code = code;
 	vm->code_size = code_size;
+	free(vm->instrs); // decoded again on the next vm_exec() or vm_decode()
+	vm->instrs = NULL;
+	vm->num_instrs = 0;
+	vm->pure_known = false;
 	vm->sp = -1; // grow upwards, stack[sp] is top of stack and valid
 	vm->callsp = -1;
 }
 
 void vm_free(VM *vm) {
+	program_detach(vm);
+	for (int i = 0; i < vm->num_strings; i++) {
+		String_free(vm->strings[i]);
+	}
 	free(vm->strings);
-	free(vm->func_names);
+	function_table_free(&vm->funcs);
+	free(vm->instrs);
+	vm_perf_disable(vm);
+	vm_memo_disable(vm);
+	vm_jit_disable(vm);
+	vm_natives_free(vm);
+	vm_channels_free(vm);
+	vm_lazy_free(vm);
+	vm->allocator->release(vm->allocator);
+	if ( vm->owns_allocator ) vm->allocator->destroy(vm->allocator);
 	free(vm->trace);
 	free(vm->output);
 	free(vm->code);
 	free(vm);
 }
 
+/* Get ready to vm_exec() the same program again; all runtime strings go at once */
+void vm_reset(VM *vm) {
+	vm->ip = 0;
+	vm->sp = -1;
+	vm->callsp = -1;
+	vm->trace[0] = '\0';
+	vm->trace_len = 0;
+	vm->output[0] = '\0';
+	vm->allocator->release(vm->allocator);
+}
+
 // You don't need to use/create these functions but I used them
 // to help me when there are bugs in my code.
 static void inline validate_stack_address(VM *vm, int a) { }
 static void inline validate_stack(VM *vm, byte opcode, int sp) { }
 
+#define ENGINE_NAME vm_exec_plain
+#define ENGINE_TRACE 0
+#define ENGINE_PROFILE 0
+#define ENGINE_UNTAGGED 0
+#include "vm_engine.h"
+
+#define ENGINE_NAME vm_exec_untagged
+#define ENGINE_TRACE 0
+#define ENGINE_PROFILE 0
+#define ENGINE_UNTAGGED 1
+#include "vm_engine.h"
+
+#define ENGINE_NAME vm_exec_profile
+#define ENGINE_TRACE 0
+#define ENGINE_PROFILE 1
+#define ENGINE_UNTAGGED 0
+#include "vm_engine.h"
+
+#define ENGINE_NAME vm_exec_trace
+#define ENGINE_TRACE 1
+#define ENGINE_PROFILE 1
+#define ENGINE_UNTAGGED 0
+#include "vm_engine.h"
+
+/* Run from main (or address 0); see vm_run() for the engine */
 void vm_exec(VM *vm, bool trace_to_stderr) {
+	if ( vm->slot != NULL && vm->callsp < 0 ) program_refresh(vm); // a run going on stays where it is
+	if ( vm->instrs == NULL ) vm_decode(vm);
 
+	// main function
+	Function *f = function_named(&vm->funcs, "main");
+	if ( f != NULL && f->lazy ) vm_load_function(vm, f);
+	Activation_Record ar = {0}; // locals start INVALID, as a CALL leaves them
+	ar.name = f != NULL ? f->name : NULL;
+	vm->call_stack[++vm->callsp] = ar;
+	int pc = f != NULL ? f->entry_pc : 0;
 
-//	bool trace = true; // always store trace in vm->trace
-//	if (trace) {
-//		WRITE_BACK_REGISTERS(vm);
-//		vm_print_stack(vm);
-//		if ( trace_to_stderr ) fprintf(stderr, "%s", cur_trace);
-//	}
+	if ( vm->perf != NULL ) perf_start(vm->perf, f != NULL ? function_index(&vm->funcs, f) : -1);
+	vm_run(vm, pc, trace_to_stderr);
+	if ( vm->perf != NULL ) perf_stop(vm->perf);
+}
 
-	addr32 ip = 0;         // instruction pointer register    // call stack pointer register
+/* Run the decoded code from instruction pc on the stacks as they are, until
+ * it goes past the last instruction (HALT, or a RET to vm->num_instrs). The
+ * engine is picked once here: tracing, profiling when counters or the
+ * sampling profiler are on, else untagged if the types checked out at
+ * decode time, else plain.
+ */
+void vm_run(VM *vm, int pc, bool trace_to_stderr) {
+	if ( trace_to_stderr ) vm_exec_trace(vm, pc);
+	else if ( vm->perf != NULL || vm->sampled ) vm_exec_profile(vm, pc);
+	else if ( vm->untagged ) vm_exec_untagged(vm, pc);
+	else vm_exec_plain(vm, pc);
+}
 
-	int x = 0;
-	int y = 0;
-	String *s = NULL;
-	String *t = NULL;
-	String *output = NULL;
-	element e;
-	Activation_Record ar;
-	int addr = 0;
-	int offset = 0;
+/* Call f from the host on the VM as it is: a frame on top of whatever is
+ * running that returns to vm->num_instrs, where vm_run() stops, and the
+ * stacks put back afterwards. So nothing needs resetting between calls,
+ * and a call can come from inside a running program. Host calls aren't
+ * counted by vm->perf. false if f can't take nargs arguments or there's
+ * no room, or if it HALTed rather than returning.
+ */
+bool vm_call(VM *vm, Function *f, const element *args, int nargs, element *result) {
+	if ( f == NULL || nargs < 0 || (f->nargs >= 0 && f->nargs != nargs) ||
+		 nargs + f->nlocals > MAX_LOCALS || vm->callsp + 1 >= MAX_CALL_STACK ) return false;
+	if ( vm->instrs == NULL ) vm_decode(vm);
+	if ( f->lazy ) vm_load_function(vm, f);
+	if ( nargs + f->nlocals > MAX_LOCALS ) return false;
+
+	int sp = vm->sp, callsp = vm->callsp;
+	struct vm_perf *perf = vm->perf;
+	vm->perf = NULL;
+	Activation_Record *frame = &vm->call_stack[++vm->callsp];
+	frame->name = f->name;
+	frame->nargs = nargs;
+	frame->nlocals = f->nlocals;
+	frame->memo_stamp = 0;
+	frame->retaddr = vm->num_instrs;
+	if ( nargs > 0 ) memcpy(frame->locals, args, (size_t)nargs * sizeof(element));
+	for (int i = nargs; i < nargs + f->nlocals; i++) {
+		frame->locals[i] = (element) {.type = INVALID};
+	}
+	vm_run(vm, f->body_pc, false);
+	bool returned = vm->callsp == callsp && vm->sp > sp; // RET leaves the value on top
+	if ( returned && result != NULL ) *result = vm->stack[vm->sp];
+	vm->sp = sp;
+	vm->callsp = callsp;
+	vm->perf = perf;
+	return returned;
+}
 
+/* vm->output += what this run has PRINTed so far; returns the empty rope */
+static String *vm_flush_output(VM *vm, String *output) {
+	if ( output != NULL ) {
+		strncat(vm->output, String_str(output), MAX_OUTPUT - 1 - strlen(vm->output));
+		String_free(output);
+	}
+	return NULL;
+}
 
-	// main function
-	ar.name = vm->func_names[0];
-	ar.nargs = 0;
-	ar.nlocals = 0;
-	vm->call_stack[++vm->callsp] = ar;
+/* output += s; output is a rope so PRINT costs O(1) until the end of vm_exec */
+static String *vm_append(VM *vm, String *output, String *s) {
+	String *u = String_add(vm->allocator, output, s);
+	String_free(output);
+	return u;
+}
 
+static element el_string(String *s) {
+	return (element) {.type = STRING, .s = s};
+}
 
-//	vm->ip
-	byte opcode = vm->code[ip];
-
-	while (ip < vm->code_size) {
-		printf("ip: %d\n", ip);
-		printf("opcode: %d\n", opcode);
-		if (trace_to_stderr) vm_print_instr(vm, ip);
-		ip++;
-
-		switch(opcode) {
-			case HALT:
-				break;
-			case IADD:
-				y = vm->stack[vm->sp--].i;
-				x = vm->stack[vm->sp--].i;
-				e = (element) {.type = INT, .i = x+y};
-				vm->stack[++vm->sp] = e;
-				break;
-			case ISUB:
-				y = vm->stack[vm->sp--].i;
-				x = vm->stack[vm->sp--].i;
-				e = (element) {.type = INT, .i = x-y};
-				vm->stack[++vm->sp] = e;
-				break;
-			case IMUL:
-				y = vm->stack[vm->sp--].i;
-				x = vm->stack[vm->sp--].i;
-				e = (element) {.type = INT, .i = x*y};
-				vm->stack[++vm->sp] = e;
-				break;
-			case IDIV:
-				y = vm->stack[vm->sp--].i;
-				x = vm->stack[vm->sp--].i;
-				e = (element) {.type = INT, .i = x/y};
-				vm->stack[++vm->sp] = e;
-				break;
-			case SADD:
-				t = vm->stack[vm->sp--].s;	// ->s ??
-				s = vm->stack[vm->sp--].s;
-				e = (element) {.type = STRING, .s = String_add(s, t)};
-				vm->stack[++vm->sp] = e;
-				break;
-			case OR:
-				y = vm->stack[vm->sp--].i; //fix. might have to convert to bit first
-				x = vm->stack[vm->sp--].i;
-				e = (element) {.type = INT, .i = (x|y)}; // then back to int
-				vm->stack[++vm->sp] = e;
-				break;
-			case AND:
-
-				break;
-			case INEG:
-
-				break;
-			case NOT:
-
-				break;
-			case I2S:
-				x = vm->stack[vm->sp--].i;
-				e = (element) {.type = STRING, .s = String_from_int(x)};
-				vm->stack[++vm->sp] = e;
-				break;
-			case IEQ:
-				y = vm->stack[vm->sp--].i;
-				x = vm->stack[vm->sp--].i;
-				e = (element) {.type = BOOLEAN, .b = x==y ? true : false };
-				vm->stack[++vm->sp] = e;
-				break;
-			case INEQ:
-				y = vm->stack[vm->sp--].i;
-				x = vm->stack[vm->sp--].i;
-				e = (element) {.type = BOOLEAN, .b = x!=y ? true : false };
-				vm->stack[++vm->sp] = e;
-				break;
-			case ILT:
-				y = vm->stack[vm->sp--].i;
-				x = vm->stack[vm->sp--].i;
-				e = (element) {.type = BOOLEAN, .b = x<y ? true : false };
-				vm->stack[++vm->sp] = e;
-				break;
-			case ILE:
-				y = vm->stack[vm->sp--].i;
-				x = vm->stack[vm->sp--].i;
-				e = (element) {.type = BOOLEAN, .b = x<=y ? true : false };
-				vm->stack[++vm->sp] = e;
-				break;
-			case IGT:
-				y = vm->stack[vm->sp--].i;
-				x = vm->stack[vm->sp--].i;
-				e = (element) {.type = BOOLEAN, .b = x>y ? true : false };
-				vm->stack[++vm->sp] = e;
-				break;
-			case IGE:
-				y = vm->stack[vm->sp--].i;
-				x = vm->stack[vm->sp--].i;
-				e = (element) {.type = BOOLEAN, .b = x>=y ? true : false };
-				vm->stack[++vm->sp] = e;
-				break;
-			case SEQ:
-				t = vm->stack[vm->sp--].s;	// ->s ??
-				s = vm->stack[vm->sp--].s;
-				e = (element) {.type = BOOLEAN, .b = String_eq(s, t) ? true : false };
-				vm->stack[++vm->sp] = e;
-				break;
-			case SNEQ:
-				t = vm->stack[vm->sp--].s;	// ->s ??
-				s = vm->stack[vm->sp--].s;
-				e = (element) {.type = BOOLEAN, .b = String_neq(s, t) ? true : false };
-				vm->stack[++vm->sp] = e;
-				break;
-			case SGT:
-				t = vm->stack[vm->sp--].s;	// ->s ??
-				s = vm->stack[vm->sp--].s;
-				e = (element) {.type = BOOLEAN, .b = String_gt(s, t) ? true : false };
-				vm->stack[++vm->sp] = e;
-				break;
-			case SGE:
-				t = vm->stack[vm->sp--].s;	// ->s ??
-				s = vm->stack[vm->sp--].s;
-				e = (element) {.type = BOOLEAN, .b = String_ge(s, t) ? true : false };
-				vm->stack[++vm->sp] = e;
-				break;
-			case SLT:
-				t = vm->stack[vm->sp--].s;	// ->s ??
-				s = vm->stack[vm->sp--].s;
-				e = (element) {.type = BOOLEAN, .b = String_lt(s, t) ? true : false };
-				vm->stack[++vm->sp] = e;
-				break;
-			case SLE:
-				t = vm->stack[vm->sp--].s;	// ->s ??
-				s = vm->stack[vm->sp--].s;
-				e = (element) {.type = BOOLEAN, .b = String_le(s, t) ? true : false };
-				vm->stack[++vm->sp] = e;
-				break;
-
-			case BR:
-				ip = int16(vm->code, ip);
-//				ip = ip + 4;
-				break;
-			case BRF:
-				if (vm->stack[vm->sp--].b) {
-					ip = int16(vm->code, ip);
-				}
-				else {
-					ip = ip + 4;
-				}
-				break;
-			case ICONST:
-				printf("iconst\n");
-				e = (element) {.type = INT, .i = int16(vm->code, ip)};
-				ip = ip + 4;
-				vm->stack[++vm->sp] = e;
-				printf("e.i %d\n", e.i);
-				break;
-			case SCONST:
-				e = (element) {.type = STRING, .s = String_dup(vm->strings[int16(vm->code, ip)])};
-				vm->stack[++vm->sp] = e;
-				ip = ip + 2;
-				break;
-			case LOAD:
-				printf("load\n");
-//				e = ar.locals[vm->code[ip++]];
-				e = ar.locals[int16(vm->code, ip)];
-				printf("%d\n", e.i);
-				vm->stack[++vm->sp] = e;
-				ip = ip + 2;
-				break;
-			case STORE:
-//				ar.locals[vm->code[ip++]] = vm->stack[sp--];
-				ar = vm->call_stack[vm->callsp--];
-				ar.locals[int16(vm->code, ip)] = vm->stack[vm->sp--];
-				vm->call_stack[++vm->callsp] = ar;
-				ip = ip + 2;
-				break;
-			case SINDEX:
-				x = vm->stack[vm->sp--].i;
-				s = vm->stack[vm->sp--].s;
-//				e = (element) {.type = STRING, .s = s[x]};
-//				e = (element) {.type = STRING, .s = s[x]};
-				vm->stack[++vm->sp] = e;
-				break;
-			case POP:
-				printf("pop\n");
-				vm->sp--;
-				break;
-			case CALL:
-				printf("call\n");
-				ar.nargs = int16(vm->code, ip+4);
-				printf("nargs %d\n", ar.nargs);
-				ar.retaddr = int16(vm->code, ip+7); // what?
-//				vm->call_stack[++vm->callsp] = ar;
-				for (int i=int16(vm->code, ip+4)-1; i>=0; i--) {
-					ar.locals[i] = vm->stack[vm->sp--];
-					printf("%d\n", ar.locals[i].i);
-				}
-				ar.name = vm->func_names[int16(vm->code, ip)];
-				ip = int16(vm->code, ip);
-				//ip = ip + 7;
-
-				vm->call_stack[++vm->callsp] = ar;
-				break;
-			case LOCALS:
-				ar = vm->call_stack[vm->callsp--];
-				ar.nlocals = int16(vm->code, ip);
-				vm->call_stack[++vm->callsp] = ar;
-				ip = ip + 2;
-				break;
-			case RET:
-				printf("ret\n");
-				x = vm->stack[vm->sp--].i;
-				ar = vm->call_stack[vm->callsp--];
-				e = (element) {.type = INT, .i = x};
-				vm->stack[++vm->sp] = e;
-				ip = ar.retaddr;
-//				ip = vm->call_stack[vm->callsp--].retaddr;
-				break;
-			case PRINT:
-				printf("print\n");
-				e = vm->stack[vm->sp--];
-				switch (e.type) {
-					case INT:
-						x = e.i;
-						printf("%d\n", e.i);
-//						String *str = String_from_int(x);
-//						str = String_add(str, String_from_char('\n'));
-						output = String_add(output, String_from_int(x));
-						output = String_add(output, String_from_char('\n'));
-//						output = String_add(output, str);
-						break;
-					case STRING:
-						printf("%d\n", e.s);
-						output = String_add(output, e.s);
-						break;
-					case BOOLEAN:
-						if (e.b) {
-							output = String_add(output, String_new("true\n"));
-						}
-						else {
-							output = String_add(output, String_new("false\n"));
-						}
-						break;
-				}
-				break;
-			case SLEN:
-				e = (element) {.type = INT, .i = String_len(vm->stack[vm->sp--].s)};
-				vm->stack[++vm->sp] = e;
-				break;
-			case SFREE:
-				ar = vm->call_stack[vm->callsp--];
-				e = ar.locals[int16(vm->code, ip)];
-				free(e.s);
-				e.type = INVALID;
-				e.s = NULL;
-				ar.locals[int16(vm->code, ip)] = e;
-				vm->call_stack[++vm->callsp] = ar;
-				ip = ip + 2;
-				break;
-			default:
-				printf("invalid opcode: %d at ip=%d\n", opcode, (ip - 1));
-				exit(1);
-		}
+/* short strings live inside the element; only longer ones touch the heap */
+static element el_chars(VM *vm, const char *chars, size_t n) {
+	if ( n > ELEMENT_INLINE_CHARS ) return el_string(String_from_chars(vm->allocator, chars, n));
+	element e = {.type = SHORT_STRING};
+	sk_copy(e.chars, chars, n);
+	e.chars[n] = '\0';
+	return e;
+}
 
-		if (trace_to_stderr) vm_print_stack(vm);
-		opcode = vm->code[ip];
+/* contiguous text of a string element (either form); length to *n if n!=NULL */
+static char *el_str(element *e, size_t *n) {
+	if ( e->type == SHORT_STRING ) {
+		if ( n != NULL ) *n = strlen(e->chars);
+		return e->chars;
+	}
+	if ( n != NULL ) *n = e->s->length;
+	return String_str(e->s);
+}
 
+static int el_compare(element *a, element *b) {
+	size_t n, m;
+	char *s = el_str(a, &n);
+	char *t = el_str(b, &m);
+	return sk_cmp(s, n, t, m);
+}
 
+static element el_add(VM *vm, element *a, element *b) {
+	size_t n = a->type == SHORT_STRING ? strlen(a->chars) : a->s->length;
+	size_t m = b->type == SHORT_STRING ? strlen(b->chars) : b->s->length;
+	if ( n + m <= ELEMENT_INLINE_CHARS ) {
+		element e = {.type = SHORT_STRING};
+		sk_copy(e.chars, el_str(a, NULL), n);
+		sk_copy(e.chars + n, el_str(b, NULL), m);
+		e.chars[n + m] = '\0';
+		return e;
 	}
-//	vm->call_stack[vm->callsp--];
-
-//	strcpy(vm->output, output.c_str());
-	printf("my output: %s\n", output->str);
-	e = (element) {.type = STRING, .s = output};
-	vm->output = vm_print_element(vm->output, e);
+	if ( a->type == STRING && b->type == STRING ) return el_string(String_add(vm->allocator, a->s, b->s));
+	if ( n + m < ROPE_MIN_LENGTH ) { // String_add() would copy anyway; skip the temporary
+		String *u = String_alloc(vm->allocator, n + m);
+		sk_copy(u->str, el_str(a, NULL), n);
+		sk_copy(u->str + n, el_str(b, NULL), m);
+		return el_string(u);
+	}
+	String *s = a->type == STRING ? a->s : String_from_chars(vm->allocator, a->chars, n);
+	String *t = b->type == STRING ? b->s : String_from_chars(vm->allocator, b->chars, m);
+	element e = el_string(String_add(vm->allocator, s, t));
+	if ( a->type != STRING ) String_free(s);
+	if ( b->type != STRING ) String_free(t);
+	return e;
+}
 
+static void el_free(element e) {
+	if ( e.type == STRING ) String_free(e.s);
 }
 
-/* return a 32-bit integer at data[ip] */
+/* return a 32-bit integer at data[ip]; operands aren't aligned, so no pointer casts */
 static inline int32_t int32(const byte *data, addr32 ip)
 {
-	return *((int32_t *)&data[ip]);
+	int32_t v;
+	memcpy(&v, &data[ip], sizeof(v));
+	return v;
 }
 
 /* return a 16-bit integer at data[ip] */
 static inline int16_t int16(const byte *data, addr32 ip)
 {
-	return *((int16_t *)&data[ip]); // could be negative value
+	int16_t v;
+	memcpy(&v, &data[ip], sizeof(v));
+	return v; // could be negative value
 }
 
-void vm_print_instr_opnd0(const VM *vm, addr32 ip) {
+static void vm_print_instr_opnd0(VM *vm, addr32 ip) {
 	int op_code = vm->code[ip];
 	VM_INSTRUCTION *inst = &vm_instructions[op_code];
-	print(vm->trace, "%04d:  %-25s", ip, inst->name);
+	trace_print(vm, "%04d:  %-25s", ip, inst->name);
 }
 
-void vm_print_instr_opnd1(const VM *vm, addr32 ip) {
+static void vm_print_instr_opnd1(VM *vm, addr32 ip) {
 	int op_code = vm->code[ip];
 	VM_INSTRUCTION *inst = &vm_instructions[op_code];
 	int sz = inst->opnd_sizes[0];
 	switch (sz) {
 		case 2:
-			print(vm->trace, "%04d:  %-15s%-10d", ip, inst->name, int16(vm->code, ip + 1));
+			trace_print(vm, "%04d:  %-15s%-10d", ip, inst->name, int16(vm->code, ip + 1));
 			break;
 		case 4:
-			print(vm->trace, "%04d:  %-15s%-10d", ip, inst->name, int32(vm->code, ip + 1));
+			trace_print(vm, "%04d:  %-15s%-10d", ip, inst->name, int32(vm->code, ip + 1));
 			break;
 		default:
 			break;
 	}
 }
 
-/* currently only a CALL instr */
-void vm_print_instr_opnd2(const VM *vm, addr32 ip) {
+/* CALL and NCALL */
+static void vm_print_instr_opnd2(VM *vm, addr32 ip) {
 	int op_code = vm->code[ip];
 	VM_INSTRUCTION *inst = &vm_instructions[op_code];
 	char buf[100];
 	sprintf(buf, "%d, %d", int32(vm->code, ip + 1), int16(vm->code, ip + 5));
-	print(vm->trace, "%04d:  %-15s%-10s", ip, inst->name, buf);
+	trace_print(vm, "%04d:  %-15s%-10s", ip, inst->name, buf);
 }
 
 static void vm_print_instr(VM *vm, addr32 ip)
@@ -480,49 +415,101 @@ static void vm_print_instr(VM *vm, addr32 ip)
 
 static void vm_print_stack(VM *vm) {
 	// stack grows upwards; stack[sp] is top of stack
-	print(vm->trace, "calls=[");
+	trace_print(vm, "calls=[");
 	for (int i = 0; i <= vm->callsp; i++) {
 		Activation_Record *frame = &vm->call_stack[i];
-		print(vm->trace, " %s=[", frame->name);
+		trace_print(vm, " %s=[", frame->name);
 		for (int j = 0; j < frame->nlocals+frame->nargs; ++j) {
-			print(vm->trace, " ");
+			trace_print(vm, " ");
 			vm_trace_print_element(vm, frame->locals[j]);
 		}
-		print(vm->trace, " ]");
+		trace_print(vm, " ]");
 	}
-	print(vm->trace, " ]  ");
-	print(vm->trace, "stack=[");
+	trace_print(vm, " ]  ");
+	trace_print(vm, "stack=[");
 	for (int i = 0; i <= vm->sp; i++) {
-		print(vm->trace, " ");
+		trace_print(vm, " ");
 		vm_trace_print_element(vm, vm->stack[i]);
 	}
-	print(vm->trace, " ] sp=%d\n", vm->sp);
+	trace_print(vm, " ] sp=%d\n", vm->sp);
 }
 
 void vm_trace_print_element(VM *vm, element el) {
-	if (el.type == STRING) {
-		print(vm->trace, "\"");
-		vm_print_element(vm->trace, el);
-		print(vm->trace, "\"");
+	if (el.type == STRING || el.type == SHORT_STRING) {
+		trace_print(vm, "\"");
+		vm_print_element(vm, el);
+		trace_print(vm, "\"");
 	}
 	else {
-		vm_print_element(vm->trace, el);
+		vm_print_element(vm, el);
 	}
 }
 
-char *vm_print_element(char *buffer, element el) {
+static void vm_print_element(VM *vm, element el) {
 	switch ( el.type ) {
 		case INT :
-			return print(buffer, "%d", el.i);
+			trace_print(vm, "%d", el.i);
+			break;
 		case BOOLEAN :
-			return print(buffer, "%s", el.b ? "true" : "false");
+			trace_print(vm, "%s", el.b ? "true" : "false");
+			break;
 		case STRING :
-			return print(buffer, "%s", el.s->str);
+			trace_print(vm, "%s", String_str(el.s));
+			break;
+		case SHORT_STRING :
+			trace_print(vm, "%s", el.chars);
+			break;
 		default:
-			return print(buffer, "%s", "?");
+			trace_print(vm, "%s", "?");
+			break;
 	}
 }
 
+/* append to vm->trace, which grows as needed; O(1) per call, unlike print() */
+static void trace_print(VM *vm, const char *fmt, ...) {
+	va_list args;
+	size_t room = vm->trace_max - vm->trace_len;
+	va_start(args, fmt);
+	size_t n = (size_t)vsnprintf(vm->trace + vm->trace_len, room, fmt, args);
+	va_end(args);
+	if ( n >= room ) {
+		while ( vm->trace_len + n >= vm->trace_max ) vm->trace_max *= 2;
+		vm->trace = realloc(vm->trace, vm->trace_max);
+		va_start(args, fmt);
+		vsnprintf(vm->trace + vm->trace_len, vm->trace_max - vm->trace_len, fmt, args);
+		va_end(args);
+	}
+	vm->trace_len += n;
+}
+
+/* out of line so the engines have no stdio in them */
+static void vm_invalid_opcode(const Instr *I) {
+	printf("invalid opcode: %d at ip=%d\n", I->opcode, I->addr);
+	exit(1);
+}
+
+static void vm_bad_index(const Instr *I, int index, size_t n) {
+	printf("string index %d out of range 1..%d at ip=%d\n", index, (int)n, I->addr);
+	exit(1);
+}
+
+static void vm_unbound_native(VM *vm, const Instr *I) {
+	String *name = I->a >= 0 && I->a < vm->num_strings ? vm->strings[I->a] : NULL;
+	printf("no native function %s at ip=%d\n", name != NULL ? String_str(name) : "?", I->addr);
+	exit(1);
+}
+
+static inline Channel *vm_channel(VM *vm, const Instr *I) {
+	VM_Channels *t = vm->channels;
+	if ( t == NULL || I->a < 0 || I->a >= t->n || t->channels[I->a] == NULL ) vm_channel_error(I, "isn't connected");
+	return t->channels[I->a];
+}
+
+static void vm_channel_error(const Instr *I, const char *what) {
+	printf("channel %d %s at ip=%d\n", I->a, what, I->addr);
+	exit(1);
+}
+
 char *print(char *buffer, char *fmt, ...) {
 	va_list args;
 	char buf[1000];
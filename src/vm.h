@@ -22,6 +22,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -90,9 +91,18 @@ typedef enum {
 	PRINT,
 	SLEN,
 	SFREE,
+	NCALL,			// host function named by a string: string index, nargs; see natives.h
+	SEND,			// to another VM over a channel: channel number; see channel.h
+	RECV,
+	MORE,
+
+	// internal opcodes: never in .bytecode files; only vm_decode() produces them
+	CALL_CACHED,	// CALL whose callee is resolved: function index, nargs
+	NCALL_CACHED,	// NCALL whose native is bound: native index, nargs
 } BYTECODE;
 
-static const int NUM_INSTRS		= SFREE+1; // last opcode value + 1 is num instructions
+static const int NUM_INSTRS		= MORE+1; // last opcode value + 1 is num instructions
+static const int NUM_OPCODES	= NCALL_CACHED+1; // including internal ones
 
 typedef struct {
 	char *name;
@@ -101,7 +111,10 @@ typedef struct {
 	int num_stack_opnds;
 } VM_INSTRUCTION;
 
-typedef enum { INVALID=0, INT, BOOLEAN, STRING } element_type;
+// SHORT_STRING holds up to ELEMENT_INLINE_CHARS chars in the element itself; no heap String
+typedef enum { INVALID=0, INT, BOOLEAN, STRING, SHORT_STRING } element_type;
+
+#define ELEMENT_INLINE_CHARS 7
 
 typedef struct {
 	element_type type;
@@ -109,42 +122,98 @@ typedef struct {
 		int i;
 		bool b;
 		String *s;
+		char chars[ELEMENT_INLINE_CHARS+1]; // '\0' terminated
 	};
 } element;
 
+// One entry per function in the bytecode header; see functions.h
+typedef struct {
+	addr32 addr;
+	char *name;
+	int nargs;				// from the CALL sites; -1 if it's never called
+	int nlocals;			// LOCALS operand at the entry point, else 0
+	addr32 code_length;		// bytes up to the next function or the end of the code
+	addr32 body;			// first instruction after the entry LOCALS, if any
+	int entry_pc;			// addr and body as indexes into vm->instrs; set by vm_decode()
+	int body_pc;
+	bool pure;				// no side effects, ints and booleans only; set by vm_memo_enable()
+	bool lazy;				// body not loaded yet; see lazy.h
+} Function;
+
+typedef struct {
+	Function *functions;	// sorted by addr
+	int n;
+	int *by_name;			// open addressing hash tables of indexes into functions; -1 is empty
+	int *by_addr;
+	unsigned int mask;		// hash table size - 1
+} Function_Table;
+
+// One decoded instruction, fixed size and aligned; see decode.h
+typedef struct {
+	uint16_t opcode;		// BYTECODE
+	uint16_t types;			// static tags for STORE, PRINT, RET and CALL args; see type_infer.h
+	int32_t a;				// first operand; BR, BRF and CALL targets are instruction indexes
+	int32_t b;				// second operand (CALL nargs)
+	addr32 addr;			// where it is in vm->code, for traces and error messages
+} Instr;
+
 typedef struct activation_record {
-	addr32 retaddr;
+	addr32 retaddr;					// index into vm->instrs
 	char *name;						// set by CALL
 	int nargs;						// set by CALL
 	int nlocals;					// set by LOCALS
+	int memo_slot;					// where RET leaves the result if memo_stamp != 0; see memo.h
+	unsigned int memo_stamp;
 	element locals[MAX_LOCALS]; 	// args + locals go here per func def
 } Activation_Record;
 
 typedef struct {
 	// registers
-	addr32 ip;        	// instruction pointer register
+	addr32 ip;        	// bytecode address of the current instruction; kept up by the profiling/tracing engines
     int sp;             // stack pointer register
 	int callsp;			// call stack pointer register
 
 	byte *code;   		// byte-addressable code memory.
 	int code_size;
+	Instr *instrs;		// code decoded; this is what vm_exec() runs
+	int num_instrs;
 	element stack[MAX_OPND_STACK]; 	// operand stack, grows upwards; word addressable
 	Activation_Record call_stack[MAX_CALL_STACK];
 
-	int num_functions;
-	int max_func_addr;
-	char **func_names;
+	Function_Table funcs;
 	int num_strings;
 	String **strings;
 
-	char *trace;
+	char *trace;		// grows as needed; trace_len chars so far
+	size_t trace_len;
+	size_t trace_max;
 	char *output;		// prints strcat on to the end of this buffer
+
+	Allocator *allocator;	// runtime strings; an arena unless vm_set_allocator() says otherwise
+	bool owns_allocator;
+
+	struct vm_perf *perf;	// hardware counters per function; see vm_perf_enable()
+	struct vm_memo *memo;	// results of pure functions; see vm_memo_enable()
+	struct vm_jit *jit;		// native traces of hot loops; see vm_jit_enable()
+	struct vm_natives *natives;	// host functions for NCALL; see vm_bind_native()
+	struct vm_channels *channels;	// to other VMs for SEND, RECV and MORE; see vm_connect()
+	struct vm_lazy *lazy;	// function bodies still to load; see lazy.h
+	struct vm_program *program;	// the shared image this VM runs, if any; see program.h
+	struct program_slot *slot;	// where vm_exec() looks for a newer one
+	bool sampled;			// a sampling profiler reads vm->ip; see profiler.h
+	bool untagged;			// INT/BOOLEAN stack values may go without their tags; see type_infer.h
+	bool pure_known;		// Function.pure holds for these instrs; see memo_find_pure()
 } VM;
 
 extern VM *vm_alloc();
 extern void vm_init(VM *vm, byte *code, int code_size);
 extern void vm_free(VM *vm);
+extern void vm_reset(VM *vm);
+extern void vm_set_allocator(VM *vm, Allocator *a);
 extern void vm_exec(VM *vm, bool trace_to_stderr);
+extern void vm_run(VM *vm, int pc, bool trace_to_stderr);	// from instruction pc; vm_exec() sets up main first
+// host calls: look f up once with function_named(&vm->funcs, name), then call it as often as needed
+extern bool vm_call(VM *vm, Function *f, const element *args, int nargs, element *result);
 extern VM_INSTRUCTION vm_instructions[];
 extern char *print(char *buffer, char *fmt, ...);
 
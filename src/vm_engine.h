@@ -0,0 +1,348 @@
+/* The interpreter loop, written once and compiled into several engines.
+ * vm.c includes this file once per engine after defining
+ *
+ *   ENGINE_NAME      name of the static function to define
+ *   ENGINE_TRACE     1: append every instruction and the stacks to vm->trace
+ *   ENGINE_PROFILE   1: keep vm->ip current for the sampling profiler and
+ *                    call the perf_*() hooks when vm->perf is set
+ *   ENGINE_UNTAGGED  1: push INT and BOOLEAN results without their tags and
+ *                    tag them from Instr.types where they leave the stack;
+ *                    only for code vm_infer_types() accepted
+ *
+ * Engines with neither TRACE nor PROFILE also hand backward branches to
+ * the JIT when vm->jit is set (see jit.h).
+ *
+ * With TRACE and PROFILE 0 the engine has no diagnostic code in it at all. The
+ * ENGINE_* tests are constants, so each engine only keeps its own.
+ * There is deliberately no include guard.
+ */
+
+#if ENGINE_UNTAGGED
+#define PUSH_INT(v) (vm->stack[++vm->sp].i = (v))
+#define PUSH_BOOL(v) (vm->stack[++vm->sp].i = 0, vm->stack[vm->sp].b = (v))
+#else
+#define PUSH_INT(v) (vm->stack[++vm->sp] = (element) {.type = INT, .i = (v)})
+#define PUSH_BOOL(v) (vm->stack[++vm->sp] = (element) {.type = BOOLEAN, .b = (v)})
+#endif
+
+#define ENGINE_JIT (!ENGINE_TRACE && !ENGINE_PROFILE)
+
+static void ENGINE_NAME(VM *vm, int pc) {
+	Instr *I;
+	int x = 0;
+	int y = 0;
+	size_t n = 0;
+	char buf[12];
+	char *chars;
+	String *s = NULL;
+	String *output = NULL;
+	element e;
+	Activation_Record *frame;
+	Function *f;
+	int slot = 0;
+	unsigned int stamp;
+
+	while (pc < vm->num_instrs) {
+		I = &vm->instrs[pc++];
+#if ENGINE_PROFILE
+		vm->ip = I->addr; // visible to the sampling profiler
+		if ( vm->perf != NULL ) perf_bytecode(vm->perf);
+#endif
+#if ENGINE_TRACE
+		vm_print_instr(vm, I->addr);
+#endif
+
+		switch(I->opcode) {
+			case HALT:
+				pc = vm->num_instrs;
+				break;
+			case IADD:
+				y = vm->stack[vm->sp--].i;
+				x = vm->stack[vm->sp--].i;
+				PUSH_INT(x+y);
+				break;
+			case ISUB:
+				y = vm->stack[vm->sp--].i;
+				x = vm->stack[vm->sp--].i;
+				PUSH_INT(x-y);
+				break;
+			case IMUL:
+				y = vm->stack[vm->sp--].i;
+				x = vm->stack[vm->sp--].i;
+				PUSH_INT(x*y);
+				break;
+			case IDIV:
+				y = vm->stack[vm->sp--].i;
+				x = vm->stack[vm->sp--].i;
+				PUSH_INT(x/y);
+				break;
+			case SADD:
+				e = el_add(vm, &vm->stack[vm->sp-1], &vm->stack[vm->sp]);
+				vm->sp -= 2;
+				vm->stack[++vm->sp] = e;
+				break;
+			case OR:
+				y = vm->stack[vm->sp--].b;
+				x = vm->stack[vm->sp--].b;
+				PUSH_BOOL(x || y);
+				break;
+			case AND:
+				y = vm->stack[vm->sp--].b;
+				x = vm->stack[vm->sp--].b;
+				PUSH_BOOL(x && y);
+				break;
+			case INEG:
+				vm->stack[vm->sp].i = -vm->stack[vm->sp].i;
+				break;
+			case NOT:
+				vm->stack[vm->sp].b = !vm->stack[vm->sp].b;
+				break;
+			case I2S:
+				x = vm->stack[vm->sp--].i;
+				n = sk_itoa(x, buf);
+				e = el_chars(vm, buf, n);
+				vm->stack[++vm->sp] = e;
+				break;
+			case IEQ:
+				y = vm->stack[vm->sp--].i;
+				x = vm->stack[vm->sp--].i;
+				PUSH_BOOL(x==y ? true : false);
+				break;
+			case INEQ:
+				y = vm->stack[vm->sp--].i;
+				x = vm->stack[vm->sp--].i;
+				PUSH_BOOL(x!=y ? true : false);
+				break;
+			case ILT:
+				y = vm->stack[vm->sp--].i;
+				x = vm->stack[vm->sp--].i;
+				PUSH_BOOL(x<y ? true : false);
+				break;
+			case ILE:
+				y = vm->stack[vm->sp--].i;
+				x = vm->stack[vm->sp--].i;
+				PUSH_BOOL(x<=y ? true : false);
+				break;
+			case IGT:
+				y = vm->stack[vm->sp--].i;
+				x = vm->stack[vm->sp--].i;
+				PUSH_BOOL(x>y ? true : false);
+				break;
+			case IGE:
+				y = vm->stack[vm->sp--].i;
+				x = vm->stack[vm->sp--].i;
+				PUSH_BOOL(x>=y ? true : false);
+				break;
+			case SEQ:
+				x = el_compare(&vm->stack[vm->sp-1], &vm->stack[vm->sp]);
+				vm->sp -= 2;
+				PUSH_BOOL(x == 0);
+				break;
+			case SNEQ:
+				x = el_compare(&vm->stack[vm->sp-1], &vm->stack[vm->sp]);
+				vm->sp -= 2;
+				PUSH_BOOL(x != 0);
+				break;
+			case SGT:
+				x = el_compare(&vm->stack[vm->sp-1], &vm->stack[vm->sp]);
+				vm->sp -= 2;
+				PUSH_BOOL(x > 0);
+				break;
+			case SGE:
+				x = el_compare(&vm->stack[vm->sp-1], &vm->stack[vm->sp]);
+				vm->sp -= 2;
+				PUSH_BOOL(x >= 0);
+				break;
+			case SLT:
+				x = el_compare(&vm->stack[vm->sp-1], &vm->stack[vm->sp]);
+				vm->sp -= 2;
+				PUSH_BOOL(x < 0);
+				break;
+			case SLE:
+				x = el_compare(&vm->stack[vm->sp-1], &vm->stack[vm->sp]);
+				vm->sp -= 2;
+				PUSH_BOOL(x <= 0);
+				break;
+
+			case BR:
+				pc = I->a;
+				if ( ENGINE_JIT && vm->jit != NULL && pc <= I - vm->instrs ) pc = jit_loop(vm, pc);
+				break;
+			case BRF:
+				if ( !vm->stack[vm->sp--].b ) {
+					pc = I->a;
+					if ( ENGINE_JIT && vm->jit != NULL && pc <= I - vm->instrs ) pc = jit_loop(vm, pc);
+				}
+				break;
+			case ICONST:
+				PUSH_INT(I->a);
+				break;
+			case SCONST:
+				s = vm->strings[I->a];
+				e = s->length <= ELEMENT_INLINE_CHARS ? el_chars(vm, s->str, s->length) : el_string(String_dup(vm->allocator, s));
+				vm->stack[++vm->sp] = e;
+				break;
+			case LOAD:
+				e = vm->call_stack[vm->callsp].locals[I->a];
+				vm->stack[++vm->sp] = e;
+				break;
+			case STORE:
+				if ( ENGINE_UNTAGGED && I->types ) vm->stack[vm->sp].type = I->types;
+				vm->call_stack[vm->callsp].locals[I->a] = vm->stack[vm->sp--];
+				break;
+			case SINDEX:
+				x = vm->stack[vm->sp--].i;
+				chars = el_str(&vm->stack[vm->sp--], &n);
+				if ( x < 1 || (size_t)x > n ) vm_bad_index(I, x, n);
+				e = el_chars(vm, &chars[x-1], 1); // indexed from 1
+				vm->stack[++vm->sp] = e;
+				break;
+			case POP:
+				vm->sp--;
+				break;
+			case CALL: // target isn't a function in the header
+				frame = &vm->call_stack[++vm->callsp];
+				frame->nargs = I->b;
+				frame->nlocals = 0;
+				frame->memo_stamp = 0;
+				frame->retaddr = pc;
+				for (int i=frame->nargs-1; i>=0; i--) {
+					frame->locals[i] = vm->stack[vm->sp--];
+				}
+				pc = I->a;
+				frame->name = NULL;
+				if ( ENGINE_PROFILE && vm->perf != NULL ) perf_call(vm->perf, -1);
+				break;
+			case CALL_CACHED:
+				// one-step frame setup from the call site; the callee's LOCALS is done here too
+				f = &vm->funcs.functions[I->a];
+				if ( __atomic_load_n(&f->lazy, __ATOMIC_ACQUIRE) ) vm_load_function(vm, f);
+				for (int i=0; ENGINE_UNTAGGED && I->types && i<I->b; i++) { // args go into a frame tagged
+					x = I->types >> 2*i & 3;
+					if ( x ) vm->stack[vm->sp - I->b + 1 + i].type = x;
+				}
+				stamp = 0;
+				if ( vm->memo != NULL && f->pure &&
+					 memo_lookup(vm->memo, I->a, &vm->stack[vm->sp - I->b + 1], I->b, &e, &slot, &stamp) ) {
+					vm->sp -= I->b; // no call at all
+					vm->stack[++vm->sp] = e;
+					break;
+				}
+				frame = &vm->call_stack[++vm->callsp];
+				frame->memo_slot = slot;
+				frame->memo_stamp = stamp;
+				frame->name = f->name;
+				frame->nargs = I->b;
+				frame->nlocals = ENGINE_TRACE ? 0 : f->nlocals; // traced LOCALS sets it, as before
+				frame->retaddr = pc;
+				for (int i=I->b-1; i>=0; i--) {
+					frame->locals[i] = vm->stack[vm->sp--];
+				}
+				for (int i=I->b; i<I->b+f->nlocals; i++) {
+					frame->locals[i] = (element) {.type = INVALID};
+				}
+				pc = ENGINE_TRACE ? f->entry_pc : f->body_pc; // the trace still shows LOCALS
+				if ( ENGINE_PROFILE && vm->perf != NULL ) perf_call(vm->perf, function_index(&vm->funcs, f));
+				break;
+			case NCALL_CACHED:
+				// no frame: the native reads the args where they are and its result replaces them
+				output = vm_flush_output(vm, output); // before anything a vm_call() back in PRINTs
+				for (int i=0; ENGINE_UNTAGGED && I->types && i<I->b; i++) {
+					x = I->types >> 2*i & 3;
+					if ( x ) vm->stack[vm->sp - I->b + 1 + i].type = x;
+				}
+				e = vm->natives->natives[I->a].fn(vm, &vm->stack[vm->sp - I->b + 1], I->b);
+				vm->sp -= I->b;
+				vm->stack[++vm->sp] = e;
+				break;
+			case NCALL:	// nothing bound to that name
+				vm_unbound_native(vm, I);
+				break;
+			case SEND:
+				e = vm->stack[vm->sp--];
+				if ( ENGINE_UNTAGGED && I->types ) e.type = I->types;
+				if ( e.type == STRING ) e.s = String_dup(&heap_allocator, e.s); // our allocator is ours alone
+				channel_send(vm_channel(vm, I), e);
+				break;
+			case RECV:
+				if ( !channel_recv(vm_channel(vm, I), &e) ) vm_channel_error(I, "is closed");
+				if ( e.type == STRING ) {
+					s = e.s;
+					e.s = String_dup(vm->allocator, s);
+					String_free(s);
+				}
+				vm->stack[++vm->sp] = e;
+				break;
+			case MORE:
+				PUSH_BOOL(channel_more(vm_channel(vm, I)));
+				break;
+			case LOCALS:
+				vm->call_stack[vm->callsp].nlocals = I->a;
+				break;
+			case RET:
+				frame = &vm->call_stack[vm->callsp--];
+				pc = frame->retaddr; // return value stays on the stack
+				if ( ENGINE_UNTAGGED && I->types ) vm->stack[vm->sp].type = I->types;
+				if ( frame->memo_stamp != 0 && vm->memo != NULL ) {
+					memo_fill(vm->memo, frame->memo_slot, frame->memo_stamp, vm->stack[vm->sp]);
+				}
+				if ( ENGINE_PROFILE && vm->perf != NULL ) perf_ret(vm->perf);
+				break;
+			case PRINT:
+				e = vm->stack[vm->sp--];
+				if ( ENGINE_UNTAGGED && I->types ) e.type = I->types;
+				switch (e.type) {
+					case INT:
+						x = e.i;
+						s = String_from_int(vm->allocator, x);
+						output = vm_append(vm, output, s);
+						String_free(s);
+						break;
+					case STRING:
+						output = vm_append(vm, output, e.s);
+						break;
+					case SHORT_STRING:
+						s = String_new(vm->allocator, e.chars);
+						output = vm_append(vm, output, s);
+						String_free(s);
+						break;
+					case BOOLEAN:
+						s = String_new(vm->allocator, e.b ? "true" : "false");
+						output = vm_append(vm, output, s);
+						String_free(s);
+						break;
+					default:
+						break;
+				}
+				s = String_from_char(vm->allocator, '\n');
+				output = vm_append(vm, output, s);
+				String_free(s);
+				break;
+			case SLEN:
+				el_str(&vm->stack[vm->sp--], &n);
+				PUSH_INT((int)n);
+				break;
+			case SFREE:
+				frame = &vm->call_stack[vm->callsp];
+				el_free(frame->locals[I->a]);
+				frame->locals[I->a] = (element) {.type = INVALID};
+				break;
+			default:
+				vm_invalid_opcode(I);
+		}
+
+#if ENGINE_TRACE
+		vm_print_stack(vm);
+#endif
+	}
+
+	vm_flush_output(vm, output);
+}
+
+#undef ENGINE_NAME
+#undef ENGINE_TRACE
+#undef ENGINE_PROFILE
+#undef ENGINE_UNTAGGED
+#undef ENGINE_JIT
+#undef PUSH_INT
+#undef PUSH_BOOL
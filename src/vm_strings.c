@@ -2,35 +2,48 @@
 #include <string.h>
 #include <stdio.h>
 #include "vm_strings.h"
+#include "string_kernels.h"
 #include <assert.h>
 
-String *String_alloc(size_t length) {
-	String *p = (String *)calloc(1, sizeof(String) + (length+1) * sizeof(char));
+static void rope_copy(String *s, char *dst);
+static int String_cmp(String *s, String *t);
+
+String *String_alloc(Allocator *a, size_t length) {
+	String *p = (String *)a->alloc(a, sizeof(String) + (length+1) * sizeof(char));
 	p->length = length;
+	p->allocator = a;
+	p->refs = 1;
+	p->chars = p->str;
 	return p;
 }
 
-String *String_new(char *orig) {
-	String *s = String_alloc(strlen(orig));
+String *String_new(Allocator *a, char *orig) {
+	String *s = String_alloc(a, strlen(orig));
 	strcpy(s->str, orig);
 	return s;
 }
 
-String *String_dup(String *orig) {
-	String *s = String_alloc(orig->length);
-	strcpy(s->str, orig->str);
+String *String_from_chars(Allocator *a, const char *orig, size_t n) {
+	String *s = String_alloc(a, n);
+	sk_copy(s->str, orig, n);
 	return s;
 }
 
-String *String_from_char(char c) {
+String *String_dup(Allocator *a, String *orig) {
+	String *s = String_alloc(a, orig->length);
+	sk_copy(s->str, String_str(orig), orig->length);
+	return s;
+}
+
+String *String_from_char(Allocator *a, char c) {
 	char buf[2] = {c, '\0'};
-	return String_new(buf);
+	return String_new(a, buf);
 }
 
-String *String_from_int(int value) {
-	char buf[50];
-	sprintf(buf,"%d",value);
-	return String_new(buf);
+String *String_from_int(Allocator *a, int value) {
+	char buf[12];
+	size_t n = sk_itoa(value, buf);
+	return String_from_chars(a, buf, n);
 }
 
 int String_len(String *s) {
@@ -41,24 +54,101 @@ int String_len(String *s) {
 	return (int)s->length;
 }
 
-String *String_add(String *s, String *t) {
+/* Always returns a new reference the caller must String_free(). Short
+ * results are copied; longer ones become a rope node holding references
+ * to s and t so loops that build strings piecemeal stay linear.
+ */
+String *String_add(Allocator *a, String *s, String *t) {
 	if ( s == NULL && t == NULL) {
 		fprintf(stderr, "Addition Operator cannot be applied to two NULL string objects\n");
 		return NIL_STRING;
 	}
-	if ( s == NULL ) return t; // don't REF/DEREF as we might free our return value
-	if ( t == NULL ) return s;
-	size_t n = strlen(s->str) + strlen(t->str);
-	String *u = String_alloc(n);
-	strcpy(u->str, s->str);
-	strcat(u->str, t->str);
+	if ( s == NULL ) { t->refs++; return t; }
+	if ( t == NULL ) { s->refs++; return s; }
+	size_t n = s->length + t->length;
+	if ( n < ROPE_MIN_LENGTH ) {
+		String *u = String_alloc(a, n);
+		sk_copy(u->str, String_str(s), s->length);
+		sk_copy(u->str + s->length, String_str(t), t->length);
+		return u;
+	}
+	String *u = (String *)a->alloc(a, sizeof(String));
+	u->length = n;
+	u->refs = 1;
+	u->allocator = a;
+	u->left = s;
+	u->right = t;
+	s->refs++;
+	t->refs++;
 	return u;
 }
 
+void String_free(String *s) {
+	while ( s != NULL && --s->refs == 0 ) {
+		String *next = NULL;
+		if ( s->left != NULL ) {
+			// recurse into the shorter side, loop on the longer; depth stays O(log n)
+			if ( s->left->length >= s->right->length ) {
+				String_free(s->right);
+				next = s->left;
+			}
+			else {
+				String_free(s->left);
+				next = s->right;
+			}
+		}
+		Allocator *a = s->allocator;
+		if ( s->chars != s->str ) a->free(a, s->chars);
+		a->free(a, s);
+		s = next;
+	}
+}
+
+bool String_is_rope(String *s) {
+	return s->chars == NULL;
+}
+
+/* Return contiguous text for s, flattening a rope on first use */
+char *String_str(String *s) {
+	if ( s->chars == NULL ) {
+		char *buf = s->allocator->alloc(s->allocator, s->length + 1);
+		rope_copy(s, buf);
+		buf[s->length] = '\0';
+		s->chars = buf;
+		String_free(s->left);
+		String_free(s->right);
+		s->left = s->right = NULL;
+	}
+	return s->chars;
+}
+
+/* copy s->length chars of s to dst; recurses only into the shorter child */
+static void rope_copy(String *s, char *dst) {
+	while ( s->chars == NULL ) {
+		String *l = s->left;
+		String *r = s->right;
+		if ( l->length >= r->length ) {
+			rope_copy(r, dst + l->length);
+			s = l;
+		}
+		else {
+			rope_copy(l, dst);
+			dst += l->length;
+			s = r;
+		}
+	}
+	sk_copy(dst, s->chars, s->length);
+}
+
+static int String_cmp(String *s, String *t) {
+	return sk_cmp(String_str(s), s->length, String_str(t), t->length);
+}
+
 bool String_eq(String *s, String *t) {
 	assert(s);
 	assert(t);
-	return strcmp(s->str, t->str) == 0;
+	if ( s->length != t->length ) return false;
+	return sk_eq(String_str(s), s->length, String_str(t), t->length);
 }
 
 bool String_neq(String *s, String *t) {
@@ -68,23 +158,23 @@ bool String_neq(String *s, String *t) {
 bool String_gt(String *s, String *t) {
 	assert(s);
 	assert(t);
-	return strcmp(s->str, t->str) > 0;
+	return String_cmp(s, t) > 0;
 }
 
 bool String_ge(String *s, String *t) {
 	assert(s);
 	assert(t);
-	return strcmp(s->str, t->str) >= 0;
+	return String_cmp(s, t) >= 0;
 }
 
 bool String_lt(String *s, String *t) {
 	assert(s);
 	assert(t);
-	return strcmp(s->str, t->str) < 0;
+	return String_cmp(s, t) < 0;
 
 }
 bool String_le(String *s, String *t) {
 	assert(s);
 	assert(t);
-	return strcmp(s->str, t->str) <= 0;
+	return String_cmp(s, t) <= 0;
 }
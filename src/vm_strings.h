@@ -4,8 +4,19 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#include "allocator.h"
+
 typedef struct string {
-	size_t length; // does not count the '\0' on end
+	size_t length; // does not count the '\0' on end; cached for ropes too
+	int refs;      // String_free() drops one reference; freed at zero
+	/* A concatenation (rope) node has left and right set and chars==NULL
+	 * until somebody needs contiguous bytes; String_str() then flattens
+	 * it into a separate buffer and drops the children.
+	 */
+	struct string *left;
+	struct string *right;
+	char *chars;   // contiguous, '\0' terminated text; == str for flat strings
+	Allocator *allocator; // where this string, its rope nodes and flattened text live
 	char str[];
 	/* the string starts at the end of fixed fields; this field
 	 * does not take any room in the structure; it's really just a
@@ -18,16 +29,24 @@ typedef struct string {
 
 static String* NIL_STRING = NULL;
 
+// results of String_add() shorter than this are copied, not roped
+static const size_t ROPE_MIN_LENGTH = 64;
+
 // You need to implement this function 
-String *String_alloc(size_t length);
+String *String_alloc(Allocator *a, size_t length);
 
 // You don't have to, but I have defined some useful functions
 // used by my VM:
-String *String_new(char *s);
-String *String_dup(String *orig);
-String *String_from_char(char c);
-String *String_add(String *s, String *t);
-String *String_from_int(int value);
+String *String_new(Allocator *a, char *s);
+String *String_from_chars(Allocator *a, const char *s, size_t n);
+String *String_dup(Allocator *a, String *orig);
+String *String_from_char(Allocator *a, char c);
+String *String_add(Allocator *a, String *s, String *t);
+String *String_from_int(Allocator *a, int value);
+void String_free(String *s);
+
+char *String_str(String *s);
+bool String_is_rope(String *s);
 
 bool String_eq(String *s, String *t);
 bool String_neq(String *s, String *t);
@@ -22,16 +22,50 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 #include <stdio.h>
+#include <string.h>
 #include "vm.h"
 #include "loader.h"
+#include "perf_counters.h"
+#include "profiler.h"
+#include "code_cache.h"
+#include "memo.h"
+#include "jit.h"
 
+/* wrun [-perf] [-prof] [-memo] [-jit] [-cache dir] file.bytecode
+ *   -perf  hardware counters per function (instrumented)
+ *   -prof  sampling profile at 1000 Hz
+ *   -memo  memoize pure functions (64k results)
+ *   -jit   compile hot loops to native code; no instruction trace then
+ *   -cache load from/save to a code cache in dir
+ */
 int main(int argc, char *argv[])
 {
-    FILE *f = fopen(argv[1], "r");
-    if ( f!=NULL ) {
-        VM *vm = vm_load(f);
-        vm_exec(vm, true);
+    bool perf = false;
+    bool prof = false;
+    bool memo = false;
+    bool jit = false;
+    for (int i = 1; i < argc-1; i++) {
+        if ( strcmp(argv[i], "-perf") == 0 ) perf = true;
+        else if ( strcmp(argv[i], "-prof") == 0 ) prof = true;
+        else if ( strcmp(argv[i], "-memo") == 0 ) memo = true;
+        else if ( strcmp(argv[i], "-jit") == 0 ) jit = true;
+        else if ( strcmp(argv[i], "-cache") == 0 && i+1 < argc-1 ) vm_set_cache_dir(argv[++i]);
+    }
+    VM *vm = vm_load_file(argv[argc-1], 0);
+    if ( vm!=NULL ) {
+        if ( perf ) vm_perf_enable(vm);
+        if ( memo ) vm_memo_enable(vm, 65536);
+        if ( jit ) jit = vm_jit_enable(vm, true);
+        Profiler *profiler = prof ? vm_profile_start(vm, 1000, 100000) : NULL;
+        vm_exec(vm, !jit);
+        vm_profile_stop(profiler);
         puts(vm->output);
+        if ( perf ) vm_perf_report(vm, stderr);
+        if ( memo ) vm_memo_report(vm, stderr);
+        if ( jit ) vm_jit_report(vm, stderr);
+        if ( profiler != NULL ) vm_profile_report(profiler, stderr);
+        vm_profile_free(profiler);
+        vm_free(vm);
     }
     return 0;
 }
@@ -1,11 +1,20 @@
+#define _POSIX_C_SOURCE 200809L // fork
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <vm.h>
 
 #include "vm.h"
 #include "c_unit.h"
 #include "loader.h"
+#include "code_cache.h"
+#include "decode.h"
+#include "jit.h"
+#include "functions.h"
+#include "lazy.h"
 
 static VM *run(char *code, bool trace);
 
@@ -587,6 +596,45 @@ void sindex() { // indexing is from 1 NOT 0
 	assert_str_equal("", diff);
 }
 
+/* exit status of running text in a child, which may exit() on an error */
+static int exit_status(const char *text) {
+	fflush(stdout);
+	pid_t pid = fork();
+	if ( pid == 0 ) {
+		if ( freopen("/dev/null", "w", stdout) == NULL ) _exit(2);
+		VM *child = vm_load_text(text, strlen(text));
+		vm_exec(child, false);
+		exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// s[i] for i outside 1..length stops the program instead of reading past the string
+void sindex_out_of_range() {
+	const char *strings[] = {"5/hello", "15/a longer one!"};
+	int lengths[] = {5, 15};
+	for (int k = 0; k < 2; k++) {
+		int indexes[] = {0, -1, lengths[k] + 1, 1000000, 1, lengths[k]};
+		for (int i = 0; i < 6; i++) {
+			char text[300];
+			snprintf(text, sizeof(text),
+				"1 strings\n"
+				"	0: %s\n"
+				"1 functions maxaddr=0\n"
+				"	0: 4/main\n"
+				"5 instr, 11 bytes\n"
+				"	SCONST 0\n"
+				"	ICONST %d\n"
+				"	SINDEX\n"
+				"	PRINT\n"
+				"	HALT\n", strings[k], indexes[i]);
+			assert_equal(i < 4 ? 1 : 0, exit_status(text));
+		}
+	}
+}
+
 void br() {
 	char *code =
 	"0 strings\n"
@@ -650,6 +698,82 @@ void brf() {
  * while ( i<5 ) {i = i + 1 }
  * print(i)
  */
+// a string element the way the VM would make it: inline up to ELEMENT_INLINE_CHARS
+static element str_el(const char *chars) {
+	size_t n = strlen(chars);
+	if ( n > ELEMENT_INLINE_CHARS ) return (element) {.type = STRING, .s = String_new(vm->allocator, (char *)chars)};
+	element e = {.type = SHORT_STRING};
+	strcpy(e.chars, chars);
+	return e;
+}
+
+static element call2(const char *name, element a, element b) {
+	element args[2] = {a, b}, result = {.type = INVALID};
+	vm_call(vm, function_named(&vm->funcs, name), args, 2, &result);
+	return result;
+}
+
+/* 7 chars stay in the element, 8 go to the heap: SADD across the line
+ * (and with a long string on either side), SLEN, SINDEX and compares
+ */
+void short_string_boundary() {
+	char *code =
+		"0 strings\n"
+		"6 functions maxaddr=30\n"
+		"	0: 4/main\n"
+		"	1: 3/cat\n"
+		"	9: 3/len\n"
+		"	14: 2/at\n"
+		"	22: 2/lt\n"
+		"	30: 2/eq\n"
+		"20 instr, 38 bytes\n"
+		"	HALT\n"
+		"	LOAD 0\n	LOAD 1\n	SADD\n	RET\n"
+		"	LOAD 0\n	SLEN\n	RET\n"
+		"	LOAD 0\n	LOAD 1\n	SINDEX\n	RET\n"
+		"	LOAD 0\n	LOAD 1\n	SLT\n	RET\n"
+		"	LOAD 0\n	LOAD 1\n	SEQ\n	RET\n";
+	vm = vm_load_text(code, strlen(code));
+	vm_exec(vm, false);
+	char long_chars[80];
+	memset(long_chars, 'x', 70);
+	long_chars[70] = '\0';
+
+	element e = call2("cat", str_el("abc"), str_el("defg"));
+	assert_equal(SHORT_STRING, e.type);
+	assert_str_equal("abcdefg", e.chars);
+	e = call2("cat", str_el("abc"), str_el("defgh"));
+	assert_equal(STRING, e.type);
+	assert_str_equal("abcdefgh", String_str(e.s));
+	e = call2("cat", str_el("ab"), str_el(long_chars));
+	assert_equal(STRING, e.type);
+	assert_equal(72, (int)e.s->length);
+	assert_equal(0, strncmp("abxx", String_str(e.s), 4));
+	e = call2("cat", str_el(long_chars), str_el("yz"));
+	assert_equal(72, (int)e.s->length);
+	assert_str_equal("yz", String_str(e.s) + 70);
+
+	element args[1] = {str_el("abcdefg")};
+	assert_true(vm_call(vm, function_named(&vm->funcs, "len"), args, 1, &e));
+	assert_equal(7, e.i);
+	args[0] = str_el("abcdefgh");
+	assert_true(vm_call(vm, function_named(&vm->funcs, "len"), args, 1, &e));
+	assert_equal(8, e.i);
+
+	e = call2("at", str_el("abcdefg"), (element) {.type = INT, .i = 7});
+	assert_equal(SHORT_STRING, e.type);
+	assert_str_equal("g", e.chars);
+	e = call2("at", str_el("abcdefgh"), (element) {.type = INT, .i = 8});
+	assert_str_equal("h", e.chars);
+
+	assert_true(call2("lt", str_el("abcdefg"), str_el("abcdefgh")).b);
+	assert_false(call2("lt", str_el("abcdefgh"), str_el("abcdefg")).b);
+	assert_false(call2("eq", str_el("abcdefg"), str_el("abcdefgh")).b);
+	assert_true(call2("eq", str_el("abcdefg"), str_el("abcdefg")).b);
+	assert_true(call2("eq", str_el("abcdefgh"), str_el("abcdefgh")).b);
+	assert_true(call2("lt", str_el(""), str_el("a")).b);
+}
+
 void while_stat() {
 	char *code =
 		"0 strings\n"
@@ -740,29 +864,565 @@ void while_stat() {
 	assert_str_equal("", diff);
 }
 
+// every mnemonic in a slot of its own under MNEMONIC_SEED; see loader.c
+void mnemonics() {
+	for (int i = 0; i < NUM_INSTRS; i++) {
+		assert_addr_equal(&vm_instructions[i], vm_instr(vm_instructions[i].name));
+	}
+	assert_addr_equal(NULL, vm_instr("ICONS"));
+	assert_addr_equal(NULL, vm_instr("ICONSTX"));
+	assert_addr_equal(NULL, vm_instr("iconst"));
+	assert_addr_equal(NULL, vm_instr(""));
+	assert_addr_equal(&vm_instructions[LOAD], vm_instr_n("LOAD 0", 4));
+}
+
+// operands may be separated by blanks or a comma; trailing text is ignored
+void operand_syntax() {
+	char *code =
+		"0 strings\n"
+		"2 functions maxaddr=9\n"
+		"	0: 4/main\n"
+		"	9: 3/foo\n"
+		"6 instr, 16 bytes\n"
+		"	CALL 9,0   ; CALL addr32, nargs16\n"
+		"	POP\n"
+		"	HALT\n"
+		"ICONST -7\n"
+		"	PRINT\n"
+		"	RET\n";
+	vm = vm_load_text(code, strlen(code));
+	assert_equal(16, vm->code_size);
+	assert_equal(CALL, vm->code[0]);
+	assert_equal(9, *(int32_t *)&vm->code[1]);
+	assert_equal(0, *(int16_t *)&vm->code[5]);
+	assert_equal(ICONST, vm->code[9]);
+	assert_equal(-7, *(int32_t *)&vm->code[10]);
+	vm_exec(vm, false);
+	assert_str_equal("-7\n", vm->output);
+}
+
+/* the same generated program loaded on 1 and 4 threads assembles to
+ * the same code, including a malformed line and lines past ninstr
+ */
+void parallel_load() {
+	char fname[400];
+	strcpy(fname, get_temp_dir());
+	strcat(fname, "/big.bytecode");
+	FILE *f = fopen(fname, "w");
+	int n = 3000;
+	fprintf(f, "1 strings\n   0: 2/hi\n1 functions maxaddr=0\n   0: 4/main\n");
+	fprintf(f, "%d instr, %d bytes\n", 3*n + 2, 9*n + 1 + 1);
+	for (int i = 0; i < n; i++) {
+		fprintf(f, "\tICONST %d\n\tSCONST 0\n\tPOP\n", i - n/2);
+	}
+	fprintf(f, "\tPOP 3\n");	// operand mismatch: just the opcode
+	fprintf(f, "\tHALT\n");
+	fprintf(f, "\tHALT\n");	// past ninstr
+	fclose(f);
+
+	vm = vm_load_file(fname, 1);
+	VM *vm4 = vm_load_file(fname, 4);
+	remove(fname);
+	assert_equal(9*n + 2, vm->code_size);
+	assert_equal(vm->code_size, vm4->code_size);
+	bool same = memcmp(vm->code, vm4->code, (size_t)vm->code_size) == 0;
+	int last = vm4->code[vm4->code_size-1];
+	vm_free(vm4);
+	assert_true(same);
+	assert_equal(HALT, last);
+	assert_equal(POP, vm->code[9*n]);
+	int first = *(int32_t *)&vm->code[1];
+	assert_true(first == -n/2);
+	assert_str_equal("hi", String_str(vm->strings[0]));
+	assert_addr_equal(NULL, vm_load_file("/nonexistent.bytecode", 2));
+}
+
+void code_cache() {
+	char dir[400], fname[450];
+	strcpy(dir, get_temp_dir());
+	strcat(dir, "/wvm_cache_test");
+	snprintf(fname, sizeof(fname), "%s/prog.bytecode", get_temp_dir());
+	char *text =
+		"1 strings\n"
+		"   0: 5/hello\n"
+		"2 functions maxaddr=9\n"
+		"	9: 3/foo\n"
+		"	0: 4/main\n"
+		"6 instr, 14 bytes\n"
+		"	CALL 9, 0\n"
+		"	POP\n"
+		"	HALT\n"
+		"	SCONST 0\n"
+		"	PRINT\n"
+		"	RET\n";
+	save_string_in_file("prog.bytecode", text);
+	char image[500];
+	snprintf(image, sizeof(image), "%s/%016llx.wvm", dir, (unsigned long long)cache_key(text, strlen(text)));
+	remove(image);	// from an earlier run
+	vm_set_cache_dir(dir);
+	vm_cache_reset_stats();
+
+	VM *cold = vm_load_file(fname, 1);
+	assert_equal(1, vm_cache_stats().misses);
+	assert_equal(1, vm_cache_stats().writes);
+	vm = vm_load_file(fname, 1);
+	assert_equal(1, vm_cache_stats().hits);
+	assert_equal(0, vm_cache_stats().errors);
+	bool same = cold->code_size == vm->code_size && memcmp(cold->code, vm->code, (size_t)vm->code_size) == 0;
+	// decoded, typed and checked for purity as a fresh load is, without doing it again
+	same = same && vm->instrs != NULL && vm->pure_known && cold->untagged == vm->untagged &&
+		   cold->num_instrs == vm->num_instrs &&
+		   memcmp(cold->instrs, vm->instrs, (size_t)vm->num_instrs * sizeof(Instr)) == 0;
+	for (int i = 0; same && i < vm->funcs.n; i++) {
+		Function *a = &cold->funcs.functions[i], *b = &vm->funcs.functions[i];
+		same = strcmp(a->name, b->name) == 0 && a->addr == b->addr && a->nargs == b->nargs &&
+			   a->nlocals == b->nlocals && a->body == b->body && a->entry_pc == b->entry_pc &&
+			   a->body_pc == b->body_pc && a->pure == b->pure && a->code_length == b->code_length;
+	}
+	vm_free(cold);
+	assert_true(same);
+	assert_str_equal("hello", String_str(vm->strings[0]));
+	assert_equal(9, vm_function(vm, "foo"));
+	vm_exec(vm, false);
+	assert_str_equal("hello\n", vm->output);
+
+	remove(image);
+	char *broken =	// loads with errors on stderr only, so it's never cached
+		"0 strings\n"
+		"0 functions maxaddr=0\n"
+		"3 instr, 3 bytes\n"
+		"	NOP\n"
+		"	BOGUS\n"
+		"	HALT\n";
+	save_string_in_file("prog.bytecode", broken);
+	snprintf(image, sizeof(image), "%s/%016llx.wvm", dir, (unsigned long long)cache_key(broken, strlen(broken)));
+	remove(image);
+	for (int nthreads = 1; nthreads <= 2; nthreads++) {
+		vm_free(vm_load_file(fname, nthreads));
+	}
+	assert_equal(1, vm_cache_stats().writes);
+	assert_equal(-1, access(image, F_OK));
+
+	snprintf(image, sizeof(image), "%s/%016llx.wvm", dir, (unsigned long long)cache_key("x", 1));
+	FILE *f = fopen(image, "w");	// garbage under some other program's key is ignored
+	fputs("not an image", f);
+	fclose(f);
+	assert_addr_equal(NULL, cache_load(cache_key("x", 1)));
+	assert_equal(1, vm_cache_stats().errors);
+	remove(image);
+
+	vm_set_cache_dir(NULL);
+}
+
+/* only main, what it calls and what those call get assembled; the code
+ * that does is what an eager load makes of it
+ */
+void lazy_load() {
+	char fname[400];
+	snprintf(fname, sizeof(fname), "%s/lazy.bytecode", get_temp_dir());
+	save_string_in_file("lazy.bytecode",
+		"0 strings\n"
+		"4 functions maxaddr=89\n"
+		"	0: 4/main\n"
+		"	89: 2/sq\n"
+		"	14: 6/unused\n"
+		"	26: 3/sum\n"
+		"31 instr, 97 bytes\n"
+		"	ICONST 3\n"		// main
+		"	CALL 26, 1\n"
+		"	PRINT\n"
+		"	HALT\n"
+		"	ICONST 99\n"		// unused @ 14
+		"	PRINT\n"
+		"	ICONST 0\n"
+		"	RET\n"
+		"	LOCALS 1\n"		// sum @ 26: squares n down to 1
+		"	ICONST 0\n"
+		"	STORE 1\n"
+		"	LOAD 0\n"			// 37
+		"	ICONST 0\n"
+		"	IGT\n"
+		"	BRF 85\n"
+		"	LOAD 1\n"
+		"	LOAD 0\n"
+		"	CALL 89, 1\n"
+		"	IADD\n"
+		"	STORE 1\n"
+		"	LOAD 0\n"
+		"	ICONST 1\n"
+		"	ISUB\n"
+		"	STORE 0\n"
+		"	BR 37\n"
+		"	LOAD 1\n"			// 85
+		"	RET\n"
+		"	LOAD 0\n"			// sq @ 89
+		"	LOAD 0\n"
+		"	IMUL\n"
+		"	RET\n");
+	VM *eager = vm_load_file(fname, 1);
+	vm = vm_load_file_lazy(fname);
+	remove(fname);
+	assert_true(vm->lazy != NULL);
+	assert_equal(0, vm_lazy_loaded(vm));
+	assert_equal(eager->num_instrs, vm->num_instrs);
+	Function *unused = function_named(&vm->funcs, "unused");
+	Function *sum = function_named(&vm->funcs, "sum");
+	assert_true(unused->lazy);
+
+	vm_exec(vm, false);
+	assert_str_equal("14\n", vm->output);
+	assert_equal(3, vm_lazy_loaded(vm));
+	assert_true(unused->lazy);
+	assert_equal(1, sum->nlocals);
+	assert_equal(function_named(&eager->funcs, "sum")->body_pc, sum->body_pc);
+	int same = 0;
+	for (int i = 0; i < vm->num_instrs; i++) {
+		Instr a = vm->instrs[i], b = eager->instrs[i];
+		same += a.opcode == b.opcode && a.a == b.a && a.b == b.b && a.addr == b.addr;
+	}
+	assert_equal(vm->num_instrs - 4, same);	// all but unused
+
+	element r;
+	assert_true(vm_call(vm, unused, NULL, 0, &r));
+	assert_str_equal("14\n99\n", vm->output);
+	assert_equal(4, vm_lazy_loaded(vm));
+
+	vm_decode(vm);	// everything, and not lazy any more
+	assert_true(vm->lazy == NULL);
+	same = memcmp(vm->code, eager->code, (size_t)eager->code_size) == 0;
+	vm_free(eager);
+	assert_true(same);
+	assert_addr_equal(NULL, vm_load_file_lazy("/nonexistent.bytecode"));
+}
+
+/* one aligned Instr per instruction; branches point at instructions,
+ * addr points back into the bytecode, and a branch into the middle of
+ * an instruction ends the program instead of running garbage
+ */
+void decoded_code() {
+	char *code =
+		"0 strings\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"7 instr, 21 bytes\n"
+		"	ICONST -3\n"		// 0
+		"	BR 11\n"			// 5
+		"	HALT\n"				// 10
+		"	LOAD 2\n"			// 11
+		"	POP\n"				// 14
+		"	BRF 16\n"			// 15: into its own operand
+		"	PRINT\n";			// 20
+	vm = vm_load_text(code, strlen(code));
+	assert_equal(7, vm->num_instrs);
+	assert_equal(0, (int)((uintptr_t)vm->instrs % sizeof(int32_t)));
+	assert_equal(ICONST, vm->instrs[0].opcode);
+	assert_true(vm->instrs[0].a == -3);
+	assert_equal(3, vm->instrs[1].a);
+	assert_equal(11, vm->instrs[3].addr);
+	assert_equal(2, vm->instrs[3].a);
+	assert_equal(7, vm->instrs[5].a);
+	assert_equal(4, vm_instr_index(vm, 14));
+	assert_equal(-1, vm_instr_index(vm, 12));
+	assert_equal(0, vm->funcs.functions[0].entry_pc);
+}
+
+/* the trace used to be a fixed 1MB buffer; now it grows, and the
+ * plain engine gives the same output without one
+ */
+void long_trace() {
+	int n = 20000;
+	char *code = malloc((size_t)n * 20 + 200);
+	char *p = code + sprintf(code, "0 strings\n0 functions maxaddr=0\n%d instr, %d bytes\n", 2*n + 2, 6*n + 6);
+	for (int i = 0; i < n; i++) p += sprintf(p, "\tICONST %d\n\tPOP\n", i);
+	sprintf(p, "\tICONST 7\n\tPRINT\n");
+	vm = vm_load_text(code, strlen(code));
+	free(code);
+	vm_exec(vm, true);
+	assert_str_equal("7\n", vm->output);
+	assert_true(vm->trace_len > 1000000);
+	assert_true(strlen(vm->trace) == vm->trace_len);
+	assert_true(strstr(vm->trace, "0005:  POP  ") != NULL);
+	vm_reset(vm);
+	vm_exec(vm, false);
+	assert_str_equal("7\n", vm->output);
+	assert_str_equal("", vm->trace);
+}
+
+/* all ints and booleans: run untagged, tagged again at STORE and PRINT */
+void untagged_ints() {
+	char *code =
+		"0 strings\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"14 instr, 38 bytes\n"
+		"	LOCALS 1\n"
+		"	ICONST 3\n"
+		"	ICONST 4\n"
+		"	IMUL\n"
+		"	STORE 0\n"			// 4
+		"	LOAD 0\n"
+		"	ICONST 12\n"
+		"	IEQ\n"
+		"	PRINT\n"			// 8
+		"	LOAD 0\n"
+		"	ICONST 2\n"
+		"	ISUB\n"
+		"	PRINT\n"			// 12
+		"	HALT\n";
+	vm = run(code, false);
+	assert_true(vm->untagged);
+	assert_equal(INT, vm->instrs[4].types);
+	assert_equal(BOOLEAN, vm->instrs[8].types);
+	assert_equal(INT, vm->instrs[12].types);
+	assert_str_equal("true\n10\n", vm->output);
+}
+
+/* an int on one path and a string on the other can't go untagged */
+void tagged_merge() {
+	char *code =
+		"1 strings\n"
+		"	0: 2/hi\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"9 instr, 31 bytes\n"
+		"	ICONST 1\n"		// 0
+		"	ICONST 0\n"		// 5
+		"	IGT\n"				// 10
+		"	BRF 26\n"			// 11
+		"	ICONST 5\n"		// 16
+		"	BR 29\n"			// 21
+		"	SCONST 0\n"		// 26
+		"	PRINT\n"			// 29
+		"	HALT\n";			// 30
+	vm = run(code, false);
+	assert_false(vm->untagged);
+	assert_str_equal("5\n", vm->output);
+}
+
+/* while_stat with 1000 trips: traced once hot, then native until the BRF exit */
+void jit_while_loop() {
+	char *code =
+		"0 strings\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"15 instr, 47 bytes\n"
+		"	LOCALS 1\n"			// 0
+		"	ICONST 0\n"			// 3
+		"	STORE 0\n"			// 8
+		"	LOAD 0\n"			// 11
+		"	ICONST 1000\n"		// 14
+		"	ILT\n"				// 19
+		"	BRF 42\n"			// 20
+		"	LOAD 0\n"			// 25
+		"	ICONST 1\n"			// 28
+		"	IADD\n"				// 31
+		"	STORE 0\n"			// 34
+		"	BR 11\n"			// 37
+		"	LOAD 0\n"			// 42
+		"	PRINT\n"			// 45
+		"	HALT\n";			// 46
+	vm = vm_load_text(code, strlen(code));
+	if ( !vm_jit_enable(vm, false) ) return; // no native code on this machine
+	vm_exec(vm, false);
+	assert_str_equal("1000\n", vm->output);
+	Jit_Stats stats = vm_jit_stats(vm);
+	assert_equal(1, (int)stats.compiled);
+	assert_equal(1, (int)stats.entries);
+	assert_equal(1, (int)stats.side_exits);
+	Jit_Trace *t = vm->jit->traces[3];
+	assert_true(t != NULL);
+	assert_equal(1000 - JIT_HOT - 1, (int)t->iterations); // JIT_HOT interpreted, one recorded
+	assert_equal(12, t->exits[1].pc);
+	assert_equal(1, (int)t->exits[1].count);
+
+	vm_reset(vm);
+	vm_exec(vm, false); // the trace is kept
+	assert_str_equal("1000\n", vm->output);
+	assert_equal(1, (int)vm_jit_stats(vm).compiled);
+	assert_equal(2, (int)vm_jit_stats(vm).entries);
+}
+
+/* PRINT in the body: never traced, same output */
+void jit_untraceable_loop() {
+	char *code =
+		"0 strings\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"15 instr, 47 bytes\n"
+		"	LOCALS 1\n"			// 0
+		"	ICONST 0\n"			// 3
+		"	STORE 0\n"			// 8
+		"	LOAD 0\n"			// 11
+		"	ICONST 60\n"		// 14
+		"	ILT\n"				// 19
+		"	BRF 46\n"			// 20
+		"	LOAD 0\n"			// 25
+		"	ICONST 1\n"			// 28
+		"	IADD\n"				// 33
+		"	STORE 0\n"			// 34
+		"	LOAD 0\n"			// 37
+		"	PRINT\n"			// 40
+		"	BR 11\n"			// 41
+		"	HALT\n";			// 46
+	vm = vm_load_text(code, strlen(code));
+	if ( !vm_jit_enable(vm, false) ) return;
+	vm_exec(vm, false);
+	assert_equal(0, (int)vm_jit_stats(vm).compiled);
+	assert_equal(1, (int)vm_jit_stats(vm).aborted);
+	assert_equal(9 * 2 + 51 * 3, (int)strlen(vm->output)); // "1\n" .. "60\n"
+}
+
+/* s = s + 1000 / (i*2 - 601): OSR into the trace with s and i in registers;
+ * at i == 300 the divisor is -1, so the trace deoptimizes with three values
+ * on its stack and the interpreter does that division
+ */
+void jit_osr_deopt() {
+	char *code =
+		"0 strings\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"27 instr, 83 bytes\n"
+		"	LOCALS 2\n"			// 0
+		"	ICONST 0\n"			// 3
+		"	STORE 0\n"			// 8
+		"	ICONST 0\n"			// 11
+		"	STORE 1\n"			// 16
+		"	LOAD 0\n"			// 19
+		"	ICONST 1000\n"		// 22
+		"	ILT\n"				// 27
+		"	BRF 78\n"			// 28
+		"	LOAD 1\n"			// 33
+		"	ICONST 1000\n"		// 36
+		"	LOAD 0\n"			// 41
+		"	ICONST 2\n"			// 44
+		"	IMUL\n"				// 49
+		"	ICONST 601\n"		// 50
+		"	ISUB\n"				// 55
+		"	IDIV\n"				// 56
+		"	IADD\n"				// 57
+		"	STORE 1\n"			// 58
+		"	LOAD 0\n"			// 61
+		"	ICONST 1\n"			// 64
+		"	IADD\n"				// 69
+		"	STORE 0\n"			// 70
+		"	BR 19\n"			// 73
+		"	LOAD 1\n"			// 78
+		"	PRINT\n"			// 81
+		"	HALT\n";			// 82
+	vm = vm_load_text(code, strlen(code));
+	vm_exec(vm, false);
+	char interpreted[32];
+	strcpy(interpreted, vm->output);
+	vm_reset(vm);
+	if ( !vm_jit_enable(vm, false) ) return;
+	vm_exec(vm, false);
+	assert_str_equal(interpreted, vm->output);
+	Jit_Stats stats = vm_jit_stats(vm);
+	assert_equal(1, (int)stats.compiled);
+	assert_equal(1, (int)stats.deopts);
+	assert_equal(2, (int)stats.entries); // and again after the deopt
+	Jit_Trace *t = vm->jit->traces[5];
+	assert_true(t != NULL);
+	assert_true(t->exits[2].deopt);
+	assert_equal(16, t->exits[2].pc);	// the IDIV
+	assert_equal(3, t->exits[2].depth);
+	assert_equal(1, (int)t->exits[2].count);
+}
+
+/* a 7 under the loop the whole time, and s = s + (i < 500 ? 1 : 2): from
+ * i == 500 every entry leaves at the inner BRF with s on the trace's stack
+ */
+void jit_osr_live_stack() {
+	char *code =
+		"0 strings\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"29 instr, 97 bytes\n"
+		"	LOCALS 2\n"			// 0
+		"	ICONST 7\n"			// 3
+		"	ICONST 0\n"			// 8
+		"	STORE 0\n"			// 13
+		"	ICONST 0\n"			// 16
+		"	STORE 1\n"			// 21
+		"	LOAD 0\n"			// 24
+		"	ICONST 1000\n"		// 27
+		"	ILT\n"				// 32
+		"	BRF 91\n"			// 33
+		"	LOAD 1\n"			// 38
+		"	LOAD 0\n"			// 41
+		"	ICONST 500\n"		// 44
+		"	ILT\n"				// 49
+		"	BRF 65\n"			// 50
+		"	ICONST 1\n"			// 55
+		"	BR 70\n"			// 60
+		"	ICONST 2\n"			// 65
+		"	IADD\n"				// 70
+		"	STORE 1\n"			// 71
+		"	LOAD 0\n"			// 74
+		"	ICONST 1\n"			// 77
+		"	IADD\n"				// 82
+		"	STORE 0\n"			// 83
+		"	BR 24\n"			// 86
+		"	LOAD 1\n"			// 91
+		"	IADD\n"				// 94
+		"	PRINT\n"			// 95
+		"	HALT\n";			// 96
+	vm = vm_load_text(code, strlen(code));
+	vm_exec(vm, false);
+	assert_str_equal("1507\n", vm->output);
+	vm_reset(vm);
+	if ( !vm_jit_enable(vm, false) ) return;
+	vm_exec(vm, false);
+	assert_str_equal("1507\n", vm->output);
+	Jit_Stats stats = vm_jit_stats(vm);
+	assert_equal(1, (int)stats.compiled);
+	assert_equal(0, (int)stats.deopts);
+	assert_equal(501, (int)stats.entries);
+	Jit_Trace *t = vm->jit->traces[6];
+	assert_true(t != NULL);
+	assert_equal(17, t->exits[2].pc);	// ICONST 2
+	assert_equal(1, t->exits[2].depth);
+	assert_equal(500, (int)t->exits[2].count);
+}
+
 int main(int argc, char *argv[]) {
 	c_unit_setup = setup;
 	c_unit_teardown = teardown;
 
-//	test(hello);
-//	test(locals);
-//	test(sfree);
-//	test(slen);
-//	test(iadd);
-//	test(isub_pos);
-//	test(isub_neg);
-//	test(imul);
-//	test(idiv);
-//	test(ieq);
-//	test(icmp);
-//	test(sadd);
-//	test(i2s);
-//	test(seq);
-//	test(scmp);
-//	test(sindex);
-//	test(br);
-//	test(brf);
+	test(hello);
+	test(locals);
+	test(sfree);
+	test(slen);
+	test(iadd);
+	test(isub_pos);
+	test(isub_neg);
+	test(imul);
+	test(idiv);
+	test(ieq);
+	test(icmp);
+	test(sadd);
+	test(i2s);
+	test(seq);
+	test(scmp);
+	test(sindex);
+	test(sindex_out_of_range);
+	test(br);
+	test(brf);
 	test(while_stat);
+	test(short_string_boundary);
+	test(mnemonics);
+	test(operand_syntax);
+	test(parallel_load);
+	test(code_cache);
+	test(lazy_load);
+	test(decoded_code);
+	test(long_trace);
+	test(untagged_ints);
+	test(tagged_merge);
+	test(jit_while_loop);
+	test(jit_untraceable_loop);
+	test(jit_osr_deopt);
+	test(jit_osr_live_stack);
 
 	return c_unit_fails;
 }
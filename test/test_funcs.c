@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <vm.h>
@@ -6,6 +7,14 @@
 #include "vm.h"
 #include "c_unit.h"
 #include "loader.h"
+#include "perf_counters.h"
+#include "functions.h"
+#include "memo.h"
+#include "inliner.h"
+#include "batch.h"
+#include "natives.h"
+#include "program.h"
+#include "channel.h"
 
 static VM *run(char *code, bool trace);
 
@@ -61,7 +70,7 @@ void call_hello() {
 		"0007:  POP                      calls=[ main=[ ] ]  stack=[ ] sp=-1\n"
 		"0008:  HALT                     calls=[ main=[ ] ]  stack=[ ] sp=-1\n";
 
-	vm = run(code, false);
+	vm = run(code, true);
 
 	assert_str_equal(expected_output, vm->output);
 
@@ -100,7 +109,7 @@ void print_arg() {
 		"0012:  POP                      calls=[ main=[ ] ]  stack=[ ] sp=-1\n"
 		"0013:  HALT                     calls=[ main=[ ] ]  stack=[ ] sp=-1\n";
 
-	vm = run(code, false);
+	vm = run(code, true);
 
 	assert_str_equal(expected_output, vm->output);
 
@@ -145,7 +154,7 @@ void print_args() {
 		"0017:  PRINT                    calls=[ main=[ ] ]  stack=[ ] sp=-1\n"
 		"0018:  HALT                     calls=[ main=[ ] ]  stack=[ ] sp=-1\n";
 
-	vm = run(code, false);
+	vm = run(code, true);
 
 	assert_str_equal(expected_output, vm->output);
 
@@ -192,7 +201,7 @@ void arg_and_local() {
 		"0012:  POP                      calls=[ main=[ ] ]  stack=[ ] sp=-1\n"
 		"0013:  HALT                     calls=[ main=[ ] ]  stack=[ ] sp=-1\n";
 
-	vm = run(code, false);
+	vm = run(code, true);
 
 	assert_str_equal(expected_output, vm->output);
 
@@ -327,7 +336,7 @@ void fib() {
 		"0087:  PRINT                    calls=[ main=[ ] ]  stack=[ ] sp=-1\n"
 		"0088:  HALT                     calls=[ main=[ ] ]  stack=[ ] sp=-1\n";
 
-	vm = run(code, false);
+	vm = run(code, true);
 
 	assert_str_equal(expected_output, vm->output);
 
@@ -335,15 +344,869 @@ void fib() {
 	assert_str_equal("", diff);
 }
 
+/* Same program as call_hello; bytecodes and calls are charged to the
+ * function executing them whether or not hardware counters are available.
+ */
+void perf_per_function() {
+	char *code =
+		"0 strings\n"
+		"2 functions maxaddr=9\n"
+		"	0: 4/main\n"
+		"	9: 3/foo\n"
+		"7 instr, 21 bytes\n"
+		"	CALL 9, 0\n"
+		"	POP\n"
+		"	HALT\n"
+		"	ICONST 1234\n"
+		"	PRINT\n"
+		"	ICONST 0\n"
+		"   RET\n";
+	save_string_in_file("t.bytecode", code);
+	char fname[400];
+	strcpy(fname, get_temp_dir());
+	strcat(fname, "/t.bytecode");
+	FILE *f = fopen(fname, "r");
+	vm = vm_load(f);
+	fclose(f);
+	vm_perf_enable(vm);
+	vm_exec(vm, false);
+
+	assert_str_equal("1234\n", vm->output);
+	assert_equal(3, vm->perf->functions[0].bytecodes);
+	assert_equal(0, vm->perf->functions[0].calls);
+	assert_equal(4, vm->perf->functions[1].bytecodes);
+	assert_equal(1, vm->perf->functions[1].calls);
+	assert_equal(7, vm->perf->total.bytecodes);
+}
+
+static void *exec_vm(void *arg) {
+	vm_exec(arg, false);
+	return NULL;
+}
+
+/* enabled on this thread and run on another: the counters move to the
+ * thread that runs, as they're per thread, and still open if they could
+ * be opened here
+ */
+void perf_other_thread() {
+	perf_per_function();
+	bool counting = vm->perf->group_fd >= 0;
+	long enabled_on = vm->perf->thread;
+	pthread_t t;
+	pthread_create(&t, NULL, exec_vm, vm);
+	pthread_join(t, NULL);
+
+	assert_str_equal("1234\n1234\n", vm->output);
+	assert_equal(14, vm->perf->total.bytecodes);
+	assert_equal(counting, (vm->perf->group_fd >= 0));
+	assert_true(vm->perf->thread != enabled_on);
+}
+
+/* header lists foo before main; the table is sorted by address and
+ * nargs/nlocals come from the code
+ */
+void function_table() {
+	char *code =
+		"0 strings\n"
+		"2 functions maxaddr=14\n"
+		"	14: 3/foo\n"
+		"	0: 4/main\n"
+		"11 instr, 33 bytes\n"
+		"	ICONST 1234\n"
+		"	CALL 14, 1\n"
+		"	POP\n"
+		"	HALT\n"
+		"	LOCALS 1\n"
+		"	LOAD 0\n"
+		"	STORE 1\n"
+		"	LOAD 1\n"
+		"	PRINT\n"
+		"	ICONST 0\n"
+		"   RET\n";
+	save_string_in_file("t.bytecode", code);
+	char fname[400];
+	strcpy(fname, get_temp_dir());
+	strcat(fname, "/t.bytecode");
+	FILE *f = fopen(fname, "r");
+	vm = vm_load(f);
+	fclose(f);
+
+	assert_equal(2, vm->funcs.n);
+	assert_str_equal("main", vm->funcs.functions[0].name);
+	assert_str_equal("foo", vm->funcs.functions[1].name);
+	assert_equal(14, vm_function(vm, "foo"));
+	assert_equal(0xFFFFFFFF, vm_function(vm, "bar"));
+
+	Function *foo = function_named(&vm->funcs, "foo");
+	assert_addr_equal(foo, function_at(&vm->funcs, 14));
+	assert_addr_equal(NULL, function_at(&vm->funcs, 20));
+	assert_addr_equal(foo, function_containing(&vm->funcs, 20));
+	assert_str_equal("main", function_containing(&vm->funcs, 13)->name);
+	assert_addr_equal(NULL, function_containing(&vm->funcs, 33));
+	assert_equal(1, foo->nargs);
+	assert_equal(1, foo->nlocals);
+	assert_equal(19, foo->code_length);
+	assert_equal(14, vm->funcs.functions[0].code_length);
+	assert_equal(-1, vm->funcs.functions[0].nargs);
+
+	vm_exec(vm, false);
+	assert_str_equal("1234\n", vm->output);
+}
+
+/* each CALL to a known function decodes to CALL_CACHED; the bytecode
+ * is left alone, and a second run traces the same
+ */
+void call_site_cache() {
+	char *code =
+		"0 strings\n"
+		"2 functions maxaddr=27\n"
+		"	0: 4/main\n"
+		"	27: 3/foo\n"
+		"14 instr, 46 bytes\n"
+		"	ICONST 1\n"				// 0
+		"	CALL 27, 1\n"			// 5
+		"	POP\n"					// 12
+		"	ICONST 2\n"				// 13
+		"	CALL 27, 1\n"			// 18
+		"	POP\n"					// 25
+		"	HALT\n"					// 26
+		// foo(x:int): var y:int; y = x; print y; return 0
+		"	LOCALS 1\n"				// 27
+		"	LOAD 0\n"
+		"	STORE 1\n"
+		"	LOAD 1\n"
+		"	PRINT\n"
+		"	ICONST 0\n"
+		"   RET\n";
+	vm = run(code, true);
+	assert_str_equal("1\n2\n", vm->output);
+	assert_equal(CALL, vm->code[5]);
+	assert_equal(CALL_CACHED, vm->instrs[1].opcode);
+	assert_equal(CALL_CACHED, vm->instrs[4].opcode);
+	assert_equal(18, vm->instrs[4].addr);
+	assert_equal(1, vm->instrs[1].b);
+	assert_str_equal("foo", vm->funcs.functions[vm->instrs[4].a].name);
+	assert_equal(7, vm->funcs.functions[1].entry_pc);
+	assert_equal(8, vm->funcs.functions[1].body_pc);
+
+	char first_trace[2000];
+	strcpy(first_trace, vm->trace);
+	vm_reset(vm);
+	vm_exec(vm, true);
+	assert_str_equal("1\n2\n", vm->output);
+	diff = strdiff(first_trace, vm->trace, 10000);
+	assert_str_equal("", diff);
+
+	vm_reset(vm);
+	vm_exec(vm, false); // straight past LOCALS
+	assert_str_equal("1\n2\n", vm->output);
+}
+
+/* fib is pure, so with memoization every fib(k) runs once; show is
+ * impure (PRINT) and so is main, which calls it
+ */
+void memo_fib() {
+	char *fib =
+		"0 strings\n"
+		"3 functions maxaddr=72\n"
+		"	0: 4/main\n"
+		"	20: 3/fib\n"
+		"	72: 4/show\n"
+		"24 instr, 80 bytes\n"
+		"	ICONST 20\n"			// 0
+		"	CALL 20, 1\n"			// 5
+		"	CALL 72, 1\n"			// 12
+		"	HALT\n"					// 19
+		// fib(n): if n < 2 return n; return fib(n-1) + fib(n-2)
+		"	LOAD 0\n"				// 20
+		"	ICONST 2\n"				// 23
+		"	ILT\n"					// 28
+		"	BRF 38\n"				// 29
+		"	LOAD 0\n"				// 34
+		"	RET\n"					// 37
+		"	LOAD 0\n"				// 38
+		"	ICONST 1\n"				// 41
+		"	ISUB\n"					// 46
+		"	CALL 20, 1\n"			// 47
+		"	LOAD 0\n"				// 54
+		"	ICONST 2\n"				// 57
+		"	ISUB\n"					// 62
+		"	CALL 20, 1\n"			// 63
+		"	IADD\n"					// 70
+		"	RET\n"					// 71
+		// show(x): print x; return x
+		"	LOAD 0\n"				// 72
+		"	PRINT\n"				// 75
+		"	LOAD 0\n"
+		"	RET\n";
+	vm = run(fib, false);
+	assert_str_equal("6765\n", vm->output);
+
+	vm_reset(vm);
+	vm_memo_enable(vm, 64);
+	assert_true(function_named(&vm->funcs, "fib")->pure);
+	assert_true(!function_named(&vm->funcs, "show")->pure);
+	assert_true(!function_named(&vm->funcs, "main")->pure);
+	vm_exec(vm, false);
+	assert_str_equal("6765\n", vm->output);
+	Memo_Stats stats = vm_memo_stats(vm);
+	assert_equal(21, (int)stats.misses); // fib(0..20) once each
+	assert_equal(18, (int)stats.hits); // of 39 calls: fib(20) and two from each fib(2..20)
+
+	vm_reset(vm);
+	vm_exec(vm, false); // remembered across runs
+	assert_str_equal("6765\n", vm->output);
+	assert_equal(19, (int)vm_memo_stats(vm).hits);
+	assert_equal(21, (int)vm_memo_stats(vm).misses);
+
+	vm_memo_enable(vm, 4); // one set: always evicting, never wrong
+	vm_reset(vm);
+	vm_exec(vm, false);
+	assert_str_equal("6765\n", vm->output);
+	assert_true(vm_memo_stats(vm).evictions > 0);
+}
+
+/* twice() is a leaf with a local and two RETs; after inlining main
+ * has no CALL left, a bigger LOCALS, a loop whose branches moved and
+ * twice() itself further down
+ */
+void inline_small_calls() {
+	char *code =
+		"0 strings\n"
+		"2 functions maxaddr=54\n"
+		"	0: 4/main\n"
+		"	54: 5/twice\n"
+		"29 instr, 91 bytes\n"
+		"	LOCALS 1\n"				// 0
+		"	ICONST 3\n"				// 3
+		"	STORE 0\n"				// 8
+		"	LOAD 0\n"				// 11: loop
+		"	CALL 54, 1\n"			// 14
+		"	PRINT\n"				// 21
+		"	LOAD 0\n"				// 22
+		"	ICONST 1\n"				// 25
+		"	ISUB\n"					// 30
+		"	STORE 0\n"				// 31
+		"	LOAD 0\n"				// 34
+		"	ICONST 0\n"				// 37
+		"	IGT\n"					// 42
+		"	BRF 53\n"				// 43
+		"	BR 11\n"				// 48
+		"	HALT\n"					// 53
+		// twice(x): var y = x + x; if y > 4 return y; return 0
+		"	LOCALS 1\n"				// 54
+		"	LOAD 0\n"				// 57
+		"	LOAD 0\n"				// 60
+		"	IADD\n"					// 63
+		"	STORE 1\n"				// 64
+		"	LOAD 1\n"				// 67
+		"	ICONST 4\n"				// 70
+		"	IGT\n"					// 75
+		"	BRF 85\n"				// 76
+		"	LOAD 1\n"				// 81
+		"	RET\n"					// 84
+		"	ICONST 0\n"				// 85
+		"	RET\n";					// 90
+	vm = run(code, false);
+	assert_str_equal("6\n0\n0\n", vm->output);
+	assert_equal(0, vm_inline(vm, 16)); // too big
+
+	assert_equal(1, vm_inline(vm, 64));
+	assert_equal(87, vm_function(vm, "twice")); // CALL (7) became STORE + 37 bytes of body
+	assert_equal(0, vm_function(vm, "main"));
+	assert_equal(3, vm->funcs.functions[0].nlocals);
+	for (int pc = 0; pc < vm->funcs.functions[1].entry_pc; pc++) {
+		assert_true(vm->instrs[pc].opcode != CALL_CACHED);
+	}
+	vm_reset(vm);
+	vm_exec(vm, false);
+	assert_str_equal("6\n0\n0\n", vm->output);
+	vm_reset(vm);
+	vm_exec(vm, true);
+	assert_str_equal("6\n0\n0\n", vm->output);
+	assert_equal(0, vm_inline(vm, 64)); // nothing calls it now
+}
+
+/* fib over 20 inputs in lanes, the same with every loop build and
+ * scalar; show() prints, so it runs scalar
+ */
+void batch_fib() {
+	char *fib =
+		"0 strings\n"
+		"3 functions maxaddr=72\n"
+		"	0: 4/main\n"
+		"	20: 3/fib\n"
+		"	72: 4/show\n"
+		"24 instr, 80 bytes\n"
+		"	ICONST 20\n"			// 0
+		"	CALL 20, 1\n"			// 5
+		"	CALL 72, 1\n"			// 12
+		"	HALT\n"					// 19
+		"	LOAD 0\n"				// 20
+		"	ICONST 2\n"				// 23
+		"	ILT\n"					// 28
+		"	BRF 38\n"				// 29
+		"	LOAD 0\n"				// 34
+		"	RET\n"					// 37
+		"	LOAD 0\n"				// 38
+		"	ICONST 1\n"				// 41
+		"	ISUB\n"					// 46
+		"	CALL 20, 1\n"			// 47
+		"	LOAD 0\n"				// 54
+		"	ICONST 2\n"				// 57
+		"	ISUB\n"					// 62
+		"	CALL 20, 1\n"			// 63
+		"	IADD\n"					// 70
+		"	RET\n"					// 71
+		"	LOAD 0\n"				// 72
+		"	PRINT\n"				// 75
+		"	LOAD 0\n"
+		"	RET\n";
+	vm = run(fib, false);
+	int n = 20, args[20], results[20], expected[20] = {0, 1};
+	for (int i = 0; i < n; i++) {
+		args[i] = n - 1 - i; // lanes recurse to different depths
+		if ( i >= 2 ) expected[i] = expected[i-1] + expected[i-2];
+	}
+
+	batch_level saved = batch_current();
+	batch_level levels[] = {BATCH_AVX2, BATCH_VECTOR, BATCH_SCALAR};
+	for (int l = 0; l < 3; l++) {
+		if ( !batch_use(levels[l]) ) continue;
+		memset(results, -1, sizeof(results));
+		assert_equal(levels[l] == BATCH_SCALAR ? 0 : n, vm_batch(vm, "fib", args, 1, n, results));
+		for (int i = 0; i < n; i++) {
+			assert_equal(expected[n - 1 - i], results[i]);
+		}
+	}
+	batch_use(saved);
+
+	vm_reset(vm);
+	assert_equal(0, vm_batch(vm, "show", args, 1, 3, results));
+	assert_equal(18, results[1]);
+	assert_str_equal("19\n18\n17\n", vm->output);
+	assert_equal(-1, vm_batch(vm, "nope", args, 1, 3, results));
+	assert_equal(-1, vm_batch(vm, "fib", args, 2, 3, results));
+}
+
+/* functions called from the host over and over on one loaded VM */
+void host_call() {
+	char *code =
+		"0 strings\n"
+		"4 functions maxaddr=80\n"
+		"	0: 4/main\n"
+		"	20: 3/fib\n"
+		"	72: 4/show\n"
+		"	80: 4/stop\n"
+		"25 instr, 81 bytes\n"
+		"	ICONST 20\n"			// 0
+		"	CALL 20, 1\n"			// 5
+		"	CALL 72, 1\n"			// 12
+		"	HALT\n"					// 19
+		"	LOAD 0\n"				// 20
+		"	ICONST 2\n"				// 23
+		"	ILT\n"					// 28
+		"	BRF 38\n"				// 29
+		"	LOAD 0\n"				// 34
+		"	RET\n"					// 37
+		"	LOAD 0\n"				// 38
+		"	ICONST 1\n"				// 41
+		"	ISUB\n"					// 46
+		"	CALL 20, 1\n"			// 47
+		"	LOAD 0\n"				// 54
+		"	ICONST 2\n"				// 57
+		"	ISUB\n"					// 62
+		"	CALL 20, 1\n"			// 63
+		"	IADD\n"					// 70
+		"	RET\n"					// 71
+		"	LOAD 0\n"				// 72
+		"	PRINT\n"				// 75
+		"	LOAD 0\n"				// 76
+		"	RET\n"					// 79
+		"	HALT\n";				// 80
+	vm = run(code, false);
+	assert_str_equal("6765\n", vm->output);
+	Function *fib = function_named(&vm->funcs, "fib");
+	Function *show = function_named(&vm->funcs, "show");
+	int sp = vm->sp, callsp = vm->callsp;
+
+	element result, arg;
+	int expected[10] = {0, 1, 1, 2, 3, 5, 8, 13, 21, 34};
+	for (int i = 0; i < 100000; i++) {
+		arg = (element) {.type = INT, .i = i % 10};
+		assert_true(vm_call(vm, fib, &arg, 1, &result));
+		assert_equal(INT, result.type);
+		assert_equal(expected[i % 10], result.i);
+	}
+	assert_equal(sp, vm->sp);
+	assert_equal(callsp, vm->callsp);
+
+	arg = (element) {.type = SHORT_STRING, .chars = "hi"};	// show takes anything
+	assert_true(vm_call(vm, show, &arg, 1, &result));
+	assert_equal(SHORT_STRING, result.type);
+	assert_str_equal("hi", result.chars);
+	arg = (element) {.type = BOOLEAN, .b = true};
+	assert_true(vm_call(vm, show, &arg, 1, NULL));
+	assert_str_equal("6765\nhi\ntrue\n", vm->output);
+
+	assert_false(vm_call(vm, function_named(&vm->funcs, "stop"), NULL, 0, &result)); // HALTed
+	assert_false(vm_call(vm, function_named(&vm->funcs, "nope"), NULL, 0, &result));
+	assert_false(vm_call(vm, fib, NULL, 0, &result));	// fib takes one
+	assert_equal(sp, vm->sp);
+	assert_equal(callsp, vm->callsp);
+}
+
+static element native_sum(VM *vm, element *args, int nargs) {
+	int sum = 0;
+	for (int i = 0; i < nargs; i++) sum += args[i].i;
+	return (element) {.type = INT, .i = sum};
+}
+
+static element native_product(VM *vm, element *args, int nargs) {
+	int product = 1;
+	for (int i = 0; i < nargs; i++) product *= args[i].i;
+	return (element) {.type = INT, .i = product};
+}
+
+static element native_len(VM *vm, element *args, int nargs) {
+	size_t n = args[0].type == SHORT_STRING ? strlen(args[0].chars) : args[0].s->length;
+	return (element) {.type = INT, .i = (int)n};
+}
+
+static element native_back(VM *vm, element *args, int nargs) {	// into the program again
+	element result = {.type = INVALID};
+	vm_call(vm, function_named(&vm->funcs, "square"), args, nargs, &result);
+	return result;
+}
+
+/* NCALL to host functions bound by name after loading */
+void native_calls() {
+	char *code =
+		"4 strings\n"
+		"	0: 3/sum\n"
+		"	1: 5/hello\n"
+		"	2: 3/len\n"
+		"	3: 4/back\n"
+		"2 functions maxaddr=48\n"
+		"	0: 4/main\n"
+		"	48: 6/square\n"
+		"16 instr, 56 bytes\n"
+		"	ICONST 2\n"			// 0
+		"	ICONST 3\n"			// 5
+		"	ICONST 4\n"			// 10
+		"	NCALL 0, 3\n"		// 15
+		"	PRINT\n"			// 22
+		"	SCONST 1\n"			// 23
+		"	NCALL 2, 1\n"		// 26
+		"	PRINT\n"			// 33
+		"	ICONST 7\n"			// 34
+		"	NCALL 3, 1\n"		// 39
+		"	PRINT\n"			// 46
+		"	HALT\n"				// 47
+		"	LOAD 0\n"			// 48
+		"	LOAD 0\n"			// 51
+		"	IMUL\n"				// 54
+		"	RET\n";				// 55
+	vm = vm_load_text(code, strlen(code));
+	vm_bind_native(vm, "sum", native_sum);
+	vm_bind_native(vm, "len", native_len);
+	vm_bind_native(vm, "back", native_back);
+	vm_exec(vm, false);
+	assert_str_equal("9\n5\n49\n", vm->output);
+	assert_equal(NCALL_CACHED, vm->instrs[3].opcode);
+	assert_equal(-1, vm->sp); // args gone, results printed
+
+	vm_bind_native(vm, "sum", native_product);	// rebinding takes effect at once
+	vm_reset(vm);
+	vm_exec(vm, true);
+	assert_str_equal("24\n5\n49\n", vm->output);
+	assert_true(strstr(vm->trace, "NCALL") != NULL);
+	assert_equal(2, native_named(vm, "back"));
+	assert_equal(-1, native_named(vm, "nope"));
+}
+
+/* a function called back from a native PRINTs after what main printed
+ * before the NCALL and before what it prints after
+ */
+void native_call_prints() {
+	char *code =
+		"1 strings\n"
+		"	0: 4/back\n"
+		"2 functions maxaddr=20\n"
+		"	0: 4/main\n"
+		"	20: 6/square\n"
+		"10 instr, 30 bytes\n"
+		"	ICONST 1\n"		// 0
+		"	PRINT\n"			// 5
+		"	ICONST 7\n"		// 6
+		"	NCALL 0, 1\n"		// 11
+		"	PRINT\n"			// 18
+		"	HALT\n"			// 19
+		"	LOAD 0\n"			// 20
+		"	PRINT\n"			// 23
+		"	ICONST 5\n"		// 24
+		"	RET\n";			// 29
+	vm = vm_load_text(code, strlen(code));
+	vm_bind_native(vm, "back", native_back);
+	vm_exec(vm, false);
+	assert_str_equal("1\n7\n5\n", vm->output);
+	vm_reset(vm);
+	vm_exec(vm, true);	// the tracing engine too
+	assert_str_equal("1\n7\n5\n", vm->output);
+}
+
+static Program_Slot *swap_slot;
+static Program *swap_next;
+
+static element native_swap(VM *vm, element *args, int nargs) {
+	program_publish(swap_slot, swap_next);
+	return (element) {.type = INT, .i = 0};
+}
+
+// main() { print v; }
+static Program *counter_program(int v) {
+	char text[200];
+	snprintf(text, sizeof(text),
+		"0 strings\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"3 instr, 7 bytes\n"
+		"	ICONST %d\n"
+		"	PRINT\n"
+		"	HALT\n", v);
+	return vm_program_new(vm_load_text(text, strlen(text)));
+}
+
+/* a new version published in the middle of a run: the run finishes on
+ * the old code, the next one is on the new, and the old image goes when
+ * the last VM lets go of it
+ */
+void program_swap() {
+	char *v1 =
+		"1 strings\n"
+		"	0: 4/swap\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"7 instr, 21 bytes\n"
+		"	ICONST 1\n"
+		"	PRINT\n"
+		"	NCALL 0, 0\n"
+		"	POP\n"
+		"	ICONST 1\n"
+		"	PRINT\n"
+		"	HALT\n";
+	VM *loaded = vm_load_text(v1, strlen(v1));
+	vm_bind_native(loaded, "swap", native_swap);
+	swap_slot = program_slot_new(vm_program_new(loaded));
+	swap_next = counter_program(2);
+	vm = vm_attach(swap_slot);
+	VM *idle = vm_attach(swap_slot);
+	vm_memo_enable(vm, 64);
+	Program *old = program_acquire(swap_slot);
+	assert_equal(4, old->refs);	// the slot, two VMs and this
+	assert_true(vm->code == old->code && idle->instrs == old->instrs);
+
+	vm_exec(vm, false);
+	assert_str_equal("1\n1\n", vm->output);
+	assert_addr_equal(swap_next, swap_slot->current);
+	assert_equal(2, (int)swap_next->version);
+	assert_equal(3, old->refs);
+
+	vm_reset(vm);
+	vm_exec(vm, false);
+	assert_str_equal("2\n", vm->output);
+	assert_addr_equal(swap_next, vm->program);
+	assert_true(vm->memo != NULL);
+	assert_equal(2, old->refs);
+	vm_free(idle);
+	assert_equal(1, old->refs);
+	program_release(old);	// freed here
+
+	vm_bind_native(vm, "swap", native_swap);	// shared code stays as it is
+	assert_equal(0, vm_inline(vm, 100));
+	vm_free(vm);
+	vm = NULL;
+	program_slot_free(swap_slot);
+}
+
+#define SWAP_THREADS 4
+#define SWAP_VERSIONS 50
+
+static void *run_while_swapping(void *arg) {
+	VM *v = vm_attach(arg);
+	int last = 0;
+	bool ok = true;
+	for (int i = 0; i < 500; i++) {
+		vm_reset(v);
+		vm_exec(v, false);
+		int k = atoi(v->output);
+		ok = ok && k >= last && k == (int)v->program->version; // never goes back
+		last = k;
+	}
+	vm_free(v);
+	return ok ? arg : NULL;
+}
+
+void program_swap_threads() {
+	Program_Slot *slot = program_slot_new(counter_program(1));
+	pthread_t threads[SWAP_THREADS];
+	for (int t = 0; t < SWAP_THREADS; t++) pthread_create(&threads[t], NULL, run_while_swapping, slot);
+	for (int v = 2; v <= SWAP_VERSIONS; v++) program_publish(slot, counter_program(v));
+	int ok = 0;
+	for (int t = 0; t < SWAP_THREADS; t++) {
+		void *r;
+		pthread_join(threads[t], &r);
+		ok += r != NULL;
+	}
+	assert_equal(SWAP_VERSIONS, (int)slot->current->version);
+	assert_equal(1, slot->current->refs);
+	program_slot_free(slot);
+	assert_equal(SWAP_THREADS, ok);
+}
+
+// while ( more(0) ) print recv(0);
+static char *PRINT_ALL =
+	"0 strings\n"
+	"1 functions maxaddr=0\n"
+	"	0: 4/main\n"
+	"6 instr, 18 bytes\n"
+	"	MORE 0\n"		// 0
+	"	BRF 17\n"		// 3
+	"	RECV 0\n"		// 8
+	"	PRINT\n"		// 11
+	"	BR 0\n"			// 12
+	"	HALT\n";		// 17
+
+/* values go through in order, the ring wraps, strings of both sizes
+ * cross from one VM's allocator to the other's and MORE sees the end
+ */
+void channels() {
+	Channel *c = channel_new(3);
+	assert_equal(3, (int)c->mask);
+	element e;
+	for (int round = 0; round < 3; round++) {
+		for (int i = 0; i < 4; i++) channel_send(c, (element) {.type = INT, .i = 10 * round + i});
+		for (int i = 0; i < 4; i++) {
+			assert_true(channel_recv(c, &e));
+			assert_equal(10 * round + i, e.i);
+		}
+	}
+	channel_close(c);
+	assert_true(!channel_more(c));
+	assert_true(!channel_recv(c, &e));
+	assert_equal(12, (int)channel_stats(c).recvs);
+	channel_free(c);
+
+	char *code =
+		"2 strings\n"
+		"	0: 2/hi\n"
+		"	1: 17/a longer greeting\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"7 instr, 21 bytes\n"
+		"	SCONST 0\n"
+		"	SEND 0\n"
+		"	SCONST 1\n"
+		"	SEND 0\n"
+		"	ICONST 42\n"
+		"	SEND 0\n"
+		"	HALT\n";
+	c = channel_new(4);
+	VM *producer = vm_load_text(code, strlen(code));
+	vm_connect(producer, 0, c);
+	vm_exec(producer, false);
+	channel_close(c);
+	vm_free(producer);	// and its strings
+	vm = vm_load_text(PRINT_ALL, strlen(PRINT_ALL));
+	vm_connect(vm, 0, c);
+	vm_exec(vm, false);
+	assert_str_equal("hi\na longer greeting\n42\n", vm->output);
+	assert_equal(3, (int)channel_stats(c).sends);
+	channel_free(c);
+}
+
+typedef struct {
+	VM *vm;
+	Channel *out;	// closed when the stage is done
+} Stage;
+
+static void *run_stage(void *arg) {
+	Stage *st = arg;
+	vm_exec(st->vm, false);
+	if ( st->out != NULL ) channel_close(st->out);
+	return NULL;
+}
+
+/* numbers -> 3x+1 -> printed, on three threads over small channels */
+void channel_pipeline() {
+	int n = 20000;
+	char source[400];
+	snprintf(source, sizeof(source),	// for (i = 0; i < n; i++) send(0, i);
+		"0 strings\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"15 instr, 49 bytes\n"
+		"	LOCALS 1\n"		// 0
+		"	ICONST 0\n"		// 3
+		"	STORE 0\n"		// 8
+		"	LOAD 0\n"		// 11
+		"	ICONST %d\n"	// 14
+		"	ILT\n"			// 19
+		"	BRF 48\n"		// 20
+		"	LOAD 0\n"		// 25
+		"	SEND 0\n"		// 28
+		"	LOAD 0\n"		// 31
+		"	ICONST 1\n"		// 34
+		"	IADD\n"			// 39
+		"	STORE 0\n"		// 40
+		"	BR 11\n"		// 43
+		"	HALT\n", n);	// 48
+	char *transform =		// while ( more(0) ) send(1, 3 * recv(0) + 1);
+		"0 strings\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"10 instr, 32 bytes\n"
+		"	MORE 0\n"		// 0
+		"	BRF 31\n"		// 3
+		"	RECV 0\n"		// 8
+		"	ICONST 3\n"		// 11
+		"	IMUL\n"			// 16
+		"	ICONST 1\n"		// 17
+		"	IADD\n"			// 22
+		"	SEND 1\n"		// 23
+		"	BR 0\n"			// 26
+		"	HALT\n";		// 31
+	char sink[200];	// PRINT_ALL from channel 1
+	strcpy(sink, PRINT_ALL);
+	sink[strstr(sink, "MORE 0") - sink + 5] = '1';
+	sink[strstr(sink, "RECV 0") - sink + 5] = '1';
+
+	Channel *a = channel_new(8), *b = channel_new(8);
+	Stage stages[3] = {
+		{vm_load_text(source, strlen(source)), a},
+		{vm_load_text(transform, strlen(transform)), b},
+		{vm_load_text(sink, strlen(sink)), NULL},
+	};
+	for (int i = 0; i < 3; i++) {
+		vm_connect(stages[i].vm, 0, a);
+		vm_connect(stages[i].vm, 1, b);
+	}
+	pthread_t threads[3];
+	for (int i = 0; i < 3; i++) pthread_create(&threads[i], NULL, run_stage, &stages[i]);
+	for (int i = 0; i < 3; i++) pthread_join(threads[i], NULL);
+
+	bool same = true;
+	const char *p = stages[2].vm->output;
+	for (int i = 0; i < n && same; i++) {
+		char *end;
+		same = strtol(p, &end, 10) == 3 * i + 1 && *end == '\n';
+		p = end + 1;
+	}
+	same = same && *p == '\0';
+	Channel_Stats sa = channel_stats(a), sb = channel_stats(b);
+	for (int i = 0; i < 3; i++) vm_free(stages[i].vm);
+	channel_free(a);
+	channel_free(b);
+	assert_true(same);
+	assert_equal(n, (int)sa.recvs);
+	assert_equal(n, (int)sb.sends);
+}
+
+#define STRING_SENDERS 4
+
+/* pairs of VMs on their own threads, all passing heap strings at once */
+void channel_long_strings() {
+	int n = 5000;
+	char producer[500];
+	snprintf(producer, sizeof(producer),	// for (i = 0; i < n; i++) send(0, "...");
+		"1 strings\n"
+		"	0: 30/a string too long to go inline\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"15 instr, 49 bytes\n"
+		"	LOCALS 1\n"		// 0
+		"	ICONST 0\n"		// 3
+		"	STORE 0\n"		// 8
+		"	LOAD 0\n"		// 11
+		"	ICONST %d\n"	// 14
+		"	ILT\n"			// 19
+		"	BRF 48\n"		// 20
+		"	SCONST 0\n"		// 25
+		"	SEND 0\n"		// 28
+		"	LOAD 0\n"		// 31
+		"	ICONST 1\n"		// 34
+		"	IADD\n"			// 39
+		"	STORE 0\n"		// 40
+		"	BR 11\n"		// 43
+		"	HALT\n", n);	// 48
+	char *consumer =		// s = 0; while ( more(0) ) s += len(recv(0)); print s;
+		"0 strings\n"
+		"1 functions maxaddr=0\n"
+		"	0: 4/main\n"
+		"14 instr, 40 bytes\n"
+		"	LOCALS 1\n"		// 0
+		"	ICONST 0\n"		// 3
+		"	STORE 0\n"		// 8
+		"	MORE 0\n"		// 11
+		"	BRF 35\n"		// 14
+		"	RECV 0\n"		// 19
+		"	SLEN\n"			// 22
+		"	LOAD 0\n"		// 23
+		"	IADD\n"			// 26
+		"	STORE 0\n"		// 27
+		"	BR 11\n"		// 30
+		"	LOAD 0\n"		// 35
+		"	PRINT\n"		// 38
+		"	HALT\n";		// 39
+
+	size_t before = heap_allocator.allocations;
+	Channel *c[STRING_SENDERS];
+	Stage stages[2 * STRING_SENDERS];
+	pthread_t threads[2 * STRING_SENDERS];
+	for (int i = 0; i < STRING_SENDERS; i++) {
+		c[i] = channel_new(16);
+		stages[2*i] = (Stage) {vm_load_text(producer, strlen(producer)), c[i]};
+		stages[2*i+1] = (Stage) {vm_load_text(consumer, strlen(consumer)), NULL};
+		vm_connect(stages[2*i].vm, 0, c[i]);
+		vm_connect(stages[2*i+1].vm, 0, c[i]);
+	}
+	for (int i = 0; i < 2 * STRING_SENDERS; i++) pthread_create(&threads[i], NULL, run_stage, &stages[i]);
+	for (int i = 0; i < 2 * STRING_SENDERS; i++) pthread_join(threads[i], NULL);
+
+	char expected[20];
+	snprintf(expected, sizeof(expected), "%d\n", 30 * n);
+	int same = 0;
+	for (int i = 0; i < STRING_SENDERS; i++) same += strcmp(expected, stages[2*i+1].vm->output) == 0;
+	for (int i = 0; i < 2 * STRING_SENDERS; i++) vm_free(stages[i].vm);
+	for (int i = 0; i < STRING_SENDERS; i++) channel_free(c[i]);
+	assert_equal(STRING_SENDERS, same);
+	assert_true(heap_allocator.allocations - before >= (size_t)(STRING_SENDERS * n));
+}
+
 int main(int argc, char *argv[]) {
 	c_unit_setup = setup;
 	c_unit_teardown = teardown;
 
-//	test(call_hello);
-//	test(print_arg);
+	test(call_hello);
+	test(print_arg);
 	test(print_args);
-//	test(arg_and_local);
-//	test(fib);
+	test(perf_per_function);
+	test(perf_other_thread);
+	test(function_table);
+	test(call_site_cache);
+	test(memo_fib);
+	test(inline_small_calls);
+	test(batch_fib);
+	test(host_call);
+	test(native_calls);
+	test(native_call_prints);
+	test(program_swap);
+	test(program_swap_threads);
+	test(channels);
+	test(channel_pipeline);
+	test(channel_long_strings);
+	test(arg_and_local);
+	test(fib);
 
 	return c_unit_fails;
 }
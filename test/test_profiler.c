@@ -0,0 +1,135 @@
+#define _POSIX_C_SOURCE 200809L // open_memstream
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "profiler.h"
+#include "c_unit.h"
+
+// globals so we can free them upon failure (which bails out of test functions)
+
+static VM *vm;
+static Profiler *prof;
+static char *report;
+
+static void setup() {
+	vm = vm_alloc();
+	vm_init(vm, NULL, 0);
+	prof = NULL;
+	report = NULL;
+}
+
+static void teardown() {
+	vm_profile_free(prof);
+	vm_free(vm);
+	free(report);
+}
+
+static void push_frame(char *name) {
+	vm->call_stack[++vm->callsp].name = name;
+}
+
+static char *report_of(Profiler *p) {
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *f = open_memstream(&buf, &size);
+	vm_profile_report(p, f);
+	fclose(f);
+	return buf;
+}
+
+void samples_record_ip_and_chain() {
+	char *main_name = "main", *fib = "fib";
+	prof = calloc(1, sizeof(Profiler));
+	prof->vm = vm;
+	prof->capacity = 4;
+	prof->samples = calloc(4, sizeof(Profile_Sample));
+	push_frame(main_name);
+	push_frame(fib);
+	push_frame(fib);
+	vm->ip = 42;
+	vm_profile_sample(prof);
+	assert_equal(1, prof->nsamples);
+	assert_equal(42, prof->samples[0].ip);
+	assert_equal(3, prof->samples[0].depth);
+	assert_str_equal("main", prof->samples[0].chain[0]);
+	assert_str_equal("fib", prof->samples[0].chain[2]);
+}
+
+void full_buffer_drops() {
+	prof = calloc(1, sizeof(Profiler));
+	prof->vm = vm;
+	prof->capacity = 1;
+	prof->samples = calloc(1, sizeof(Profile_Sample));
+	push_frame("main");
+	vm_profile_sample(prof);
+	vm_profile_sample(prof);
+	assert_equal(1, prof->nsamples);
+	assert_equal(1, prof->dropped);
+}
+
+void report_self_and_total() {
+	char *main_name = "main", *fib = "fib";
+	prof = calloc(1, sizeof(Profiler));
+	prof->vm = vm;
+	prof->hz = 100;
+	prof->capacity = 4;
+	prof->samples = calloc(4, sizeof(Profile_Sample));
+	push_frame(main_name);
+	vm_profile_sample(prof);		// main
+	push_frame(fib);
+	vm_profile_sample(prof);		// main;fib
+	push_frame(fib);
+	vm_profile_sample(prof);		// main;fib;fib (fib counted once in total)
+	report = report_of(prof);
+	assert_true(strstr(report, "3 samples at 100 Hz") != NULL);
+	assert_true(strstr(report, "fib                     2   66.7%        2   66.7%") != NULL);
+	assert_true(strstr(report, "main                    1   33.3%        3  100.0%") != NULL);
+	assert_true(strstr(report, "       1  main;fib;fib") != NULL);
+}
+
+void timer_takes_samples() {
+	push_frame("main");
+	prof = vm_profile_start(vm, 1000, 1000);
+	assert_addr_not_equal(NULL, prof);
+	assert_addr_equal(NULL, vm_profile_start(vm, 1000, 1000)); // one at a time
+	volatile unsigned long x = 0;
+	while ( prof->nsamples < 5 ) x++;	// burn CPU until the timer fires a few times
+	vm_profile_stop(prof);
+	int n = prof->nsamples;
+	for (x = 0; x < 10000000; x++) ;
+	assert_equal(n, prof->nsamples);	// no samples once stopped
+	assert_str_equal("main", prof->samples[0].chain[0]);
+}
+
+void perf_map_entries() {
+	char fname[64];
+	snprintf(fname, sizeof(fname), "/tmp/perf-%d.map", (int)getpid());
+	unlink(fname);
+	FILE *map = perf_map_open();
+	assert_addr_not_equal(NULL, map);
+	perf_map_add(map, (void *)0x1000, 0x40, "trace_fib_12");
+	perf_map_close(map);
+	char line[100] = "";
+	FILE *f = fopen(fname, "r");
+	fgets(line, sizeof(line), f);
+	fclose(f);
+	unlink(fname);
+	assert_str_equal("1000 40 trace_fib_12\n", line);
+}
+
+int main(int argc, char *argv[]) {
+	c_unit_setup = setup;
+	c_unit_teardown = teardown;
+
+	test(samples_record_ip_and_chain);
+	test(full_buffer_drops);
+	test(report_self_and_total);
+	test(timer_takes_samples);
+	test(perf_map_entries);
+
+	return c_unit_fails;
+}
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "vm_strings.h"
+#include "string_kernels.h"
+#include "c_unit.h"
+
+// globals so we can free them upon failure (which bails out of test functions)
+
+static String *s;
+static String *t;
+
+static void setup() {
+	s = NULL;
+	t = NULL;
+}
+
+static void teardown() {
+	String_free(s);
+	String_free(t);
+}
+
+void short_add_is_flat() {
+	s = String_new(&heap_allocator, "hello");
+	t = String_new(&heap_allocator, "bye");
+	String *u = String_add(&heap_allocator, s, t);
+	assert_false(String_is_rope(u));
+	assert_equal(8, String_len(u));
+	assert_str_equal("hellobye", String_str(u));
+	String_free(u);
+}
+
+void long_add_is_rope() {
+	char buf[ROPE_MIN_LENGTH+1];
+	memset(buf, 'a', ROPE_MIN_LENGTH);
+	buf[ROPE_MIN_LENGTH] = '\0';
+	s = String_new(&heap_allocator, buf);
+	t = String_new(&heap_allocator, "b");
+	String *u = String_add(&heap_allocator, s, t);
+	assert_true(String_is_rope(u));
+	assert_equal(ROPE_MIN_LENGTH+1, String_len(u));
+	String_free(s); // rope keeps its own reference to s
+	s = NULL;
+	assert_equal('b', String_str(u)[ROPE_MIN_LENGTH]);
+	assert_false(String_is_rope(u));
+	assert_equal(0, strncmp(buf, String_str(u), ROPE_MIN_LENGTH));
+	String_free(u);
+}
+
+/* s = s + c in a loop, then s = c + s; neither side should recurse deeply */
+void build_in_loop() {
+	int n = 100000;
+	s = String_new(&heap_allocator, "");
+	for (int i = 0; i < n; i++) {
+		String *c = String_from_char(&heap_allocator, (char)('a' + i % 26));
+		String *u = String_add(&heap_allocator, s, c);
+		String_free(c);
+		String_free(s);
+		s = u;
+	}
+	assert_equal(n, String_len(s));
+	t = String_new(&heap_allocator, "");
+	for (int i = n-1; i >= 0; i--) {
+		String *c = String_from_char(&heap_allocator, (char)('a' + i % 26));
+		String *u = String_add(&heap_allocator, c, t);
+		String_free(c);
+		String_free(t);
+		t = u;
+	}
+	assert_equal(n, String_len(t));
+	assert_true(String_eq(s, t));
+	char *p = String_str(s);
+	for (int i = 0; i < n; i++) {
+		assert_equal('a' + i % 26, p[i]);
+	}
+}
+
+void compare_rope_and_flat() {
+	char buf[200];
+	memset(buf, 'x', 199);
+	buf[199] = '\0';
+	s = String_new(&heap_allocator, buf);
+	String *y = String_new(&heap_allocator, "y");
+	t = String_add(&heap_allocator, s, y);
+	String_free(y);
+	assert_true(String_lt(s, t));
+	assert_true(String_le(s, t));
+	assert_true(String_gt(t, s));
+	assert_true(String_ge(t, t));
+	assert_true(String_neq(s, t));
+	String *d = String_dup(&heap_allocator, t);
+	assert_true(String_eq(d, t));
+	assert_false(String_is_rope(d));
+	String_free(d);
+}
+
+void arena_strings() {
+	Allocator *a = arena_new(1024);
+	String *r = String_new(a, "");
+	for (int i = 0; i < 1000; i++) {
+		String *c = String_from_int(a, i);
+		String *u = String_add(a, r, c);
+		String_free(c);	// back on the arena's free lists
+		String_free(r);
+		r = u;
+	}
+	assert_equal(2890, String_len(r));
+	assert_equal(0, strncmp("0123456789101112", String_str(r), 16));
+	assert_true(a->allocations > 1000);
+	a->release(a);
+	String *big = String_alloc(a, 4096); // bigger than a chunk
+	String *small = String_new(a, "ok");
+	assert_str_equal("ok", String_str(small));
+	assert_equal(4096, String_len(big));
+	a->destroy(a);
+}
+
+/* what a VM that frees its strings does in a loop: freed blocks are used
+ * again, so the arena stops growing once the loop is warm
+ */
+void arena_reuses_freed() {
+	Allocator *a = arena_new(1024);
+	char buf[ROPE_MIN_LENGTH*4];
+	memset(buf, 'x', sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	size_t warm = 0;
+	for (int i = 0; i < 100000; i++) {
+		String *x = String_new(a, "hello ");
+		String *y = String_new(a, (i % 3) == 0 ? buf : "world");	// some bigger than a chunk
+		String *z = String_add(a, x, y);
+		String_str(z);	// flatten ropes too
+		String_free(x);
+		String_free(y);
+		String_free(z);
+		if ( i == 100 ) warm = arena_footprint(a);
+	}
+	assert_true(warm > 0);
+	assert_equal(warm, arena_footprint(a));
+	a->destroy(a);
+}
+
+static int sign(int x) { return (x > 0) - (x < 0); }
+
+/* every kernel level this CPU has must agree with strcmp() */
+void kernels_match_strcmp() {
+	char a[300], b[300];
+	for (sk_level l = SK_SCALAR; l <= SK_AVX2; l++) {
+		if ( !sk_use(l) ) continue;
+		for (int n = 0; n < 200; n += 7) {
+			for (int diff = 0; diff <= n; diff += 3) {
+				for (int i = 0; i < n; i++) a[i] = b[i] = (char)('a' + i % 26);
+				a[n] = b[n] = '\0';
+				if ( diff < n ) b[diff] = (char)0xE9; // high bit set: compare unsigned like strcmp
+				assert_equal(sign(strcmp(a, b)), sign(sk_cmp(a, n, b, n)));
+				assert_equal(strcmp(a, b) == 0, sk_eq(a, n, b, n));
+				assert_equal(sign(strcmp(a, b)), sign(-sk_cmp(b, n, a, n)));
+				if ( n > 0 ) assert_equal(sign(strcmp(a, b + 1)), sign(sk_cmp(a, n, b + 1, n - 1)));
+			}
+		}
+	}
+	if ( !sk_use(SK_AVX2) ) sk_use(SK_SSE2);
+}
+
+void kernel_itoa() {
+	int values[] = {0, 7, -7, 10, 99, 100, -100, 12345, 2147483647, -2147483647-1};
+	char buf[12], expected[12];
+	for (int i = 0; i < sizeof(values)/sizeof(values[0]); i++) {
+		sprintf(expected, "%d", values[i]);
+		assert_equal(strlen(expected), sk_itoa(values[i], buf));
+		assert_str_equal(expected, buf);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	c_unit_setup = setup;
+	c_unit_teardown = teardown;
+
+	test(short_add_is_flat);
+	test(long_add_is_rope);
+	test(build_in_loop);
+	test(compare_rope_and_flat);
+	test(arena_strings);
+	test(arena_reuses_freed);
+	test(kernels_match_strcmp);
+	test(kernel_itoa);
+
+	return c_unit_fails;
+}